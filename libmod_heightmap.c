@@ -11,7 +11,20 @@
 #include <GL/glew.h>
 #include <inttypes.h>  
 #include "tex_format.h"
+#include "terrain_format.h"
 #include <limits.h> 
+#include <strings.h>
+#include <setjmp.h>
+#include <png.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #define max(a,b) ((a) > (b) ? (a) : (b))  
 #define min(a,b) ((a) < (b) ? (a) : (b))  
@@ -134,11 +147,19 @@ typedef struct {
     int billboard_type;  // NUEVO CAMPO  
 } VOXEL_BILLBOARD;
 
-typedef struct {  
-    uint32_t final_color;  // Color final con transparencia aplicada  
-    uint8_t has_water;     // 1 si hay agua, 0 si no  
-    float water_depth;     // Profundidad del agua para efectos  
-} PRECALC_WATER_DATA;  
+// Campo de oleaje de la ventana visible, recalculado una vez por tick de agua.
+// Las tres ondas dependen solo de x, de y y de x + y, así que el campo por
+// texel se guarda como tres tablas 1D en lugar de una matriz completa.
+typedef struct {
+    float *wave_x;         // Onda que depende de x, por columna de texels
+    float *wave_y;         // Onda que depende de y, por fila de texels
+    float *wave_xy;        // Onda que depende de x + y
+    int origin_x, origin_y;
+    int size_x, size_y, size_xy;
+    int capacity_x, capacity_y, capacity_xy;
+    float time, level, amplitude;   // Estado con el que se calcularon
+    int valid;
+} PRECALC_WATER_DATA;
 
 // Estructura temporal para ordenamiento de billboards  
 typedef struct {  
@@ -147,6 +168,13 @@ typedef struct {
     GRAPH *graph;  
     float distance;  
 } BILLBOARD_RENDER_DATA;
+
+// Billboard activo con su GRAPH ya resuelto: se reúne una vez por frame y se
+// proyecta en cada vista
+typedef struct {
+    VOXEL_BILLBOARD *billboard;
+    GRAPH *graph;
+} BILLBOARD_SOURCE;
   
 
 // Variables para textura del cielo  
@@ -162,7 +190,6 @@ static GRAPH* bridge_texture = NULL;
 static float bridge_height_offset = 5.0f; // Altura adicional para puentes  
 
 
-static PRECALC_WATER_DATA *precalc_water = NULL;
 // Variables globales para el sistema de texturas de agua  
 static GRAPH *water_texture = NULL;  
 static int64_t water_texture_id = 0;  
@@ -178,10 +205,6 @@ static int static_billboard_count = 0;
 static int dynamic_billboard_count = 0;  
 
 static int current_heightmap_id = 0; 
-static float *fog_table = NULL;      
-static int fog_table_size = 0;      
-static int fog_table_initialized = 0;   
-
 static float cached_fog_intensity = -1.0f;  
 static Uint8 cached_fog_r = 0, cached_fog_g = 0, cached_fog_b = 0;
 
@@ -190,7 +213,6 @@ static BGD_SHADER *voxel_shader = NULL;
 static BGD_SHADER_PARAMETERS *voxel_params = NULL;  
 static BGD_SHADER *sector_shader = NULL;  
 static BGD_SHADER_PARAMETERS *sector_params = NULL;
-static GRAPH *render_buffer = NULL;
 
 
 #define BILLBOARD_TYPE_STATIC     0  
@@ -216,22 +238,11 @@ static float calculated_bridge_height = -1.0f;
 #define RGBA32_A(color) ((color >> 24) & 0xFF)
 
 // Variables globales para configuración de renderizado
-static float max_render_distance = 12000.0f;
 static int chunk_size = 512;
 static int chunk_radius = 15;
 
-// Variables globales para el color del cielo
-static Uint8 sky_color_r = 135; // Azul cielo por defecto
-static Uint8 sky_color_g = 206;
-static Uint8 sky_color_b = 235;
-static Uint8 sky_color_a = 255; // Alpha del cielo
-
 // Variables para niebla mejorada  
 static float fog_vertical_gradient = 0.5f;  
-static Uint8 fog_color_r = 200;  
-static Uint8 fog_color_g = 200;   
-static Uint8 fog_color_b = 200;  
-static float fog_intensity = 0.0f;
 
 
 // Variables globales para el color y la transparencia del agua
@@ -257,15 +268,156 @@ void gr_alpha_put_pixel(GRAPH *dest, int x, int y, uint32_t color, uint8_t alpha
 GRAPH *get_tex_image(int index);
 
 HEIGHTMAP heightmaps[MAX_HEIGHTMAPS];
-CAMERA_3D camera = {0, 0, 0, 0, 0, DEFAULT_FOV, DEFAULT_NEAR, DEFAULT_FAR};
 int64_t next_heightmap_id = 1;
 float water_level = -1.0f;
 int light_intensity = 255;
 static WLD_Map wld_map = {0};
 
-// Dimensiones configurables del render buffer  
-static int current_render_width = 320;  
-static int current_render_height = 240;
+// ============================================================================
+// CONTEXTOS DE RENDER
+// ============================================================================
+// Cada vista (pantalla principal, minimapa, retrovisor, miniaturas...) es un
+// contexto con su propia cámara, buffer de salida, configuración y cachés. Las
+// funciones exportadas actúan sobre el contexto activo (HEIGHTMAP_SELECT_CONTEXT);
+// el 0 es el contexto por defecto y existe siempre. El render CPU recibe el
+// contexto de forma explícita y no toca el activo. Los mapas, texturas, agua y
+// billboards son del mundo y se comparten entre todos los contextos.
+
+#define MAX_RENDER_CONTEXTS 16
+
+// Tramo de terreno ya dibujado, guardado para la reproyección temporal
+typedef struct {
+    int16_t y_start, y_end;
+    uint32_t color;
+    float distance;
+} TERRAIN_SPAN;
+
+// Profundidad de una columna: el terreno de un heightfield es monótono por
+// columna, así que basta con la lista de tramos [y_start, y_end) a distancia
+// creciente (de abajo arriba). Por encima del último tramo solo hay cielo.
+typedef struct {
+    int16_t y_start, y_end;
+    float distance;
+} HORIZON_SPAN;
+
+// Todo lo que, si cambia, invalida la historia de reproyección
+typedef struct {
+    const HEIGHTMAP *hm;
+    const uint16_t *height_cache;
+    const TERRAIN_TEXEL *texel_cache;
+    float camera_x, camera_y, camera_z, camera_pitch;
+    float max_distance, fog_intensity, water_level, wave_amplitude;
+    int width, height, quality_step, ray_traversal;
+    int chunk_size, chunk_radius;
+    int fog_r, fog_g, fog_b, light;
+    float lod_error, step_scale;
+} REPROJECTION_KEY;
+
+typedef struct {
+    int64_t id;
+    CAMERA_3D camera;
+
+    // Salida y configuración de la vista
+    GRAPH *render_buffer;
+    int render_width, render_height;     // HEIGHTMAP_SET_RENDER_RESOLUTION
+    float max_render_distance;
+    Uint8 sky_color_r, sky_color_g, sky_color_b, sky_color_a;
+    Uint8 fog_color_r, fog_color_g, fog_color_b;
+    float fog_intensity;
+    float lod_pixel_error;
+    float march_step_scale;              // Multiplicador del paso (gobernador de frame)
+    int reprojection_enabled;
+    int interlace_enabled;
+
+    // Buffers por píxel y por columna del render CPU
+    HORIZON_SPAN *horizon_spans;
+    int *horizon_count;
+    uint32_t *span_colors;
+    uint8_t *span_fog;
+    float *cos_cache, *sin_cache;
+    int buffer_width, buffer_height;
+    int *march_columns;
+    int march_columns_size;
+    float last_camera_x, last_camera_y, last_camera_angle;
+    float cached_water_time;
+    int water_frame_counter;
+
+    // Tablas que dependen de la distancia, la niebla o la resolución
+    float *fog_table;                    // Alpha de billboards por distancia
+    int fog_table_size;
+    int fog_table_initialized;
+    uint8_t *fog_lut;                    // Ver build_fog_lut
+    int fog_lut_size;
+    float fog_lut_distance, fog_lut_intensity, fog_lut_visible_from;
+    float *march_distances;              // Ver build_march_distances
+    int march_count;
+    float march_table_distance, march_table_footprint, march_table_error, march_table_scale;
+    int *sky_texel_x, *sky_texel_y;      // Ver build_sky_tables
+    int sky_table_width, sky_table_height;
+    int sky_tables_valid;
+    float sky_table_angle, sky_table_pitch;
+    GRAPH *sky_table_texture;
+    int64_t sky_table_code;
+    int sky_table_tex_width, sky_table_tex_height;
+    PRECALC_WATER_DATA water;            // Oleaje de la ventana de chunks de esta vista
+
+    // Reproyección y entrelazado: doble buffer, [history_current] se escribe en este frame
+    int reprojection_valid;
+    REPROJECTION_KEY reprojection_key;
+    float reprojection_base_angle;
+    TERRAIN_SPAN *history_spans[2];
+    int *history_count[2];
+    float *history_angle[2];
+    uint8_t *history_water[2];
+    int history_current;
+    int history_width, history_height;
+    int interlace_field;
+    int interlace_history_ok;            // La historia es del mismo terreno y configuración
+    int interlace_weight;                // Peso 0-256 de la interpolación espacial
+
+    // Gobernador de presupuesto de frame
+    float frame_budget_ms;               // 0 = gobernador desactivado
+    int governor_max_level;
+    int governor_level;
+    int governor_settle;
+    int governor_slack_frames;
+    float governor_average_ms;
+    GRAPH *governor_output;              // Salida reescalada al tamaño del usuario
+    int *governor_scale_x;               // Columna de origen de cada columna de salida
+    int governor_scale_width, governor_scale_source;
+} RENDER_CONTEXT;
+
+static RENDER_CONTEXT default_context;
+static RENDER_CONTEXT *render_contexts[MAX_RENDER_CONTEXTS] = { &default_context };
+static RENDER_CONTEXT *active_context = &default_context;
+
+// Campo de agua de la unión de ventanas de un render en lote (HEIGHTMAP_RENDER_VIEWS)
+static PRECALC_WATER_DATA batch_water;
+
+// Valores iniciales de un contexto: los que tenían las antiguas variables globales
+static void render_context_init(RENDER_CONTEXT *ctx, int64_t id) {
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->id = id;
+    ctx->camera = (CAMERA_3D){0, 0, 0, 0, 0, DEFAULT_FOV, DEFAULT_NEAR, DEFAULT_FAR};
+    ctx->render_width = 320;
+    ctx->render_height = 240;
+    ctx->max_render_distance = 12000.0f;
+    ctx->sky_color_r = 135;   // Azul cielo por defecto
+    ctx->sky_color_g = 206;
+    ctx->sky_color_b = 235;
+    ctx->sky_color_a = 255;
+    ctx->fog_color_r = ctx->fog_color_g = ctx->fog_color_b = 200;
+    ctx->march_step_scale = 1.0f;
+    ctx->march_table_distance = ctx->march_table_footprint = -1.0f;
+    ctx->march_table_error = ctx->march_table_scale = -1.0f;
+    ctx->fog_lut_distance = ctx->fog_lut_intensity = -1.0f;
+    ctx->interlace_weight = 256;
+}
+
+// Factor entre la resolución interna actual y la de referencia (240 filas)
+static inline float render_resolution_scale(const RENDER_CONTEXT *ctx) {
+    return ctx->render_height / PROJECTION_REFERENCE_HEIGHT;
+}
 
 //-------------------------------------
 static float mouse_sensitivity = 50.0f;
@@ -277,6 +429,12 @@ static void **wld_fpg_grf = NULL;
 
 float get_height_at(HEIGHTMAP *hm, float x, float y);
 void build_height_cache(HEIGHTMAP *hm);
+static void build_height_pyramid(HEIGHTMAP *hm);
+static void free_height_pyramid(HEIGHTMAP *hm);
+static int build_texel_cache(HEIGHTMAP *hm);
+static void free_texel_cache(HEIGHTMAP *hm);
+static int texel_layout_set(HEIGHTMAP *hm, int brick);
+static void free_texel_layout(HEIGHTMAP *hm);
 void clamp_camera_to_terrain(HEIGHTMAP *hm);
 void clamp_camera_to_bounds(HEIGHTMAP *hm);
 uint32_t get_texture_color_bilinear(GRAPH *texture, float x, float y);
@@ -285,9 +443,30 @@ static HEIGHTMAP* find_heightmap_by_id(int64_t hm_id);
 static int apply_terrain_collision(HEIGHTMAP *hm, float new_x, float new_y);  
 static int move_camera_with_collision(int64_t hm_id, float angle_offset, float speed_factor, float speed);
 static float convert_screen_to_world_coordinate(int heightmap_id, float screen_coord, int is_x_axis);
-static void collect_visible_billboards_from_array(VOXEL_BILLBOARD *billboard_array, int array_size,   
+static void collect_visible_billboards_from_array(const RENDER_CONTEXT *ctx, VOXEL_BILLBOARD *billboard_array, int array_size,   
                                                   BILLBOARD_RENDER_DATA *visible_billboards,   
                                                   int *visible_count, float terrain_fov);
+static int gather_billboard_sources(BILLBOARD_SOURCE *sources);
+static int project_billboard_sources(const RENDER_CONTEXT *ctx, const BILLBOARD_SOURCE *sources, int source_count,
+                                     BILLBOARD_RENDER_DATA *visible_billboards, float terrain_fov);
+static void render_pool_shutdown(void);
+static void reprojection_invalidate(void);
+static void free_billboard_sprites(void);
+static void free_sky_tables(RENDER_CONTEXT *ctx);
+static void render_context_free(RENDER_CONTEXT *ctx);
+static void free_water_field(PRECALC_WATER_DATA *field);
+static int load_heights_16(const char *filename, uint16_t **heights, int64_t *width, int64_t *height);
+static GRAPH *height_preview_graph(const uint16_t *heights, int64_t width, int64_t height, int bits);
+static void height_cache_ready(HEIGHTMAP *hm);
+static int has_extension(const char *filename, const char *extension);
+static void free_height_cache(HEIGHTMAP *hm);
+static void free_terrain_file(HEIGHTMAP *hm);
+static int64_t load_terrain_file(const char *filename);
+static GRAPH *heightmap_graph(HEIGHTMAP *hm);
+static void terrain_pager_begin(HEIGHTMAP *hm);
+static void terrain_pager_require(HEIGHTMAP *hm, int x0, int y0, int x1, int y1);
+static void terrain_pager_reset(HEIGHTMAP *hm);
+static void terrain_pager_free(HEIGHTMAP *hm);
 extern int64_t libmod_heightmap_load_wld(INSTANCE *my, int64_t *params);
 extern int64_t libmod_heightmap_render_wld_2d(INSTANCE *my, int64_t *params);
 extern int64_t libmod_heightmap_test_render_buffer(INSTANCE *my, int64_t *params);
@@ -352,9 +531,9 @@ static void cleanup_gpu_resources(void) {
       
 }
 void libmod_heightmap_destroy_render_buffer() {  
-    if (render_buffer) {  
-        bitmap_destroy(render_buffer);  
-        render_buffer = NULL;  
+    if (active_context->render_buffer) {  
+        bitmap_destroy(active_context->render_buffer);  
+        active_context->render_buffer = NULL;  
     }  
 }
 
@@ -365,6 +544,9 @@ void __bgdexport(libmod_heightmap, module_initialize)()
     memset(dynamic_billboards, 0, sizeof(dynamic_billboards));          
     static_billboard_count = 0;          
     next_heightmap_id = 1;          
+    render_context_init(&default_context, 0);
+    render_contexts[0] = &default_context;
+    active_context = &default_context;
             
     for (int i = 0; i < MAX_HEIGHTMAPS; i++) {          
         heightmaps[i].id = 0;          
@@ -385,11 +567,12 @@ void __bgdexport(libmod_heightmap, module_finalize)()
         if (heightmaps[i].type == MAP_TYPE_HEIGHTMAP)              
         {              
             // Liberar el cache de altura si existe              
-            if (heightmaps[i].height_cache)              
-            {              
-                free(heightmaps[i].height_cache);              
-                heightmaps[i].height_cache = NULL;              
-            }            
+            terrain_pager_free(&heightmaps[i]);
+            free_height_cache(&heightmaps[i]);
+            free_height_pyramid(&heightmaps[i]);
+            free_texel_cache(&heightmaps[i]);
+            free_texel_layout(&heightmaps[i]);
+            free_terrain_file(&heightmaps[i]);
     
             // Destruir el GRAPH del heightmap principal              
             if (heightmaps[i].heightmap)      
@@ -407,18 +590,24 @@ void __bgdexport(libmod_heightmap, module_finalize)()
         }        
     }  // <-- CERRAR BUCLE AQUÍ    
               
+    // Detener los hilos del render CPU y liberar las vistas
+    render_pool_shutdown();
+    for (int i = 0; i < MAX_RENDER_CONTEXTS; i++) {
+        if (!render_contexts[i])
+            continue;
+        render_context_free(render_contexts[i]);
+        if (render_contexts[i] != &default_context)
+            free(render_contexts[i]);
+        render_contexts[i] = NULL;
+    }
+    render_contexts[0] = &default_context;
+    active_context = &default_context;
+    free_water_field(&batch_water);
+    free_billboard_sprites();
+
     // Limpiar recursos GPU (UNA SOLA VEZ)      
     cleanup_gpu_resources();          
               
-    // Liberar el render_buffer global una sola vez              
-    libmod_heightmap_destroy_render_buffer();              
-              
-    // Liberar el fog_table global si existe              
-    if (fog_table) {              
-        free(fog_table);              
-        fog_table = NULL;              
-    }            
-                
     // Limpiar la estructura global heightmaps              
     memset(heightmaps, 0, sizeof(heightmaps));              
 }
@@ -440,24 +629,40 @@ int64_t libmod_heightmap_set_water_level(INSTANCE *my, int64_t *params)
     return 1;
 }
 
-/* Cargar mapa de altura desde archivo */
-/* Cargar mapa de altura desde archivo */  
-int64_t libmod_heightmap_load(INSTANCE *my, int64_t *params)  
-{  
-    const char *filename = string_get(params[0]);  
-    int64_t map_id = gr_load_img(filename);  
-    string_discard(params[0]);  
-  
-    if (!map_id)  
-        return 0;  
-    GRAPH *graph = bitmap_get(0, map_id);  
-    if (!graph)  
-        return 0;  
+/* Cargar mapa de altura desde archivo. rg_encoded: rojo = byte alto y verde = byte bajo */
+static int64_t load_heightmap_file(const char *filename, int rg_encoded)
+{
+    uint16_t *heights = NULL;
+    int64_t width = 0, height = 0;
+    GRAPH *graph = NULL;
+
+    if (has_extension(filename, ".hmt"))
+        return load_terrain_file(filename);
+
+    // .r16 y PNG de 16 bits tienen más precisión de la que conserva gr_load_img
+    int status = rg_encoded ? 0 : load_heights_16(filename, &heights, &width, &height);
+    if (status < 0)
+        return 0;
+
+    if (status > 0) {
+        graph = height_preview_graph(heights, width, height, 16);
+        if (!graph) {
+            free(heights);
+            return 0;
+        }
+    } else {
+        int64_t map_id = gr_load_img(filename);
+        if (!map_id)
+            return 0;
+        graph = bitmap_get(0, map_id);
+        if (!graph)
+            return 0;
+    }
   
     int slot = -1;  
     for (int i = 0; i < MAX_HEIGHTMAPS; i++)  
     {  
-        if (!heightmaps[i].heightmap)  
+        if (!heightmaps[i].heightmap && !heightmaps[i].file_data)  
         {  
             slot = i;  
             break;  
@@ -466,12 +671,14 @@ int64_t libmod_heightmap_load(INSTANCE *my, int64_t *params)
   
     if (slot == -1) {    
         fprintf(stderr, "Error: MAX_HEIGHTMAPS (%d) alcanzado\n", MAX_HEIGHTMAPS);    
+        free(heights);
         return 0;    
     }    
       
     // Verificar que next_heightmap_id no desborde    
     if (next_heightmap_id >= INT64_MAX - 1) {    
         fprintf(stderr, "Error: next_heightmap_id overflow\n");    
+        free(heights);
         return 0;    
     }  
   
@@ -482,12 +689,70 @@ int64_t libmod_heightmap_load(INSTANCE *my, int64_t *params)
     heightmaps[slot].width = graph->width;  
     heightmaps[slot].height = graph->height;  
     heightmaps[slot].height_cache = NULL;  
+    heightmaps[slot].height_scale = 0.0f;
+    heightmaps[slot].height_offset = 0.0f;
+    heightmaps[slot].height_bits = (heights || rg_encoded) ? 16 : 8;
     heightmaps[slot].cache_valid = 0;  
-    build_height_cache(&heightmaps[slot]);  
+
+    if (heights) {
+        // Los cargadores de 16 bits entregan las alturas por filas
+        if (!texel_layout_set(&heightmaps[slot], TEXEL_LAYOUT_ROWS)) {
+            free(heights);
+            bitmap_destroy(graph);
+            memset(&heightmaps[slot], 0, sizeof(HEIGHTMAP));
+            return 0;
+        }
+        heightmaps[slot].height_cache = heights;
+        height_cache_ready(&heightmaps[slot]);
+    } else {
+        build_height_cache(&heightmaps[slot]);  
+    }
   
     return heightmaps[slot].id;  
 }
 
+int64_t libmod_heightmap_load(INSTANCE *my, int64_t *params)  
+{  
+    const char *filename = string_get(params[0]);  
+    int64_t id = load_heightmap_file(filename, 0);
+    string_discard(params[0]);  
+    return id;
+}
+
+/* Cargar mapa de altura de 16 bits codificado en los canales rojo (byte alto) y verde (byte bajo) */
+int64_t libmod_heightmap_load_rg(INSTANCE *my, int64_t *params)
+{
+    const char *filename = string_get(params[0]);
+    int64_t id = load_heightmap_file(filename, 1);
+    string_discard(params[0]);
+    return id;
+}
+
+/* Rango de alturas del mapa: el valor cuantizado mínimo se convierte en min y el máximo en max */
+int64_t libmod_heightmap_set_height_range(INSTANCE *my, int64_t *params)
+{
+    HEIGHTMAP *hm = find_heightmap_by_id(params[0]);
+    float min_height = *(float *)&params[1];
+    float max_height = *(float *)&params[2];
+
+    if (!hm || !hm->cache_valid)
+        return 0;
+    if (!(max_height > min_height)) {
+        fprintf(stderr, "Error: la altura máxima debe ser mayor que la mínima\n");
+        return 0;
+    }
+
+    hm->height_offset = min_height;
+    hm->height_scale = (max_height - min_height) / (float)((1 << hm->height_bits) - 1);
+
+    // La pirámide y el sombreado por altura dependen de la escala; los texels
+    // se vuelven a sombrear en su sitio porque pueden ser la única copia de las alturas
+    reprojection_invalidate();
+    build_height_pyramid(hm);
+    if ((hm->texel_cache || hm->pager) && !build_texel_cache(hm))
+        return 0;
+    return 1;
+}
 
 /* Crear mapa de altura en memoria */
 int64_t libmod_heightmap_create(INSTANCE *my, int64_t *params)
@@ -502,7 +767,7 @@ int64_t libmod_heightmap_create(INSTANCE *my, int64_t *params)
     int slot = -1;
     for (int i = 0; i < MAX_HEIGHTMAPS; i++)
     {
-        if (!heightmaps[i].heightmap)
+        if (!heightmaps[i].heightmap && !heightmaps[i].file_data)
         {
             slot = i;
             break;
@@ -548,11 +813,12 @@ int64_t libmod_heightmap_unload(INSTANCE *my, int64_t *params)
     {  
         if (heightmaps[i].id == hm_id)  
         {  
-            if (heightmaps[i].height_cache)  
-            {  
-                free(heightmaps[i].height_cache);  
-                heightmaps[i].height_cache = NULL;  
-            }  
+            terrain_pager_free(&heightmaps[i]);
+            free_height_cache(&heightmaps[i]);
+            free_height_pyramid(&heightmaps[i]);
+            free_texel_cache(&heightmaps[i]);
+            free_texel_layout(&heightmaps[i]);
+            free_terrain_file(&heightmaps[i]);
   
             // Destruir correctamente la estructura GRAPH  
             if (heightmaps[i].heightmap)  
@@ -591,6 +857,56 @@ if (hm) {
 return 0;
 }
 
+// Altura en unidades del mundo de un valor cuantizado (o interpolado entre varios)
+static inline float height_dequantize(const HEIGHTMAP *hm, float value) {
+    return hm->height_offset + value * hm->height_scale;
+}
+
+// Posición del texel (x, y) en height_cache y texel_cache, sea cual sea la disposición
+static inline size_t texel_index(const HEIGHTMAP *hm, int x, int y) {
+    return (size_t)hm->texel_x[x] + hm->texel_y[y];
+}
+
+// Alturas de un mapa .hmt tal como están en el fichero, por filas
+static inline const uint16_t *terrain_file_heights(const HEIGHTMAP *hm) {
+    const TERRAIN_FILE_HEADER *header = (const TERRAIN_FILE_HEADER *)hm->file_data;
+    return (const uint16_t *)(hm->file_data + header->heights_offset);
+}
+
+// get_height_at sobre texel_cache: cada registro trae su altura y la de la
+// derecha, así que las cuatro esquinas salen de dos lecturas
+static inline float texel_height_at(const HEIGHTMAP *hm, float x, float y) {
+    int ix = (int)x;
+    int iy = (int)y;
+
+    if (ix < 0 || ix >= hm->width - 1 || iy < 0 || iy >= hm->height - 1)
+        return 0;
+
+    float fx = x - ix;
+    float fy = y - iy;
+
+    size_t column = hm->texel_x[ix];
+    const TERRAIN_TEXEL *top = &hm->texel_cache[column + hm->texel_y[iy]];
+    const TERRAIN_TEXEL *bottom = &hm->texel_cache[column + hm->texel_y[iy + 1]];
+    float h00 = top->height;
+    float h10 = top->height_right;
+    float h01 = bottom->height;
+    float h11 = bottom->height_right;
+
+    float h0 = h00 + fx * (h10 - h00);
+    float h1 = h01 + fx * (h11 - h01);
+    float h = h0 + fy * (h1 - h0);
+
+    return height_dequantize(hm, h);
+}
+
+// Altura cuantizada del texel (x, y) de un mapa sin paginar, esté aún en
+// height_cache o ya solo en texel_cache
+static inline uint16_t texel_height_value(const HEIGHTMAP *hm, int x, int y) {
+    size_t index = texel_index(hm, x, y);
+    return hm->height_cache ? hm->height_cache[index] : hm->texel_cache[index].height;
+}
+
 float get_height_at(HEIGHTMAP *hm, float x, float y) {    
     // Código original para heightmaps tradicionales    
     if (!hm->cache_valid)    
@@ -605,16 +921,32 @@ float get_height_at(HEIGHTMAP *hm, float x, float y) {
     float fx = x - ix;    
     float fy = y - iy;    
     
-    float h00 = hm->height_cache[iy * hm->width + ix];    
-    float h10 = hm->height_cache[iy * hm->width + (ix + 1)];    
-    float h01 = hm->height_cache[(iy + 1) * hm->width + ix];    
-    float h11 = hm->height_cache[(iy + 1) * hm->width + (ix + 1)];    
+    // Mapas propios con texel_cache: las alturas ya solo están en sus registros
+    if (!hm->height_cache && !hm->pager)
+        return texel_height_at(hm, x, y);
+
+    // Se interpola en valores cuantizados y se convierte una sola vez al final
+    const uint16_t *cache = hm->height_cache;
+    size_t x0 = hm->texel_x[ix], x1 = hm->texel_x[ix + 1];
+    size_t y0 = hm->texel_y[iy], y1 = hm->texel_y[iy + 1];
+    if (hm->pager) {
+        // Paginado no hay height_cache: el fichero tiene todas las alturas
+        cache = terrain_file_heights(hm);
+        x0 = ix;
+        x1 = ix + 1;
+        y0 = (size_t)iy * hm->width;
+        y1 = y0 + hm->width;
+    }
+    float h00 = cache[x0 + y0];
+    float h10 = cache[x1 + y0];
+    float h01 = cache[x0 + y1];
+    float h11 = cache[x1 + y1];
     
     float h0 = h00 + fx * (h10 - h00);    
     float h1 = h01 + fx * (h11 - h01);    
     float h = h0 + fy * (h1 - h0);    
     
-    return h;    
+    return height_dequantize(hm, h);
 }
 
 
@@ -624,21 +956,21 @@ int64_t libmod_heightmap_set_camera(INSTANCE *my, int64_t *params)
     fprintf(stderr, "DEBUG SET_CAMERA: params[0]=%lld params[1]=%lld params[2]=%lld\n",   
             params[0], params[1], params[2]);  
       
-    camera.x = (float)params[0];  
-    camera.y = (float)params[1];  
-    camera.z = (float)params[2];  
-    camera.angle = (float)params[3] / 1000.0f;  
-    camera.pitch = (float)params[4] / 1000.0f;  
-    camera.fov = (params[5] > 0) ? (float)params[5] : DEFAULT_FOV;  
+    active_context->camera.x = (float)params[0];  
+    active_context->camera.y = (float)params[1];  
+    active_context->camera.z = (float)params[2];  
+    active_context->camera.angle = (float)params[3] / 1000.0f;  
+    active_context->camera.pitch = (float)params[4] / 1000.0f;  
+    active_context->camera.fov = (params[5] > 0) ? (float)params[5] : DEFAULT_FOV;  
       
     fprintf(stderr, "DEBUG SET_CAMERA: camera.x=%.2f camera.y=%.2f camera.z=%.2f\n",  
-            camera.x, camera.y, camera.z);  
+            active_context->camera.x, active_context->camera.y, active_context->camera.z);  
   
     const float max_pitch = M_PI_2 * 0.99f;  
-    if (camera.pitch > max_pitch)  
-        camera.pitch = max_pitch;  
-    if (camera.pitch < -max_pitch)  
-        camera.pitch = -max_pitch;  
+    if (active_context->camera.pitch > max_pitch)  
+        active_context->camera.pitch = max_pitch;  
+    if (active_context->camera.pitch < -max_pitch)  
+        active_context->camera.pitch = -max_pitch;  
   
     return 1;  
 }
@@ -675,6 +1007,10 @@ int64_t libmod_heightmap_load_texture(INSTANCE *my, int64_t *params)
         return 0;
 
     hm->texturemap = graph;
+
+    // Precalcular los colores del terreno con la nueva textura
+    if (!build_texel_cache(hm))
+        return 0;
     return 1;
 }
 
@@ -694,89 +1030,287 @@ int64_t libmod_heightmap_set_sky_texture(INSTANCE *my, int64_t *params)
       
     sky_texture = bitmap_get(0, map_id);  
     if (!sky_texture) return 0;  
+    for (int i = 0; i < MAX_RENDER_CONTEXTS; i++) {
+        if (render_contexts[i])
+            free_sky_tables(render_contexts[i]);
+    }
       
     sky_texture_scale = scale;  
     return 1;  
 }
- 
-// Función auxiliar para samplear la textura del cielo con proyección esférica corregida  
-static uint32_t sample_sky_texture(float screen_x, float screen_y, float camera_angle, float camera_pitch, float time) {      
-    if (!sky_texture) {      
-        return SDL_MapRGBA(gPixelFormat, sky_color_r, sky_color_g, sky_color_b, sky_color_a);      
-    }      
-          
-    float terrain_fov = 0.1f;    
-    float fov_horizontal = terrain_fov;      
-    float fov_vertical = terrain_fov * 0.75f;    
-      
-    // CORREGIDO: Usar dimensiones dinámicas  
-    float half_width = current_render_width / 2.0f;  
-    float half_height = current_render_height / 2.0f;  
-      
-    float ray_angle_h = ((screen_x - half_width) / (float)current_render_width) * fov_horizontal;      
-    float ray_angle_v = ((screen_y - half_height) / (float)current_render_height) * fov_vertical;  
-          
-    float world_angle_h = camera_angle + ray_angle_h;      
-    float world_angle_v = camera_pitch + ray_angle_v;      
-          
-    float u = (world_angle_h + M_PI) / (2.0f * M_PI);      
-    float v = (world_angle_v + M_PI_2) / M_PI;      
-          
-    if (u < 0.0f) u = 0.0f;      
-    if (u > 1.0f) u = 1.0f;      
-    if (v < 0.0f) v = 0.0f;      
-    if (v > 1.0f) v = 1.0f;      
-          
-    int tex_x = (int)(u * sky_texture->width) % sky_texture->width;      
-    int tex_y = (int)(v * sky_texture->height) % sky_texture->height;      
-          
-    return gr_get_pixel(sky_texture, tex_x, tex_y);      
+
+// ============================================================================
+// ESCRITURA DIRECTA DE TRAMOS EN EL GRAPH DESTINO
+// ============================================================================
+// Los renderers CPU (terreno, cielo, WLD) escriben columnas y filas completas.
+// En lugar de llamar a gr_put_pixel por cada píxel se escribe directamente en
+// surface->pixels usando el pitch. Requiere 32 bpp; si no, se usa gr_put_pixel.
+// Los rangos se recortan contra el tamaño real del GRAPH, igual que gr_put_pixel.
+
+static inline int span_direct_ok(GRAPH *dst) {
+    return dst && dst->surface && dst->surface->pixels && gPixelFormat->BytesPerPixel == 4;
+}
+
+// Avance en píxeles (no en bytes) entre dos filas
+static inline int span_stride(GRAPH *dst) {
+    return dst->surface->pitch / 4;
+}
+
+static inline uint32_t *span_pixel_ptr(GRAPH *dst, int x, int y) {
+    return (uint32_t *)((uint8_t *)dst->surface->pixels + (size_t)y * dst->surface->pitch) + x;
+}
+
+// Recorta el tramo vertical [*y_start, *y_end) de la columna x. Devuelve 0 si queda vacío.
+static inline int span_clip_column(GRAPH *dst, int x, int *y_start, int *y_end) {
+    if (x < 0 || x >= dst->width)
+        return 0;
+    if (*y_start < 0)
+        *y_start = 0;
+    if (*y_end > dst->height)
+        *y_end = (int)dst->height;
+    return *y_start < *y_end;
+}
+
+// Marca el GRAPH para que BennuGD2 vuelva a subir la textura
+static inline void span_mark_dirty(GRAPH *dst) {
+    if (dst)
+        dst->texture_must_update = 1;
+}
+
+static void span_fill_column(GRAPH *dst, int x, int y_start, int y_end, uint32_t color) {
+    if (!dst || !span_clip_column(dst, x, &y_start, &y_end))
+        return;
+
+    if (!span_direct_ok(dst)) {
+        for (int y = y_start; y < y_end; y++)
+            gr_put_pixel(dst, x, y, color);
+        return;
+    }
+
+    int stride = span_stride(dst);
+    uint32_t *pixel = span_pixel_ptr(dst, x, y_start);
+    for (int y = y_start; y < y_end; y++, pixel += stride)
+        *pixel = color;
+}
+
+static void span_fill_row(GRAPH *dst, int x_start, int x_end, int y, uint32_t color) {
+    if (!dst || y < 0 || y >= dst->height)
+        return;
+    if (x_start < 0)
+        x_start = 0;
+    if (x_end > dst->width)
+        x_end = (int)dst->width;
+    if (x_start >= x_end)
+        return;
+
+    if (!span_direct_ok(dst)) {
+        for (int x = x_start; x < x_end; x++)
+            gr_put_pixel(dst, x, y, color);
+        return;
+    }
+
+    uint32_t *pixel = span_pixel_ptr(dst, x_start, y);
+    for (int x = x_start; x < x_end; x++)
+        *pixel++ = color;
+}
+
+// Cursor de columna para tramos con color por píxel (paredes, suelos y techos WLD)
+typedef struct {
+    GRAPH *dst;
+    uint32_t *top;      // Píxel (x, 0) o NULL si hay que usar gr_put_pixel
+    int stride;
+    int x;
+} SPAN_COLUMN;
+
+// Prepara el cursor y recorta [*y_start, *y_end). Devuelve 0 si no hay nada que dibujar.
+static inline int span_column_begin(SPAN_COLUMN *column, GRAPH *dst, int x, int *y_start, int *y_end) {
+    if (!dst || !span_clip_column(dst, x, y_start, y_end))
+        return 0;
+
+    column->dst = dst;
+    column->x = x;
+    if (span_direct_ok(dst)) {
+        column->top = span_pixel_ptr(dst, x, 0);
+        column->stride = span_stride(dst);
+    } else {
+        column->top = NULL;
+        column->stride = 0;
+    }
+    return 1;
+}
+
+// y debe estar dentro del rango devuelto por span_column_begin
+static inline void span_column_put(SPAN_COLUMN *column, int y, uint32_t color) {
+    if (column->top)
+        column->top[(size_t)y * column->stride] = color;
+    else
+        gr_put_pixel(column->dst, column->x, y, color);
+}
+
+// Copia la fila src_y sobre [dst_y, dst_y + count) para replicar bloques de quality_step
+static void span_repeat_row(GRAPH *dst, int src_y, int dst_y, int count, int x_end) {
+    if (!span_direct_ok(dst) || src_y < 0 || src_y >= dst->height)
+        return;
+    if (x_end > dst->width)
+        x_end = (int)dst->width;
+    if (x_end <= 0)
+        return;
+
+    const uint32_t *src = span_pixel_ptr(dst, 0, src_y);
+    for (int y = dst_y; y < dst_y + count && y < dst->height; y++)
+        memcpy(span_pixel_ptr(dst, 0, y), src, (size_t)x_end * sizeof(uint32_t));
+}
+
+// Proyección esférica del cielo. La u depende solo de la columna y el yaw, y la
+// v solo de la fila y el pitch, así que se tabulan por separado (texel de la
+// textura por columna y por fila) y se recalculan solo si cambian la cámara, la
+// resolución o la textura.
+#define SKY_FOV 0.1f
+
+
+static void free_sky_tables(RENDER_CONTEXT *ctx) {
+    free(ctx->sky_texel_x);
+    free(ctx->sky_texel_y);
+    ctx->sky_texel_x = NULL;
+    ctx->sky_texel_y = NULL;
+    ctx->sky_table_width = ctx->sky_table_height = 0;
+    ctx->sky_tables_valid = 0;
+}
+
+static int sky_texel_column(const RENDER_CONTEXT *ctx, float screen_x, float camera_angle) {
+    float half_width = ctx->render_width / 2.0f;
+    float ray_angle_h = ((screen_x - half_width) / (float)ctx->render_width) * SKY_FOV;
+    float u = (camera_angle + ray_angle_h + M_PI) / (2.0f * M_PI);
+
+    if (u < 0.0f) u = 0.0f;
+    if (u > 1.0f) u = 1.0f;
+    return (int)(u * sky_texture->width) % sky_texture->width;
+}
+
+static int sky_texel_row(const RENDER_CONTEXT *ctx, float screen_y, float camera_pitch) {
+    float half_height = ctx->render_height / 2.0f;
+    float ray_angle_v = ((screen_y - half_height) / (float)ctx->render_height) * (SKY_FOV * 0.75f);
+    float v = (camera_pitch + ray_angle_v + M_PI_2) / M_PI;
+
+    if (v < 0.0f) v = 0.0f;
+    if (v > 1.0f) v = 1.0f;
+    return (int)(v * sky_texture->height) % sky_texture->height;
+}
+
+static int build_sky_tables(RENDER_CONTEXT *ctx, int width, int height, float camera_angle, float camera_pitch) {
+    if (ctx->sky_tables_valid && ctx->sky_table_width == width && ctx->sky_table_height == height &&
+        ctx->sky_table_angle == camera_angle && ctx->sky_table_pitch == camera_pitch &&
+        ctx->sky_table_texture == sky_texture && ctx->sky_table_code == sky_texture->code &&
+        ctx->sky_table_tex_width == (int)sky_texture->width && ctx->sky_table_tex_height == (int)sky_texture->height)
+        return 1;
+
+    if (ctx->sky_table_width != width || ctx->sky_table_height != height || !ctx->sky_texel_x || !ctx->sky_texel_y) {
+        free_sky_tables(ctx);
+        ctx->sky_texel_x = malloc(width * sizeof(int));
+        ctx->sky_texel_y = malloc(height * sizeof(int));
+        if (!ctx->sky_texel_x || !ctx->sky_texel_y) {
+            fprintf(stderr, "Error: No se pudieron asignar las tablas del cielo %dx%d\n", width, height);
+            free_sky_tables(ctx);
+            return 0;
+        }
+        ctx->sky_table_width = width;
+        ctx->sky_table_height = height;
+    }
+
+    for (int x = 0; x < width; x++)
+        ctx->sky_texel_x[x] = sky_texel_column(ctx, (float)x, camera_angle);
+    for (int y = 0; y < height; y++)
+        ctx->sky_texel_y[y] = sky_texel_row(ctx, (float)y, camera_pitch);
+
+    ctx->sky_table_angle = camera_angle;
+    ctx->sky_table_pitch = camera_pitch;
+    ctx->sky_table_texture = sky_texture;
+    ctx->sky_table_code = sky_texture->code;
+    ctx->sky_table_tex_width = (int)sky_texture->width;
+    ctx->sky_table_tex_height = (int)sky_texture->height;
+    ctx->sky_tables_valid = 1;
+    return 1;
 }
 
+// Escribe una fila de cielo: tramos de columnas que caen en el mismo texel
+static void render_sky_row(RENDER_CONTEXT *ctx, int y, int sky_width, int quality_step) {
+    int tex_y = ctx->sky_texel_y[y];
+    const uint32_t *texels = span_direct_ok(sky_texture) ? span_pixel_ptr(sky_texture, 0, tex_y) : NULL;
+
+    int x = 0;
+    while (x < sky_width) {
+        int tex_x = ctx->sky_texel_x[x];
+        int x_end = x + quality_step;
+        while (x_end < sky_width && ctx->sky_texel_x[x_end] == tex_x)
+            x_end += quality_step;
+        if (x_end > sky_width)
+            x_end = sky_width;
+
+        uint32_t sky_color = texels ? texels[tex_x] : gr_get_pixel(sky_texture, tex_x, tex_y);
+        span_fill_row(ctx->render_buffer, x, x_end, y, sky_color);
+        x = x_end;
+    }
+}
 
 // Función de renderizado del skybox corregida  
-static void render_skybox(float camera_angle, float camera_pitch, float time, int quality_step) {    
-    if (!sky_texture) {    
-        uint32_t background_color = SDL_MapRGBA(gPixelFormat, sky_color_r, sky_color_g, sky_color_b, sky_color_a);    
-        gr_clear_as(render_buffer, background_color);    
-        return;    
-    }    
-        
-    uint32_t background_color = SDL_MapRGBA(gPixelFormat, sky_color_r, sky_color_g, sky_color_b, sky_color_a);    
-    gr_clear_as(render_buffer, background_color);    
-      
+static void render_skybox(RENDER_CONTEXT *ctx, float time, int quality_step) {    
+    uint32_t background_color = SDL_MapRGBA(gPixelFormat, ctx->sky_color_r, ctx->sky_color_g, ctx->sky_color_b, ctx->sky_color_a);    
+
     // CORREGIDO: Usar dimensiones dinámicas  
-    for (int y = 0; y < current_render_height; y += quality_step) {    
-        for (int x = 0; x < current_render_width; x += quality_step) {    
-            uint32_t sky_color = sample_sky_texture((float)x, (float)y, camera_angle, camera_pitch, time);    
-                
-            for (int dy = 0; dy < quality_step && (y + dy) < current_render_height; dy++) {    
-                for (int dx = 0; dx < quality_step && (x + dx) < current_render_width; dx++) {    
-                    gr_put_pixel(render_buffer, x + dx, y + dy, sky_color);    
-                }    
-            }    
-        }    
+    int sky_width = (ctx->render_width < ctx->render_buffer->width) ? ctx->render_width : (int)ctx->render_buffer->width;
+    int sky_height = (ctx->render_height < ctx->render_buffer->height) ? ctx->render_height : (int)ctx->render_buffer->height;
+
+    // Sin textura, o si el cielo no cubre todo el buffer, el fondo es el color plano
+    if (!sky_texture || sky_width < ctx->render_buffer->width || sky_height < ctx->render_buffer->height)
+        gr_clear_as(ctx->render_buffer, background_color);
+    if (!sky_texture || !build_sky_tables(ctx, sky_width, sky_height, ctx->camera.angle, ctx->camera.pitch))
+        return;
+
+    // Se muestrea una fila de bloques y se replica en las quality_step - 1 filas
+    // siguientes; las filas que caen en el mismo texel que la anterior se copian
+    int direct = span_direct_ok(ctx->render_buffer);
+    int last_y = -1;
+    for (int y = 0; y < sky_height; y += quality_step) {    
+        int block_rows = (y + quality_step < sky_height) ? quality_step : sky_height - y;
+
+        if (direct && last_y >= 0 && ctx->sky_texel_y[y] == ctx->sky_texel_y[last_y]) {
+            span_repeat_row(ctx->render_buffer, last_y, y, block_rows, sky_width);
+            continue;
+        }
+
+        render_sky_row(ctx, y, sky_width, quality_step);
+        if (direct) {
+            span_repeat_row(ctx->render_buffer, y, y + 1, block_rows - 1, sky_width);
+        } else {
+            for (int dy = 1; dy < block_rows; dy++) {
+                for (int x = 0; x < sky_width; x++)
+                    gr_put_pixel(ctx->render_buffer, x, y + dy, gr_get_pixel(ctx->render_buffer, x, y));
+            }
+        }
+        last_y = y;
     }    
+    span_mark_dirty(ctx->render_buffer);
 }
 
-static BILLBOARD_PROJECTION calculate_proyection(VOXEL_BILLBOARD *bb, GRAPH *billboard_graph, float terrain_fov) {        
+static BILLBOARD_PROJECTION calculate_proyection(const RENDER_CONTEXT *ctx, VOXEL_BILLBOARD *bb, GRAPH *billboard_graph, float terrain_fov) {        
     BILLBOARD_PROJECTION result = {0};        
             
-    float dx = bb->world_x - camera.x;        
-    float dy = bb->world_y - camera.y;        
-    float dz = bb->world_z - camera.z;        
+    float dx = bb->world_x - ctx->camera.x;        
+    float dy = bb->world_y - ctx->camera.y;        
+    float dz = bb->world_z - ctx->camera.z;        
     float distance = sqrtf(dx * dx + dy * dy + dz * dz);        
             
-    if (distance > max_render_distance * 1.1f || distance < 0.5f) {        
+    if (distance > ctx->max_render_distance * 1.1f || distance < 0.5f) {        
         result.valid = 0;        
         return result;        
     }        
             
     result.distance = distance;      
+    result.ground_distance = sqrtf(dx * dx + dy * dy);
           
     float effective_fov = terrain_fov;      
     float billboard_angle = atan2f(dy, dx);      
-    float angle_diff = billboard_angle - camera.angle;      
+    float angle_diff = billboard_angle - ctx->camera.angle;      
           
     while (angle_diff > M_PI) angle_diff -= 2.0f * M_PI;      
     while (angle_diff < -M_PI) angle_diff += 2.0f * M_PI;      
@@ -788,19 +1322,19 @@ static BILLBOARD_PROJECTION calculate_proyection(VOXEL_BILLBOARD *bb, GRAPH *bil
         return result;      
     }      
         
-    float half_width = current_render_width / 2.0f;    
-    float screen_x_float = half_width + (angle_diff / effective_fov) * (float)current_render_width;      
+    float half_width = ctx->render_width / 2.0f;    
+    float screen_x_float = half_width + (angle_diff / effective_fov) * (float)ctx->render_width;      
         
-    float extended_width = current_render_width * 1.25f;    
-    if (screen_x_float < -extended_width || screen_x_float >= current_render_width + extended_width) {      
+    float extended_width = ctx->render_width * 1.25f;    
+    if (screen_x_float < -extended_width || screen_x_float >= ctx->render_width + extended_width) {      
         result.valid = 0;      
         return result;      
     }      
           
     result.screen_x = (int)screen_x_float;      
           
-    float cos_angle = cosf(camera.angle);        
-    float sin_angle = sinf(camera.angle);        
+    float cos_angle = cosf(ctx->camera.angle);        
+    float sin_angle = sinf(ctx->camera.angle);        
     float cam_forward = dx * cos_angle + dy * sin_angle;      
           
     if (cam_forward <= 0.1f) {        
@@ -808,12 +1342,13 @@ static BILLBOARD_PROJECTION calculate_proyection(VOXEL_BILLBOARD *bb, GRAPH *bil
         return result;        
     }      
         
-    float half_height = current_render_height / 2.0f;    
-    float height_on_screen = half_height + (camera.z - bb->world_z) / cam_forward * 300.0f;      
-    height_on_screen += camera.pitch * 40.0f;      
+    float resolution_scale = render_resolution_scale(ctx);
+    float half_height = ctx->render_height / 2.0f;    
+    float height_on_screen = half_height + (ctx->camera.z - bb->world_z) / cam_forward * (PROJECTION_HEIGHT_SCALE * resolution_scale);      
+    height_on_screen += ctx->camera.pitch * 40.0f * resolution_scale;      
         
-    float extended_height = current_render_height * 1.67f;    
-    if (height_on_screen < -extended_height || height_on_screen >= current_render_height + extended_height) {      
+    float extended_height = ctx->render_height * 1.67f;    
+    if (height_on_screen < -extended_height || height_on_screen >= ctx->render_height + extended_height) {      
         result.valid = 0;      
         return result;      
     }      
@@ -849,6 +1384,7 @@ static BILLBOARD_PROJECTION calculate_proyection(VOXEL_BILLBOARD *bb, GRAPH *bil
     result.distance_scale = base_scale_factor / cam_forward;      
     if (result.distance_scale > max_scale) result.distance_scale = max_scale;      
     if (result.distance_scale < min_scale) result.distance_scale = min_scale;      
+    result.distance_scale *= resolution_scale;
           
     result.scaled_width = (int)(result.distance_scale * billboard_graph->width);      
     result.scaled_height = (int)(result.distance_scale * billboard_graph->height);      
@@ -862,16 +1398,16 @@ static BILLBOARD_PROJECTION calculate_proyection(VOXEL_BILLBOARD *bb, GRAPH *bil
     float fog = 1.0f;  // Empezar con opacidad completa  
       
     // Solo aplicar fog_table si la distancia es significativa  
-    if (distance > max_render_distance * 0.3f) {  
+    if (distance > ctx->max_render_distance * 0.3f) {  
         int fog_index = (int)distance;      
-        if (fog_index >= fog_table_size) fog_index = fog_table_size - 1;      
-        fog = fog_table[fog_index];      
+        if (fog_index >= ctx->fog_table_size) fog_index = ctx->fog_table_size - 1;      
+        fog = ctx->fog_table[fog_index];      
     }  
           
     // Fade-out por distancia (solo para objetos lejanos)  
-    if (distance > max_render_distance * 0.7f) {      
-        float fade_range = max_render_distance * 0.3f;    
-        float fade_progress = (distance - max_render_distance * 0.7f) / fade_range;      
+    if (distance > ctx->max_render_distance * 0.7f) {      
+        float fade_range = ctx->max_render_distance * 0.3f;    
+        float fade_progress = (distance - ctx->max_render_distance * 0.7f) / fade_range;      
         float distance_fade = 1.0f - fade_progress;      
         distance_fade = fmaxf(0.0f, fminf(1.0f, distance_fade));      
         fog *= distance_fade;      
@@ -889,13 +1425,13 @@ static BILLBOARD_PROJECTION calculate_proyection(VOXEL_BILLBOARD *bb, GRAPH *bil
     result.alpha = (Uint8)(255 * fog);      
         
     // Tintado de niebla (solo para objetos lejanos con niebla activa)  
-    if (fog_intensity > 0.0f && distance > max_render_distance * 0.3f) {      
-        float fog_start = max_render_distance * 0.3f;      
-        float fog_range = max_render_distance - fog_start;      
+    if (ctx->fog_intensity > 0.0f && distance > ctx->max_render_distance * 0.3f) {      
+        float fog_start = ctx->max_render_distance * 0.3f;      
+        float fog_range = ctx->max_render_distance - fog_start;      
         float fog_progress = (distance - fog_start) / fog_range;      
         fog_progress = fog_progress * fog_progress;      
               
-        float fog_tint_factor = fog_progress * fog_intensity * 0.3f;      
+        float fog_tint_factor = fog_progress * ctx->fog_intensity * 0.3f;      
         if (fog_tint_factor > 0.5f) fog_tint_factor = 0.5f;      
               
         result.fog_tint_factor = fog_tint_factor;      
@@ -907,379 +1443,3010 @@ static BILLBOARD_PROJECTION calculate_proyection(VOXEL_BILLBOARD *bb, GRAPH *bil
     return result;      
 }
 
-// Función de comparación para qsort (más lejanos primero)  
-int compare_billboards_by_distance(const void *a, const void *b) {  
-    BILLBOARD_RENDER_DATA *bb_a = (BILLBOARD_RENDER_DATA *)a;  
-    BILLBOARD_RENDER_DATA *bb_b = (BILLBOARD_RENDER_DATA *)b;  
-      
-    // Renderizar primero los más lejanos (mayor distancia)  
-    if (bb_a->distance > bb_b->distance) return -1;  
-    if (bb_a->distance < bb_b->distance) return 1;  
-    return 0;  
+// Función de comparación para qsort (más lejanos primero)  
+int compare_billboards_by_distance(const void *a, const void *b) {  
+    BILLBOARD_RENDER_DATA *bb_a = (BILLBOARD_RENDER_DATA *)a;  
+    BILLBOARD_RENDER_DATA *bb_b = (BILLBOARD_RENDER_DATA *)b;  
+      
+    // Renderizar primero los más lejanos (mayor distancia)  
+    if (bb_a->distance > bb_b->distance) return -1;  
+    if (bb_a->distance < bb_b->distance) return 1;  
+    return 0;  
+}
+
+// ============================================================================
+// POOL DE HILOS PARA EL RENDER CPU
+// ============================================================================
+// Las columnas del voxelspace son independientes entre sí: se agrupan en tiras
+// de RENDER_STRIP_WIDTH columnas y cada hilo recibe un rango contiguo de tiras.
+// Cuando un hilo agota su rango roba tiras pendientes de los demás, así las
+// columnas que llegan al horizonte lejano no retrasan el frame completo.
+
+#define MAX_RENDER_THREADS 32
+#define RENDER_STRIP_WIDTH 8
+
+typedef void (*RENDER_JOB_FUNC)(void *data, int strip);
+
+typedef struct {
+    SDL_atomic_t next;   // Siguiente tira a reclamar (propia o robada)
+    int end;             // Fin (exclusivo) del rango asignado
+} RENDER_QUEUE;
+
+static SDL_Thread *render_threads[MAX_RENDER_THREADS];
+static RENDER_QUEUE render_queues[MAX_RENDER_THREADS];
+static int render_thread_count = 0;       // Hilos auxiliares (el llamador también trabaja)
+static int requested_render_threads = 0;  // 0 = automático según núcleos
+static int render_pool_started = 0;
+
+static SDL_mutex *render_pool_mutex = NULL;
+static SDL_cond *render_pool_work_cond = NULL;
+static SDL_cond *render_pool_done_cond = NULL;
+static int render_pool_generation = 0;
+static int render_pool_pending = 0;
+static int render_pool_quit = 0;
+static int render_pool_participants = 1;
+
+static RENDER_JOB_FUNC render_job_func = NULL;
+static void *render_job_data = NULL;
+
+static int render_pool_claim(int queue_index) {
+    RENDER_QUEUE *q = &render_queues[queue_index];
+    if (SDL_AtomicGet(&q->next) >= q->end)
+        return -1;
+    int strip = SDL_AtomicAdd(&q->next, 1);
+    return (strip < q->end) ? strip : -1;
+}
+
+static void render_pool_work(int index) {
+    int strip;
+
+    // Primero el rango propio
+    while ((strip = render_pool_claim(index)) >= 0)
+        render_job_func(render_job_data, strip);
+
+    // Después robar a los demás participantes
+    for (int i = 1; i < render_pool_participants; i++) {
+        int victim = (index + i) % render_pool_participants;
+        while ((strip = render_pool_claim(victim)) >= 0)
+            render_job_func(render_job_data, strip);
+    }
+}
+
+static int render_worker_main(void *arg) {
+    int index = (int)(intptr_t)arg;
+    int seen_generation = 0;
+
+    SDL_LockMutex(render_pool_mutex);
+    for (;;) {
+        while (!render_pool_quit && render_pool_generation == seen_generation)
+            SDL_CondWait(render_pool_work_cond, render_pool_mutex);
+        if (render_pool_quit)
+            break;
+        seen_generation = render_pool_generation;
+        SDL_UnlockMutex(render_pool_mutex);
+
+        render_pool_work(index);
+
+        SDL_LockMutex(render_pool_mutex);
+        if (--render_pool_pending == 0)
+            SDL_CondSignal(render_pool_done_cond);
+    }
+    SDL_UnlockMutex(render_pool_mutex);
+    return 0;
+}
+
+static void render_pool_shutdown(void) {
+    if (!render_pool_started)
+        return;
+
+    // Con un solo hilo (o si falló la creación) no hay primitivas que liberar
+    if (render_pool_mutex) {
+        SDL_LockMutex(render_pool_mutex);
+        render_pool_quit = 1;
+        SDL_CondBroadcast(render_pool_work_cond);
+        SDL_UnlockMutex(render_pool_mutex);
+    }
+
+    for (int i = 0; i < render_thread_count; i++) {
+        SDL_WaitThread(render_threads[i], NULL);
+        render_threads[i] = NULL;
+    }
+
+    SDL_DestroyCond(render_pool_work_cond);
+    SDL_DestroyCond(render_pool_done_cond);
+    SDL_DestroyMutex(render_pool_mutex);
+    render_pool_work_cond = NULL;
+    render_pool_done_cond = NULL;
+    render_pool_mutex = NULL;
+
+    render_thread_count = 0;
+    render_pool_generation = 0;
+    render_pool_pending = 0;
+    render_pool_quit = 0;
+    render_pool_started = 0;
+}
+
+static void render_pool_ensure(void) {
+    if (render_pool_started)
+        return;
+    render_pool_started = 1;
+
+    int total = requested_render_threads;
+    if (total <= 0)
+        total = SDL_GetCPUCount();
+    if (total < 1)
+        total = 1;
+    if (total > MAX_RENDER_THREADS)
+        total = MAX_RENDER_THREADS;
+
+    render_thread_count = 0;
+    if (total == 1)
+        return;
+
+    render_pool_mutex = SDL_CreateMutex();
+    render_pool_work_cond = SDL_CreateCond();
+    render_pool_done_cond = SDL_CreateCond();
+    if (!render_pool_mutex || !render_pool_work_cond || !render_pool_done_cond) {
+        fprintf(stderr, "Error: No se pudo crear el pool de render, se usa un solo hilo\n");
+        return;
+    }
+
+    for (int i = 1; i < total; i++) {
+        SDL_Thread *thread = SDL_CreateThread(render_worker_main, "heightmap_render", (void *)(intptr_t)i);
+        if (!thread) {
+            fprintf(stderr, "Error: No se pudo crear el hilo de render %d\n", i);
+            break;
+        }
+        render_threads[render_thread_count++] = thread;
+    }
+}
+
+// Ejecuta job(data, strip) para strip = 0..strip_count-1 repartido entre los hilos.
+// Vuelve cuando todas las tiras han terminado.
+static void render_pool_run(RENDER_JOB_FUNC job, void *data, int strip_count) {
+    render_pool_ensure();
+
+    if (render_thread_count == 0 || strip_count <= 1) {
+        for (int strip = 0; strip < strip_count; strip++)
+            job(data, strip);
+        return;
+    }
+
+    int participants = render_thread_count + 1;
+    if (participants > strip_count)
+        participants = strip_count;
+
+    // Reparto inicial en rangos contiguos (buena localidad de caché por hilo)
+    int begin = 0;
+    for (int i = 0; i < participants; i++) {
+        int count = strip_count / participants + (i < strip_count % participants ? 1 : 0);
+        SDL_AtomicSet(&render_queues[i].next, begin);
+        render_queues[i].end = begin + count;
+        begin += count;
+    }
+
+    render_job_func = job;
+    render_job_data = data;
+
+    SDL_LockMutex(render_pool_mutex);
+    render_pool_participants = participants;
+    render_pool_pending = render_thread_count;
+    render_pool_generation++;
+    SDL_CondBroadcast(render_pool_work_cond);
+    SDL_UnlockMutex(render_pool_mutex);
+
+    // El hilo llamador también trabaja como participante 0
+    render_pool_work(0);
+
+    SDL_LockMutex(render_pool_mutex);
+    while (render_pool_pending > 0)
+        SDL_CondWait(render_pool_done_cond, render_pool_mutex);
+    SDL_UnlockMutex(render_pool_mutex);
+}
+
+/* Configurar número de hilos del render CPU (0 = automático) */
+int64_t libmod_heightmap_set_render_threads(INSTANCE *my, int64_t *params) {
+    int64_t threads = params[0];
+
+    if (threads < 0 || threads > MAX_RENDER_THREADS) {
+        fprintf(stderr, "Error: render_threads debe estar entre 0 y %d\n", MAX_RENDER_THREADS);
+        return 0;
+    }
+
+    if (threads == requested_render_threads)
+        return 1;
+
+    // El pool se recrea con el nuevo tamaño en el próximo frame
+    render_pool_shutdown();
+    requested_render_threads = (int)threads;
+    return 1;
+}
+
+// ============================================================================
+// RENDER CPU POR COLUMNAS
+// ============================================================================
+
+// Estado de solo lectura compartido por todas las columnas de un frame
+typedef struct {
+    RENDER_CONTEXT *ctx;
+    HEIGHTMAP *hm;
+    GRAPH *dst;                    // render_buffer del contexto
+    CAMERA_3D camera;              // Copia de la cámara del contexto para los hilos
+    float max_distance;
+    HORIZON_SPAN *horizon_spans;   // height tramos por columna
+    int *horizon_count;            // Uno por columna
+    uint32_t *span_colors;         // Color de cada tramo (los de niebla, sin mezclar hasta column_end)
+    uint8_t *span_fog;             // Peso de niebla 0-255 de los tramos con niebla
+    const uint8_t *fog_lut;        // Peso de niebla por distancia (NULL sin niebla)
+    int fog_lut_size;
+    float fog_visible_from;        // Por debajo de esta distancia no hay niebla
+    uint32_t fog_color;            // Color de niebla empaquetado
+    const float *cos_cache;
+    const float *sin_cache;
+    const float *march_distances;  // Distancias de muestreo, iguales para todas las columnas
+    int march_count;
+    float base_angle, angle_step;
+    float min_angle, max_angle;
+    float pitch_offset;
+    float projection_scale;        // PROJECTION_HEIGHT_SCALE ajustado al alto interno
+    float center_y;
+    float water_time;
+    const PRECALC_WATER_DATA *water;   // Oleaje de la ventana (del contexto o compartido en lote)
+    int min_chunk_x, max_chunk_x;
+    int min_chunk_y, max_chunk_y;
+    float window_x0, window_x1;    // Mapa ∩ ventana de chunks, semiabierto [x0, x1)
+    float window_y0, window_y1;
+    int width, height;             // Resolución interna del render
+    int quality_step;
+    int column_count;              // Columnas que se renderizan (según quality_step)
+    int simd_lanes;                // 8 = AVX2, 4 = SSE2, 0 = escalar
+    int ray_traversal;             // RAY_TRAVERSAL_STEPS o RAY_TRAVERSAL_DDA
+    const int *columns;            // screen_x de cada columna a marchar
+    TERRAIN_SPAN *history_spans;   // Historia para reproyección (NULL si está desactivada)
+    int *history_count;
+    float *history_angle;
+    uint8_t *history_water;
+} VOXEL_FRAME;
+
+// Estado mutable de una columna mientras avanza el rayo
+typedef struct {
+    int screen_x;
+    int lowest_y;
+    int horizon_count;
+    int fog_first;         // Primer tramo con niebla: desde él se dibuja en column_end
+    int saw_water;
+} TERRAIN_COLUMN;
+
+// LOD por error en pantalla: el paso a distancia d es el ancho en mundo de
+// lod_pixel_error píxeles, d * pixel_angle * lod_pixel_error. Así el número de
+// muestras crece con la resolución y solo logarítmicamente con la distancia.
+// 0 conserva la tabla clásica de tres tramos.
+#define MARCH_MIN_STEP 0.3f
+
+static inline float march_step(const RENDER_CONTEXT *ctx, float distance, float pixel_angle) {
+    if (ctx->lod_pixel_error <= 0.0f)
+        return (distance < 50.0f ? 0.3f : distance < 200.0f ? 0.8f : 1.5f) * ctx->march_step_scale;
+
+    float step = distance * pixel_angle * ctx->lod_pixel_error;
+    return (step < MARCH_MIN_STEP ? MARCH_MIN_STEP : step) * ctx->march_step_scale;
+}
+
+// Tabla de distancias del ray-march. Se genera con la misma acumulación en
+// float que el bucle original para que todos los kernels muestreen igual.
+// pixel_angle: ángulo que abarca un píxel de pantalla (fov / ancho)
+static int build_march_distances(RENDER_CONTEXT *ctx, float pixel_angle) {
+    if (ctx->march_distances && ctx->march_table_distance == ctx->max_render_distance &&
+        ctx->march_table_error == ctx->lod_pixel_error && ctx->march_table_scale == ctx->march_step_scale &&
+        (ctx->lod_pixel_error <= 0.0f || ctx->march_table_footprint == pixel_angle))
+        return 1;
+
+    int count = 0;
+    for (float distance = 1.0f; distance < ctx->max_render_distance;
+         distance += march_step(ctx, distance, pixel_angle)) {
+        count++;
+    }
+
+    float *table = realloc(ctx->march_distances, (count > 0 ? count : 1) * sizeof(float));
+    if (!table)
+        return 0;
+    ctx->march_distances = table;
+
+    int i = 0;
+    for (float distance = 1.0f; distance < ctx->max_render_distance;
+         distance += march_step(ctx, distance, pixel_angle)) {
+        ctx->march_distances[i++] = distance;
+    }
+
+    ctx->march_count = count;
+    ctx->march_table_distance = ctx->max_render_distance;
+    ctx->march_table_footprint = pixel_angle;
+    ctx->march_table_error = ctx->lod_pixel_error;
+    ctx->march_table_scale = ctx->march_step_scale;
+    return 1;
+}
+
+// Reserva una tabla del campo de agua con al menos size entradas
+static int water_field_reserve(float **table, int *capacity, int size) {
+    if (*capacity >= size)
+        return 1;
+    float *grown = realloc(*table, size * sizeof(float));
+    if (!grown)
+        return 0;
+    *table = grown;
+    *capacity = size;
+    return 1;
+}
+
+static void free_water_field(PRECALC_WATER_DATA *field) {
+    free(field->wave_x);
+    free(field->wave_y);
+    free(field->wave_xy);
+    memset(field, 0, sizeof(*field));
+}
+
+// Recalcula el oleaje (aproximación simple del ruido para CPU) en los texels de
+// la ventana [x0, x1) x [y0, y1) si cambió el tick de agua, el nivel o la ventana
+static int build_water_field(PRECALC_WATER_DATA *field, float x0, float x1, float y0, float y1, float water_time) {
+    int origin_x = (int)x0;
+    int origin_y = (int)y0;
+    int size_x = (int)ceilf(x1) - origin_x + 2;   // +1 para interpolar con el vecino
+    int size_y = (int)ceilf(y1) - origin_y + 2;
+    int size_xy = size_x + size_y;
+
+    if (field->valid && field->time == water_time && field->level == water_level &&
+        field->amplitude == wave_amplitude && field->origin_x == origin_x && field->origin_y == origin_y &&
+        field->size_x == size_x && field->size_y == size_y)
+        return 1;
+
+    if (!water_field_reserve(&field->wave_x, &field->capacity_x, size_x) ||
+        !water_field_reserve(&field->wave_y, &field->capacity_y, size_y) ||
+        !water_field_reserve(&field->wave_xy, &field->capacity_xy, size_xy)) {
+        fprintf(stderr, "Error: No se pudo asignar el campo de agua\n");
+        field->valid = 0;
+        return 0;
+    }
+
+    for (int i = 0; i < size_x; i++)
+        field->wave_x[i] = sin(water_time * 0.5f + (origin_x + i) * 0.05f) * wave_amplitude * 0.5f;
+    for (int i = 0; i < size_y; i++)
+        field->wave_y[i] = sin(water_time * 0.8f + (origin_y + i) * 0.03f) * wave_amplitude * 0.3f;
+    for (int i = 0; i < size_xy; i++)
+        field->wave_xy[i] = sin(water_time * 1.2f + (origin_x + origin_y + i) * 0.02f) * wave_amplitude * 0.2f;
+
+    field->origin_x = origin_x;
+    field->origin_y = origin_y;
+    field->size_x = size_x;
+    field->size_y = size_y;
+    field->size_xy = size_xy;
+    field->time = water_time;
+    field->level = water_level;
+    field->amplitude = wave_amplitude;
+    field->valid = 1;
+    return 1;
+}
+
+static inline float water_field_lerp(const float *table, float position) {
+    int i = (int)position;
+    float t = position - i;
+    return table[i] + t * (table[i + 1] - table[i]);
+}
+
+// Altura de la superficie del agua con oleaje; world_x/world_y dentro de la ventana
+static inline float water_surface_height(const VOXEL_FRAME *frame, float world_x, float world_y) {
+    const PRECALC_WATER_DATA *field = frame->water;
+    float fx = world_x - field->origin_x;
+    float fy = world_y - field->origin_y;
+
+    return water_level + water_field_lerp(field->wave_x, fx) + water_field_lerp(field->wave_y, fy) +
+           water_field_lerp(field->wave_xy, fx + fy);
+}
+
+// Niebla del render CPU: peso 0-255 tabulado por distancia, FOG_LUT_SCALE
+// entradas por unidad. Reproduce la curva anterior: lineal desde el 20% de la
+// distancia máxima, sin efecto por debajo de 0.1 y con tope en 0.9.
+#define FOG_LUT_SCALE 4
+
+
+static void free_fog_lut(RENDER_CONTEXT *ctx) {
+    free(ctx->fog_lut);
+    ctx->fog_lut = NULL;
+    ctx->fog_lut_size = 0;
+    ctx->fog_lut_distance = -1.0f;
+    ctx->fog_lut_intensity = -1.0f;
+}
+
+static int build_fog_lut(RENDER_CONTEXT *ctx) {
+    if (ctx->fog_lut && ctx->fog_lut_distance == ctx->max_render_distance && ctx->fog_lut_intensity == ctx->fog_intensity)
+        return 1;
+
+    int size = (int)(ctx->max_render_distance * FOG_LUT_SCALE) + 2;
+    uint8_t *lut = realloc(ctx->fog_lut, size);
+    if (!lut) {
+        fprintf(stderr, "Error: No se pudo asignar la tabla de niebla (%d entradas)\n", size);
+        return 0;
+    }
+
+    float fog_start = ctx->max_render_distance * 0.2f;
+    float fog_range = ctx->max_render_distance * 0.8f;
+    // Primera distancia con factor > 0.1; fog_weight corta ahí con exactitud y
+    // las entradas que la cruzan no bajan de ese factor
+    float visible_from = fog_start + fog_range * 0.05f / ctx->fog_intensity;
+
+    for (int i = 0; i < size; i++) {
+        float low = i / (float)FOG_LUT_SCALE;
+        float high = (i + 1) / (float)FOG_LUT_SCALE;
+        if (high <= visible_from) {
+            lut[i] = 0;
+            continue;
+        }
+
+        // Centro de la entrada para que el error por cuantizar la distancia sea simétrico
+        float distance = fmaxf((low + high) * 0.5f, visible_from);
+        float fog_factor = (distance - fog_start) / fog_range * ctx->fog_intensity * 2.0f;
+        if (fog_factor > 0.9f)
+            fog_factor = 0.9f;
+        lut[i] = (uint8_t)(fog_factor * 255.0f + 0.5f);
+    }
+
+    ctx->fog_lut = lut;
+    ctx->fog_lut_size = size;
+    ctx->fog_lut_distance = ctx->max_render_distance;
+    ctx->fog_lut_intensity = ctx->fog_intensity;
+    ctx->fog_lut_visible_from = visible_from;
+    return 1;
+}
+
+static void column_begin(VOXEL_FRAME *frame, TERRAIN_COLUMN *col, int screen_x) {
+    col->screen_x = screen_x;
+    col->horizon_count = 0;
+    col->fog_first = -1;
+    col->saw_water = 0;
+
+    // Columnas fuera del FOV no se marchan (horizonte ya cerrado)
+    float angle = frame->base_angle + screen_x * frame->angle_step;
+    col->lowest_y = (angle < frame->min_angle || angle > frame->max_angle) ? 0 : frame->height;
+}
+
+static void fog_blend_spans(const VOXEL_FRAME *frame, uint32_t *colors, const uint8_t *weights, int count);
+
+// Cierra la columna: mezcla la niebla de sus tramos lejanos en una pasada y los dibuja
+static void column_end(VOXEL_FRAME *frame, TERRAIN_COLUMN *col) {
+    int screen_x = col->screen_x;
+    int count = col->horizon_count;
+    size_t base = (size_t)screen_x * frame->height;
+    const HORIZON_SPAN *spans = frame->horizon_spans + base;
+    uint32_t *colors = frame->span_colors + base;
+
+    if (col->fog_first >= 0) {
+        int first = col->fog_first;
+        fog_blend_spans(frame, colors + first, frame->span_fog + base + first, count - first);
+        for (int i = first; i < count; i++)
+            span_fill_column(frame->dst, screen_x, spans[i].y_start, spans[i].y_end, colors[i]);
+    }
+    frame->horizon_count[screen_x] = count;
+
+    if (frame->history_spans) {
+        // Las columnas con agua no se reproyectan: no hace falta su historia
+        int history = col->saw_water ? 0 : count;
+        TERRAIN_SPAN *saved = frame->history_spans + base;
+        for (int i = 0; i < history; i++) {
+            saved[i].y_start = spans[i].y_start;
+            saved[i].y_end = spans[i].y_end;
+            saved[i].color = colors[i];
+            saved[i].distance = spans[i].distance;
+        }
+        frame->history_count[screen_x] = history;
+        frame->history_angle[screen_x] = frame->base_angle + screen_x * frame->angle_step;
+        frame->history_water[screen_x] = (uint8_t)col->saw_water;
+    }
+}
+
+static inline uint8_t fog_weight(const VOXEL_FRAME *frame, float distance) {
+    int i = (int)(distance * FOG_LUT_SCALE);
+    return frame->fog_lut[(i < frame->fog_lut_size) ? i : frame->fog_lut_size - 1];
+}
+
+// Registra el tramo [screen_y, lowest_y) de la columna. Los tramos llegan a
+// distancia creciente y la niebla no decrece con ella: hasta el primero con
+// niebla se dibujan aquí, a partir de él se aplazan a column_end.
+static inline void column_push_span(VOXEL_FRAME *frame, TERRAIN_COLUMN *col, int screen_y, float distance,
+                                    uint32_t color, int fogged) {
+    if (fogged && col->fog_first < 0 && frame->fog_lut && distance > frame->fog_visible_from)
+        col->fog_first = col->horizon_count;
+
+    int slot = col->screen_x * frame->height + col->horizon_count++;
+    HORIZON_SPAN *span = &frame->horizon_spans[slot];
+    span->y_start = (int16_t)screen_y;
+    span->y_end = (int16_t)col->lowest_y;
+    span->distance = distance;
+    frame->span_colors[slot] = color;
+
+    if (col->fog_first < 0)
+        span_fill_column(frame->dst, col->screen_x, screen_y, col->lowest_y, color);
+    else
+        frame->span_fog[slot] = fogged ? fog_weight(frame, distance) : 0;
+}
+
+// Mezcla un texel de agua sobre el color del terreno sumergido. El alpha es el
+// override de HEIGHTMAP_WATER_TEXTURE o, si es -1, el del texel por water_color_a.
+static inline uint32_t water_blend(uint32_t water, uint32_t seabed) {
+    int alpha;
+    if (water_texture_alpha_override >= 0) {
+        alpha = (water_texture_alpha_override > 255) ? 255 : water_texture_alpha_override;
+    } else {
+        int texel_alpha = gPixelFormat->Amask ? (int)((water & gPixelFormat->Amask) >> gPixelFormat->Ashift) : 255;
+        alpha = texel_alpha * water_color_a / 255;
+    }
+
+    int water_r = (water >> gPixelFormat->Rshift) & 0xFF;
+    int water_g = (water >> gPixelFormat->Gshift) & 0xFF;
+    int water_b = (water >> gPixelFormat->Bshift) & 0xFF;
+    int seabed_r = (seabed >> gPixelFormat->Rshift) & 0xFF;
+    int seabed_g = (seabed >> gPixelFormat->Gshift) & 0xFF;
+    int seabed_b = (seabed >> gPixelFormat->Bshift) & 0xFF;
+
+    return SDL_MapRGB(gPixelFormat,
+                      (Uint8)(seabed_r + (water_r - seabed_r) * alpha / 255),
+                      (Uint8)(seabed_g + (water_g - seabed_g) * alpha / 255),
+                      (Uint8)(seabed_b + (water_b - seabed_b) * alpha / 255));
+}
+
+// Registra el tramo [screen_y, lowest_y) de la columna y sube su horizonte
+static void column_draw_span(VOXEL_FRAME *frame, TERRAIN_COLUMN *col, int screen_y, float distance,
+                             float world_x, float world_y, int render_water) {
+    HEIGHTMAP *hm = frame->hm;
+    float cached_water_time = frame->water_time;
+
+    if (render_water) {
+        col->saw_water = 1;
+
+        // Renderizar agua: un texel de la textura mezclado con el fondo marino
+        if (water_texture && water_texture->width > 0 && water_texture->height > 0) {
+            float u = (world_x * 0.01f + cached_water_time * 0.1f);
+            float v = (world_y * 0.01f + cached_water_time * 0.05f);
+
+            u = u - floor(u);
+            v = v - floor(v);
+
+            int tex_x = (int)(u * water_texture->width);
+            int tex_y = (int)(v * water_texture->height);
+
+            // Clamp en lugar de modulo para evitar valores negativos
+            tex_x = (tex_x < 0) ? 0 : (tex_x >= water_texture->width) ? water_texture->width - 1 : tex_x;
+            tex_y = (tex_y < 0) ? 0 : (tex_y >= water_texture->height) ? water_texture->height - 1 : tex_y;
+
+            uint32_t seabed = hm->texel_cache[texel_index(hm, (int)world_x, (int)world_y)].color;
+            uint32_t texel = span_direct_ok(water_texture) ? *span_pixel_ptr(water_texture, tex_x, tex_y)
+                                                           : gr_get_pixel(water_texture, tex_x, tex_y);
+            column_push_span(frame, col, screen_y, distance, water_blend(texel, seabed), 0);
+        }
+    } else {
+        // Terreno: el color ya viene sombreado y empaquetado en hm->texel_cache,
+        // en la misma línea que la altura que se acaba de leer; la niebla se
+        // mezcla al cerrar la columna
+        uint32_t terrain_color = hm->texel_cache[texel_index(hm, (int)world_x, (int)world_y)].color;
+        column_push_span(frame, col, screen_y, distance, terrain_color, 1);
+    }
+
+    col->lowest_y = screen_y;
+}
+
+// Proyecta una muestra (terreno o agua) y la dibuja si asoma sobre el horizonte
+static inline void column_sample(VOXEL_FRAME *frame, TERRAIN_COLUMN *col, float distance,
+                                 float world_x, float world_y, float terrain_height) {
+    // Renderizar terreno/agua según su altura real
+    float render_height;
+    int render_water = 0;
+
+    if (water_level > 0 && terrain_height < water_level) {
+        render_height = water_surface_height(frame, world_x, world_y);
+        render_water = 1;
+    } else {
+        render_height = terrain_height;
+    }
+
+    float height_on_screen = (frame->camera.z - render_height) / distance * frame->projection_scale + frame->center_y;
+    height_on_screen += frame->pitch_offset;
+
+    int screen_y = (int)height_on_screen;
+    if (screen_y < 0)
+        screen_y = 0;
+    if (screen_y >= frame->height)
+        return;
+
+    if (screen_y < col->lowest_y)
+        column_draw_span(frame, col, screen_y, distance, world_x, world_y, render_water);
+}
+
+// ----------------------------------------------------------------------------
+// Recorte analítico del rayo contra el mapa y la ventana de chunks. Se calcula
+// una vez por columna el tramo de distancias en el que el rayo está dentro, y
+// el bucle solo recorre ese tramo. Cerca de los bordes (a RAY_CLIP_MARGIN) se
+// mantiene la comprobación exacta para que las muestras sean las mismas.
+// ----------------------------------------------------------------------------
+
+#define RAY_CLIP_MARGIN 0.5f   // Unidades de mundo
+
+typedef struct {
+    float start, end;             // Fuera de [start, end] no hay muestras válidas
+    float safe_start, safe_end;   // Dentro de [safe_start, safe_end] todas lo son
+} RAY_CLIP;
+
+// Intersección del rayo con la caja [x0, x1] x [y0, y1]; 0 si no la toca
+static int ray_clip_box(const VOXEL_FRAME *frame, float cos_angle, float sin_angle,
+                        float x0, float x1, float y0, float y1, float *t_start, float *t_end) {
+    float t_min = 0.0f, t_max = frame->max_distance;
+    float origin[2] = { frame->camera.x, frame->camera.y };
+    float dir[2] = { cos_angle, sin_angle };
+    float low[2] = { x0, y0 };
+    float high[2] = { x1, y1 };
+
+    for (int axis = 0; axis < 2; axis++) {
+        if (fabsf(dir[axis]) < 1e-6f) {
+            if (origin[axis] < low[axis] || origin[axis] > high[axis])
+                return 0;
+            continue;
+        }
+        float t0 = (low[axis] - origin[axis]) / dir[axis];
+        float t1 = (high[axis] - origin[axis]) / dir[axis];
+        if (t0 > t1) { float t = t0; t0 = t1; t1 = t; }
+        if (t0 > t_min) t_min = t0;
+        if (t1 < t_max) t_max = t1;
+    }
+
+    *t_start = t_min;
+    *t_end = t_max;
+    return t_min <= t_max;
+}
+
+// Tramo útil de la columna; 0 si el rayo no pasa por la ventana
+static int ray_clip_column(const VOXEL_FRAME *frame, float cos_angle, float sin_angle, RAY_CLIP *clip) {
+    if (!ray_clip_box(frame, cos_angle, sin_angle,
+                      frame->window_x0 - RAY_CLIP_MARGIN, frame->window_x1 + RAY_CLIP_MARGIN,
+                      frame->window_y0 - RAY_CLIP_MARGIN, frame->window_y1 + RAY_CLIP_MARGIN,
+                      &clip->start, &clip->end))
+        return 0;
+
+    if (!ray_clip_box(frame, cos_angle, sin_angle,
+                      frame->window_x0 + RAY_CLIP_MARGIN, frame->window_x1 - RAY_CLIP_MARGIN,
+                      frame->window_y0 + RAY_CLIP_MARGIN, frame->window_y1 - RAY_CLIP_MARGIN,
+                      &clip->safe_start, &clip->safe_end)) {
+        clip->safe_start = 1e30f;
+        clip->safe_end = -1e30f;
+    }
+    return 1;
+}
+
+// Comprobación exacta, solo para muestras cerca del borde de la ventana
+static inline int ray_sample_in_window(const VOXEL_FRAME *frame, float world_x, float world_y) {
+    const HEIGHTMAP *hm = frame->hm;
+    if (world_x < 0 || world_x >= hm->width - 1 || world_y < 0 || world_y >= hm->height - 1)
+        return 0;
+
+    int current_chunk_x = (int)(world_x / chunk_size);
+    int current_chunk_y = (int)(world_y / chunk_size);
+    return current_chunk_x >= frame->min_chunk_x && current_chunk_x <= frame->max_chunk_x &&
+           current_chunk_y >= frame->min_chunk_y && current_chunk_y <= frame->max_chunk_y;
+}
+
+// Primer índice de la tabla de distancias con distancia >= start
+static int march_first_index(const VOXEL_FRAME *frame, float start) {
+    int low = 0, high = frame->march_count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (frame->march_distances[mid] < start)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+// ----------------------------------------------------------------------------
+// Salto de zonas vacías con la pirámide de alturas máximas. Un bloque se puede
+// saltar entero si ni su altura máxima (o la del agua con oleaje) proyectada
+// en el punto más favorable del tramo que recorre el rayo llega a subir por
+// encima del horizonte actual de la columna.
+// ----------------------------------------------------------------------------
+
+#define PYRAMID_SKIP_MARGIN 0.01f   // No saltar justo hasta el borde del bloque
+
+// Distancia a la que el rayo sale del bloque [x0, x1) x [y0, y1)
+static inline float ray_block_exit(const VOXEL_FRAME *frame, float cos_angle, float sin_angle,
+                                   float x0, float x1, float y0, float y1) {
+    float exit_x = (cos_angle > 1e-6f) ? (x1 - frame->camera.x) / cos_angle :
+                   (cos_angle < -1e-6f) ? (x0 - frame->camera.x) / cos_angle : 1e30f;
+    float exit_y = (sin_angle > 1e-6f) ? (y1 - frame->camera.y) / sin_angle :
+                   (sin_angle < -1e-6f) ? (y0 - frame->camera.y) / sin_angle : 1e30f;
+    return (exit_x < exit_y) ? exit_x : exit_y;
+}
+
+// Distancia (>= from) a la que el rayo entra en el mapa, o un valor enorme si no entra
+static float ray_map_entry(const VOXEL_FRAME *frame, float cos_angle, float sin_angle, float from) {
+    const HEIGHTMAP *hm = frame->hm;
+    float t_min = from, t_max = 1e30f;
+    float origin[2] = { frame->camera.x, frame->camera.y };
+    float dir[2] = { cos_angle, sin_angle };
+    float limit[2] = { (float)(hm->width - 1), (float)(hm->height - 1) };
+
+    for (int axis = 0; axis < 2; axis++) {
+        if (fabsf(dir[axis]) < 1e-6f) {
+            if (origin[axis] < 0 || origin[axis] >= limit[axis])
+                return 1e30f;
+            continue;
+        }
+        float t0 = (0.0f - origin[axis]) / dir[axis];
+        float t1 = (limit[axis] - origin[axis]) / dir[axis];
+        if (t0 > t1) { float t = t0; t0 = t1; t1 = t; }
+        if (t0 > t_min) t_min = t0;
+        if (t1 < t_max) t_max = t1;
+    }
+
+    return (t_min < t_max) ? t_min : 1e30f;
+}
+
+// Devuelve la distancia hasta la que no hace falta muestrear la columna a partir
+// de distance. En *recheck deja la distancia a partir de la cual merece la pena
+// volver a consultar la pirámide.
+static float height_pyramid_skip(const VOXEL_FRAME *frame, float cos_angle, float sin_angle,
+                                 float distance, int lowest_y, float *recheck) {
+    const HEIGHTMAP *hm = frame->hm;
+    float horizon = (float)lowest_y + 1.0f;   // Un píxel de margen por redondeo
+    float water_top = (water_level > 0) ? water_level + fabsf(wave_amplitude) : -1e30f;
+    float skip_to = distance;    // Todo lo anterior es invisible
+    float probe = distance;      // Punto donde se consulta el siguiente bloque
+    int level = 0;               // Se empieza fino y se sube mientras se pueda saltar
+
+    *recheck = distance;
+    while (level >= 0 && probe < frame->max_distance) {
+        float wx = frame->camera.x + cos_angle * probe;
+        float wy = frame->camera.y + sin_angle * probe;
+        if (wx < 0 || wx >= hm->width - 1 || wy < 0 || wy >= hm->height - 1) {
+            // Fuera del mapa no hay nada que dibujar: saltar hasta donde el rayo entre
+            float enter = ray_map_entry(frame, cos_angle, sin_angle, probe);
+            if (enter - PYRAMID_SKIP_MARGIN <= skip_to)
+                break;
+            skip_to = enter - PYRAMID_SKIP_MARGIN;
+            probe = enter + PYRAMID_SKIP_MARGIN;
+            continue;
+        }
+
+        int shift = HEIGHT_PYRAMID_BASE_SHIFT + level;
+        int bx = (int)wx >> shift;
+        int by = (int)wy >> shift;
+        float size = (float)(1 << shift);
+        float exit = ray_block_exit(frame, cos_angle, sin_angle, bx * size, (bx + 1) * size, by * size, (by + 1) * size);
+
+        float max_height = hm->height_max[level][by * hm->height_max_width[level] + bx];
+        if (max_height < water_top)
+            max_height = water_top;
+
+        // La pantalla sube al alejarse si la cima está por debajo de la cámara
+        // y al acercarse si está por encima
+        float nearest = (frame->camera.z >= max_height) ? exit : skip_to;
+        float top_y = (frame->camera.z - max_height) / nearest * frame->projection_scale + frame->center_y + frame->pitch_offset;
+
+        if (top_y >= horizon) {
+            if (exit - PYRAMID_SKIP_MARGIN <= skip_to)
+                break;
+            skip_to = exit - PYRAMID_SKIP_MARGIN;
+            probe = exit + PYRAMID_SKIP_MARGIN;
+            if (level < hm->height_max_levels - 1)
+                level++;
+            continue;
+        }
+
+        if (level == 0) {
+            // El bloque más pequeño es visible: no volver a mirar hasta salir de él
+            *recheck = exit;
+            break;
+        }
+        level--;
+    }
+
+    if (*recheck < skip_to)
+        *recheck = skip_to;
+    return skip_to;
+}
+
+// Avanza i mientras la siguiente distancia siga por debajo de resume
+static inline int march_fast_forward(const VOXEL_FRAME *frame, int i, float resume) {
+    while (i + 1 < frame->march_count && frame->march_distances[i + 1] < resume)
+        i++;
+    return i;
+}
+
+// Kernel escalar: una columna completa
+static void render_terrain_column(VOXEL_FRAME *frame, int screen_x) {
+    HEIGHTMAP *hm = frame->hm;
+    TERRAIN_COLUMN col;
+    column_begin(frame, &col, screen_x);
+
+    float cos_angle = frame->cos_cache[screen_x];
+    float sin_angle = frame->sin_cache[screen_x];
+
+    RAY_CLIP clip;
+    if (!ray_clip_column(frame, cos_angle, sin_angle, &clip)) {
+        column_end(frame, &col);
+        return;
+    }
+
+    int use_pyramid = (hm->height_max_levels > 0);
+    float skip_until = 0.0f;
+    float recheck = 0.0f;
+
+    for (int i = march_first_index(frame, clip.start); i < frame->march_count && col.lowest_y > 0; i++) {
+        float distance = frame->march_distances[i];
+        if (distance > clip.end)
+            break;
+
+        if (use_pyramid && distance >= recheck)
+            skip_until = height_pyramid_skip(frame, cos_angle, sin_angle, distance, col.lowest_y, &recheck);
+        if (distance < skip_until) {
+            i = march_fast_forward(frame, i, skip_until);
+            continue;
+        }
+
+        float world_x = frame->camera.x + cos_angle * distance;
+        float world_y = frame->camera.y + sin_angle * distance;
+
+        if ((distance < clip.safe_start || distance > clip.safe_end) &&
+            !ray_sample_in_window(frame, world_x, world_y))
+            continue;
+
+        float terrain_height = texel_height_at(hm, world_x, world_y);
+        column_sample(frame, &col, distance, world_x, world_y, terrain_height);
+    }
+
+    column_end(frame, &col);
+}
+
+// ----------------------------------------------------------------------------
+// Recorrido exacto de la rejilla (DDA). En lugar de avanzar con pasos fijos se
+// visita cada cruce del rayo con una línea de la rejilla de height_cache, una
+// sola vez, e interpolando solo a lo largo de la arista cruzada. La coordenada
+// que no se cruza avanza en punto fijo 16.16.
+// ----------------------------------------------------------------------------
+
+#define RAY_TRAVERSAL_STEPS 0
+#define RAY_TRAVERSAL_DDA   1
+
+static int ray_traversal_mode = RAY_TRAVERSAL_STEPS;
+
+#define DDA_FIXED_SHIFT 16
+#define DDA_FIXED_ONE   (1 << DDA_FIXED_SHIFT)
+#define DDA_NO_CROSSING 1e30f
+
+static void render_terrain_column_dda(VOXEL_FRAME *frame, int screen_x) {
+    HEIGHTMAP *hm = frame->hm;
+    TERRAIN_COLUMN col;
+    column_begin(frame, &col, screen_x);
+
+    const TERRAIN_TEXEL *texels = hm->texel_cache;
+    const uint32_t *texel_x = hm->texel_x;
+    const uint32_t *texel_y = hm->texel_y;
+    int map_width = (int)hm->width;
+    int map_height = (int)hm->height;
+
+    float cos_angle = frame->cos_cache[screen_x];
+    float sin_angle = frame->sin_cache[screen_x];
+    int step_x = (cos_angle >= 0.0f) ? 1 : -1;
+    int step_y = (sin_angle >= 0.0f) ? 1 : -1;
+
+    // Distancia hasta el primer cruce de cada eje y entre cruces consecutivos
+    float abs_cos = fabsf(cos_angle);
+    float abs_sin = fabsf(sin_angle);
+    float delta_x = (abs_cos > 1e-6f) ? 1.0f / abs_cos : DDA_NO_CROSSING;
+    float delta_y = (abs_sin > 1e-6f) ? 1.0f / abs_sin : DDA_NO_CROSSING;
+
+    RAY_CLIP clip;
+    if (!ray_clip_column(frame, cos_angle, sin_angle, &clip)) {
+        column_end(frame, &col);
+        return;
+    }
+
+    int grid_x = (int)floorf(frame->camera.x) + (step_x > 0 ? 1 : 0);
+    int grid_y = (int)floorf(frame->camera.y) + (step_y > 0 ? 1 : 0);
+    float next_x = (delta_x < DDA_NO_CROSSING) ? (grid_x - frame->camera.x) / cos_angle : DDA_NO_CROSSING;
+    float next_y = (delta_y < DDA_NO_CROSSING) ? (grid_y - frame->camera.y) / sin_angle : DDA_NO_CROSSING;
+
+    // Con la cámara fuera del mapa o de la ventana, el recorrido empieza en el
+    // primer cruce de cada eje dentro del tramo útil del rayo
+    if (next_x < clip.start) {
+        grid_x += (int)ceilf((clip.start - next_x) / delta_x) * step_x;
+        next_x = (grid_x - frame->camera.x) / cos_angle;
+    }
+    if (next_y < clip.start) {
+        grid_y += (int)ceilf((clip.start - next_y) / delta_y) * step_y;
+        next_y = (grid_y - frame->camera.y) / sin_angle;
+    }
+
+    // Coordenada libre en cada tipo de cruce (16.16) y su incremento por celda
+    int64_t cross_y = (int64_t)((frame->camera.y + sin_angle * next_x) * DDA_FIXED_ONE);
+    int64_t cross_y_step = (int64_t)(sin_angle * delta_x * DDA_FIXED_ONE);
+    int64_t cross_x = (int64_t)((frame->camera.x + cos_angle * next_y) * DDA_FIXED_ONE);
+    int64_t cross_x_step = (int64_t)(cos_angle * delta_y * DDA_FIXED_ONE);
+    const float fixed_scale = 1.0f / DDA_FIXED_ONE;
+
+    while (col.lowest_y > 0) {
+        float distance;
+        float world_x = 0.0f, world_y = 0.0f, terrain_height = 0.0f;
+        int valid = 0;
+
+        if (next_x < next_y) {
+            // Cruce de la línea vertical x = grid_x: interpolar en y
+            distance = next_x;
+            if (distance >= frame->max_distance || distance > clip.end)
+                break;
+            if (grid_x < 0 ? step_x < 0 : grid_x >= map_width - 1 && step_x > 0)
+                break;
+
+            int iy = (int)(cross_y >> DDA_FIXED_SHIFT);
+            if (distance >= 1.0f && grid_x >= 0 && grid_x < map_width - 1 && iy >= 0 && iy < map_height - 1) {
+                float fy = (float)(cross_y & (DDA_FIXED_ONE - 1)) * fixed_scale;
+                size_t column = texel_x[grid_x];
+                float h0 = texels[column + texel_y[iy]].height;
+                terrain_height = height_dequantize(hm, h0 + fy * (texels[column + texel_y[iy + 1]].height - h0));
+                world_x = (float)grid_x;
+                world_y = iy + fy;
+                valid = 1;
+            }
+
+            grid_x += step_x;
+            next_x += delta_x;
+            cross_y += cross_y_step;
+        } else {
+            // Cruce de la línea horizontal y = grid_y: interpolar en x
+            distance = next_y;
+            if (distance >= frame->max_distance || distance > clip.end)
+                break;
+            if (grid_y < 0 ? step_y < 0 : grid_y >= map_height - 1 && step_y > 0)
+                break;
+
+            int ix = (int)(cross_x >> DDA_FIXED_SHIFT);
+            if (distance >= 1.0f && grid_y >= 0 && grid_y < map_height - 1 && ix >= 0 && ix < map_width - 1) {
+                float fx = (float)(cross_x & (DDA_FIXED_ONE - 1)) * fixed_scale;
+                size_t row = texel_y[grid_y];
+                const TERRAIN_TEXEL *texel = &texels[texel_x[ix] + row];
+                float h0 = texel->height;
+                terrain_height = height_dequantize(hm, h0 + fx * (texel->height_right - h0));
+                world_x = ix + fx;
+                world_y = (float)grid_y;
+                valid = 1;
+            }
+
+            grid_y += step_y;
+            next_y += delta_y;
+            cross_x += cross_x_step;
+        }
+
+        if (!valid)
+            continue;
+
+        if ((distance < clip.safe_start || distance > clip.safe_end) &&
+            !ray_sample_in_window(frame, world_x, world_y))
+            continue;
+
+        column_sample(frame, &col, distance, world_x, world_y, terrain_height);
+    }
+
+    column_end(frame, &col);
+}
+
+/* Modo de avance del rayo CPU: 0 = pasos fijos (por defecto), 1 = recorrido DDA de la rejilla */
+int64_t libmod_heightmap_set_ray_traversal(INSTANCE *my, int64_t *params) {
+    int64_t mode = params[0];
+
+    if (mode != RAY_TRAVERSAL_STEPS && mode != RAY_TRAVERSAL_DDA) {
+        fprintf(stderr, "Error: ray_traversal debe ser 0 (pasos) o 1 (DDA)\n");
+        return 0;
+    }
+
+    ray_traversal_mode = (int)mode;
+    return 1;
+}
+
+// ----------------------------------------------------------------------------
+// Kernels SIMD: avanzan un paquete de columnas a la vez (mismas distancias para
+// todas), con lecturas de altura agrupadas, proyección vectorial y máscaras de
+// horizonte por carril. El sombreado y el agua pasan por column_sample y
+// column_draw_span, así que el resultado es idéntico al kernel escalar.
+// ----------------------------------------------------------------------------
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HEIGHTMAP_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+static int requested_render_simd = -1;   // -1 = automático, 0 = escalar, 1 = SSE2, 2 = AVX2
+
+static int render_simd_supported(void) {
+#ifdef HEIGHTMAP_SIMD_X86
+    if (SDL_HasAVX2())
+        return 2;
+    if (SDL_HasSSE2())
+        return 1;
+#endif
+    return 0;
+}
+
+static int render_simd_lanes(void) {
+    static int supported = -1;
+    if (supported < 0)
+        supported = render_simd_supported();
+
+    int level = (requested_render_simd < 0 || requested_render_simd > supported) ? supported : requested_render_simd;
+    return (level == 2) ? 8 : (level == 1) ? 4 : 0;
+}
+
+// Salto con la pirámide para un paquete: devuelve los carriles que hay que
+// muestrear a esta distancia. Si no queda ninguno, *resume es la menor
+// distancia a la que algún carril vuelve a necesitar muestras.
+static int pyramid_packet_mask(const VOXEL_FRAME *frame, const TERRAIN_COLUMN *cols, int alive, float distance,
+                               const float *cos_lane, const float *sin_lane,
+                               float *skip_until, float *recheck, float *resume) {
+    int sampling = 0;
+    *resume = 1e30f;
+
+    for (int k = 0; alive >> k; k++) {
+        if (!(alive & (1 << k)))
+            continue;
+        if (distance >= recheck[k])
+            skip_until[k] = height_pyramid_skip(frame, cos_lane[k], sin_lane[k], distance, cols[k].lowest_y, &recheck[k]);
+        if (distance >= skip_until[k])
+            sampling |= 1 << k;
+        else if (skip_until[k] < *resume)
+            *resume = skip_until[k];
+    }
+    return sampling;
+}
+
+// Recorte por carril de un paquete. Rellena los ángulos y horizontes de cada
+// carril y devuelve el primer índice de la tabla que interesa a alguno. Los
+// carriles que no tocan la ventana quedan con un tramo vacío.
+static int packet_clip(const VOXEL_FRAME *frame, const TERRAIN_COLUMN *cols, int lanes, int width,
+                       float *cos_lane, float *sin_lane, int32_t *lowest_lane,
+                       float *start_lane, float *end_lane, float *safe_start_lane, float *safe_end_lane) {
+    float start = 1e30f;
+
+    for (int k = 0; k < width; k++) {
+        RAY_CLIP clip = { 1e30f, -1e30f, 1e30f, -1e30f };
+        if (k < lanes) {
+            cos_lane[k] = frame->cos_cache[cols[k].screen_x];
+            sin_lane[k] = frame->sin_cache[cols[k].screen_x];
+            lowest_lane[k] = cols[k].lowest_y;
+            if (!ray_clip_column(frame, cos_lane[k], sin_lane[k], &clip)) {
+                clip.start = clip.safe_start = 1e30f;
+                clip.end = clip.safe_end = -1e30f;
+            }
+        }
+        start_lane[k] = clip.start;
+        end_lane[k] = clip.end;
+        safe_start_lane[k] = clip.safe_start;
+        safe_end_lane[k] = clip.safe_end;
+        if (clip.start < start)
+            start = clip.start;
+    }
+
+    return march_first_index(frame, start);
+}
+
+static float packet_clip_end(const float *end_lane, int lanes) {
+    float end = -1e30f;
+    for (int k = 0; k < lanes; k++)
+        if (end_lane[k] > end)
+            end = end_lane[k];
+    return end;
+}
+
+#ifdef HEIGHTMAP_SIMD_X86
+
+__attribute__((target("sse2")))
+static void march_packet_sse2(VOXEL_FRAME *frame, TERRAIN_COLUMN *cols, int lanes) {
+    HEIGHTMAP *hm = frame->hm;
+    const TERRAIN_TEXEL *texels = hm->texel_cache;
+    const uint32_t *texel_x = hm->texel_x;
+    const uint32_t *texel_y = hm->texel_y;
+
+    float cos_lane[4] __attribute__((aligned(16))) = {0};
+    float sin_lane[4] __attribute__((aligned(16))) = {0};
+    int32_t lowest_lane[4] __attribute__((aligned(16))) = {0};
+    float start_lane[4] __attribute__((aligned(16)));
+    float end_lane[4] __attribute__((aligned(16)));
+    float safe_start_lane[4] __attribute__((aligned(16)));
+    float safe_end_lane[4] __attribute__((aligned(16)));
+    int first = packet_clip(frame, cols, lanes, 4, cos_lane, sin_lane, lowest_lane,
+                            start_lane, end_lane, safe_start_lane, safe_end_lane);
+    const float packet_end = packet_clip_end(end_lane, lanes);
+
+    const __m128 v_cos = _mm_load_ps(cos_lane);
+    const __m128 v_sin = _mm_load_ps(sin_lane);
+    const __m128 v_cam_x = _mm_set1_ps(frame->camera.x);
+    const __m128 v_cam_y = _mm_set1_ps(frame->camera.y);
+    const __m128 v_cam_z = _mm_set1_ps(frame->camera.z);
+    const __m128 v_zero = _mm_setzero_ps();
+    const __m128 v_max_x = _mm_set1_ps((float)(hm->width - 1));
+    const __m128 v_max_y = _mm_set1_ps((float)(hm->height - 1));
+    const __m128 v_chunk = _mm_set1_ps((float)chunk_size);
+    const __m128 v_water = _mm_set1_ps(water_level);
+    const __m128 v_scale = _mm_set1_ps(frame->projection_scale);
+    const __m128 v_center = _mm_set1_ps(frame->center_y);
+    const __m128 v_pitch = _mm_set1_ps(frame->pitch_offset);
+    const __m128 v_start = _mm_load_ps(start_lane);
+    const __m128 v_end = _mm_load_ps(end_lane);
+    const __m128 v_safe_start = _mm_load_ps(safe_start_lane);
+    const __m128 v_safe_end = _mm_load_ps(safe_end_lane);
+    const __m128i v_min_cx = _mm_set1_epi32(frame->min_chunk_x - 1);
+    const __m128i v_max_cx = _mm_set1_epi32(frame->max_chunk_x + 1);
+    const __m128i v_min_cy = _mm_set1_epi32(frame->min_chunk_y - 1);
+    const __m128i v_max_cy = _mm_set1_epi32(frame->max_chunk_y + 1);
+    const __m128i v_izero = _mm_setzero_si128();
+    const __m128i v_height = _mm_set1_epi32(frame->height);
+    const __m128 v_height_scale = _mm_set1_ps(hm->height_scale);
+    const __m128 v_height_offset = _mm_set1_ps(hm->height_offset);
+    const int water_enabled = (water_level > 0);
+    const int lane_mask = (1 << lanes) - 1;
+    const int use_pyramid = (hm->height_max_levels > 0);
+    float skip_until[8] = {0};
+    float recheck[8] = {0};
+
+    __m128i v_lowest = _mm_load_si128((const __m128i *)lowest_lane);
+
+    float wx[4] __attribute__((aligned(16)));
+    float wy[4] __attribute__((aligned(16)));
+    float th[4] __attribute__((aligned(16)));
+    int32_t ix[4] __attribute__((aligned(16)));
+    int32_t iy[4] __attribute__((aligned(16)));
+    int32_t sy[4] __attribute__((aligned(16)));
+    float h00[4] __attribute__((aligned(16)));
+    float h10[4] __attribute__((aligned(16)));
+    float h01[4] __attribute__((aligned(16)));
+    float h11[4] __attribute__((aligned(16)));
+
+    for (int i = first; i < frame->march_count; i++) {
+        int alive = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(v_lowest, v_izero))) & lane_mask;
+        if (!alive)
+            break;
+
+        const float distance = frame->march_distances[i];
+        if (distance > packet_end)
+            break;
+        if (use_pyramid) {
+            float resume;
+            alive = pyramid_packet_mask(frame, cols, alive, distance, cos_lane, sin_lane, skip_until, recheck, &resume);
+            if (!alive) {
+                i = march_fast_forward(frame, i, resume);
+                continue;
+            }
+        }
+        const __m128 v_dist = _mm_set1_ps(distance);
+        __m128 v_wx = _mm_add_ps(v_cam_x, _mm_mul_ps(v_cos, v_dist));
+        __m128 v_wy = _mm_add_ps(v_cam_y, _mm_mul_ps(v_sin, v_dist));
+
+        int valid = _mm_movemask_ps(_mm_and_ps(_mm_cmpge_ps(v_dist, v_start), _mm_cmple_ps(v_dist, v_end))) & alive;
+        if (!valid)
+            continue;
+
+        // Solo cerca del borde de la ventana hace falta la comprobación exacta
+        int edge = valid & ~_mm_movemask_ps(_mm_and_ps(_mm_cmpge_ps(v_dist, v_safe_start), _mm_cmple_ps(v_dist, v_safe_end)));
+        if (edge) {
+            __m128 in_map = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(v_wx, v_zero), _mm_cmplt_ps(v_wx, v_max_x)),
+                                       _mm_and_ps(_mm_cmpge_ps(v_wy, v_zero), _mm_cmplt_ps(v_wy, v_max_y)));
+            __m128i v_cx = _mm_cvttps_epi32(_mm_div_ps(v_wx, v_chunk));
+            __m128i v_cy = _mm_cvttps_epi32(_mm_div_ps(v_wy, v_chunk));
+            __m128i in_chunk = _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi32(v_cx, v_min_cx), _mm_cmplt_epi32(v_cx, v_max_cx)),
+                                             _mm_and_si128(_mm_cmpgt_epi32(v_cy, v_min_cy), _mm_cmplt_epi32(v_cy, v_max_cy)));
+            int inside = _mm_movemask_ps(in_map) & _mm_movemask_ps(_mm_castsi128_ps(in_chunk));
+            valid &= ~edge | inside;
+            if (!valid)
+                continue;
+        }
+
+        // Lecturas de altura: SSE2 no tiene gather, se cargan por carril
+        __m128i v_ix = _mm_cvttps_epi32(v_wx);
+        __m128i v_iy = _mm_cvttps_epi32(v_wy);
+        _mm_store_si128((__m128i *)ix, v_ix);
+        _mm_store_si128((__m128i *)iy, v_iy);
+        for (int k = 0; k < 4; k++) {
+            if (valid & (1 << k)) {
+                size_t column = texel_x[ix[k]];
+                const TERRAIN_TEXEL *top = &texels[column + texel_y[iy[k]]];
+                const TERRAIN_TEXEL *bottom = &texels[column + texel_y[iy[k] + 1]];
+                h00[k] = top->height;
+                h10[k] = top->height_right;
+                h01[k] = bottom->height;
+                h11[k] = bottom->height_right;
+            } else {
+                h00[k] = h10[k] = h01[k] = h11[k] = 0.0f;
+            }
+        }
+
+        __m128 v_fx = _mm_sub_ps(v_wx, _mm_cvtepi32_ps(v_ix));
+        __m128 v_fy = _mm_sub_ps(v_wy, _mm_cvtepi32_ps(v_iy));
+        __m128 v_h00 = _mm_load_ps(h00);
+        __m128 v_h01 = _mm_load_ps(h01);
+        __m128 v_h0 = _mm_add_ps(v_h00, _mm_mul_ps(v_fx, _mm_sub_ps(_mm_load_ps(h10), v_h00)));
+        __m128 v_h1 = _mm_add_ps(v_h01, _mm_mul_ps(v_fx, _mm_sub_ps(_mm_load_ps(h11), v_h01)));
+        __m128 v_h = _mm_add_ps(v_h0, _mm_mul_ps(v_fy, _mm_sub_ps(v_h1, v_h0)));
+        v_h = _mm_add_ps(v_height_offset, _mm_mul_ps(v_h, v_height_scale));
+
+        int water = water_enabled ? (_mm_movemask_ps(_mm_cmplt_ps(v_h, v_water)) & valid) : 0;
+        int land = valid & ~water;
+
+        __m128 v_proj = _mm_add_ps(_mm_mul_ps(_mm_div_ps(_mm_sub_ps(v_cam_z, v_h), v_dist), v_scale), v_center);
+        v_proj = _mm_add_ps(v_proj, v_pitch);
+        __m128i v_sy = _mm_cvttps_epi32(v_proj);
+        v_sy = _mm_and_si128(v_sy, _mm_cmpgt_epi32(v_sy, v_izero));   // max(sy, 0)
+
+        __m128i visible = _mm_and_si128(_mm_cmplt_epi32(v_sy, v_height), _mm_cmplt_epi32(v_sy, v_lowest));
+        land &= _mm_movemask_ps(_mm_castsi128_ps(visible));
+
+        int touched = land | water;
+        if (!touched)
+            continue;
+
+        _mm_store_ps(wx, v_wx);
+        _mm_store_ps(wy, v_wy);
+        _mm_store_ps(th, v_h);
+        _mm_store_si128((__m128i *)sy, v_sy);
+
+        for (int k = 0; k < lanes; k++) {
+            if (water & (1 << k))
+                column_sample(frame, &cols[k], distance, wx[k], wy[k], th[k]);
+            else if (land & (1 << k))
+                column_draw_span(frame, &cols[k], sy[k], distance, wx[k], wy[k], 0);
+            lowest_lane[k] = cols[k].lowest_y;
+        }
+        v_lowest = _mm_load_si128((const __m128i *)lowest_lane);
+    }
+}
+
+__attribute__((target("avx2")))
+static void march_packet_avx2(VOXEL_FRAME *frame, TERRAIN_COLUMN *cols, int lanes) {
+    HEIGHTMAP *hm = frame->hm;
+    const TERRAIN_TEXEL *texels = hm->texel_cache;
+    const uint32_t *texel_x = hm->texel_x;
+    const uint32_t *texel_y = hm->texel_y;
+    const int rows = (hm->texel_brick == TEXEL_LAYOUT_ROWS);
+    int map_width = (int)hm->width;
+
+    float cos_lane[8] __attribute__((aligned(32))) = {0};
+    float sin_lane[8] __attribute__((aligned(32))) = {0};
+    int32_t lowest_lane[8] __attribute__((aligned(32))) = {0};
+    float start_lane[8] __attribute__((aligned(32)));
+    float end_lane[8] __attribute__((aligned(32)));
+    float safe_start_lane[8] __attribute__((aligned(32)));
+    float safe_end_lane[8] __attribute__((aligned(32)));
+    int first = packet_clip(frame, cols, lanes, 8, cos_lane, sin_lane, lowest_lane,
+                            start_lane, end_lane, safe_start_lane, safe_end_lane);
+    const float packet_end = packet_clip_end(end_lane, lanes);
+
+    const __m256 v_cos = _mm256_load_ps(cos_lane);
+    const __m256 v_sin = _mm256_load_ps(sin_lane);
+    const __m256 v_cam_x = _mm256_set1_ps(frame->camera.x);
+    const __m256 v_cam_y = _mm256_set1_ps(frame->camera.y);
+    const __m256 v_cam_z = _mm256_set1_ps(frame->camera.z);
+    const __m256 v_zero = _mm256_setzero_ps();
+    const __m256 v_max_x = _mm256_set1_ps((float)(hm->width - 1));
+    const __m256 v_max_y = _mm256_set1_ps((float)(hm->height - 1));
+    const __m256 v_chunk = _mm256_set1_ps((float)chunk_size);
+    const __m256 v_water = _mm256_set1_ps(water_level);
+    const __m256 v_scale = _mm256_set1_ps(frame->projection_scale);
+    const __m256 v_center = _mm256_set1_ps(frame->center_y);
+    const __m256 v_pitch = _mm256_set1_ps(frame->pitch_offset);
+    const __m256 v_start = _mm256_load_ps(start_lane);
+    const __m256 v_end = _mm256_load_ps(end_lane);
+    const __m256 v_safe_start = _mm256_load_ps(safe_start_lane);
+    const __m256 v_safe_end = _mm256_load_ps(safe_end_lane);
+    const __m256i v_min_cx = _mm256_set1_epi32(frame->min_chunk_x - 1);
+    const __m256i v_max_cx = _mm256_set1_epi32(frame->max_chunk_x + 1);
+    const __m256i v_min_cy = _mm256_set1_epi32(frame->min_chunk_y - 1);
+    const __m256i v_max_cy = _mm256_set1_epi32(frame->max_chunk_y + 1);
+    const __m256i v_izero = _mm256_setzero_si256();
+    const __m256i v_height = _mm256_set1_epi32(frame->height);
+    const __m256i v_width = _mm256_set1_epi32(map_width);
+    const __m256i v_low16 = _mm256_set1_epi32(0xFFFF);
+    const __m256 v_height_scale = _mm256_set1_ps(hm->height_scale);
+    const __m256 v_height_offset = _mm256_set1_ps(hm->height_offset);
+    const int water_enabled = (water_level > 0);
+    const int lane_mask = (1 << lanes) - 1;
+    const int use_pyramid = (hm->height_max_levels > 0);
+    float skip_until[8] = {0};
+    float recheck[8] = {0};
+
+    __m256i v_lowest = _mm256_load_si256((const __m256i *)lowest_lane);
+
+    float wx[8] __attribute__((aligned(32)));
+    float wy[8] __attribute__((aligned(32)));
+    float th[8] __attribute__((aligned(32)));
+    int32_t sy[8] __attribute__((aligned(32)));
+
+    for (int i = first; i < frame->march_count; i++) {
+        int alive = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v_lowest, v_izero))) & lane_mask;
+        if (!alive)
+            break;
+
+        const float distance = frame->march_distances[i];
+        if (distance > packet_end)
+            break;
+        if (use_pyramid) {
+            float resume;
+            alive = pyramid_packet_mask(frame, cols, alive, distance, cos_lane, sin_lane, skip_until, recheck, &resume);
+            if (!alive) {
+                i = march_fast_forward(frame, i, resume);
+                continue;
+            }
+        }
+        const __m256 v_dist = _mm256_set1_ps(distance);
+        __m256 v_wx = _mm256_add_ps(v_cam_x, _mm256_mul_ps(v_cos, v_dist));
+        __m256 v_wy = _mm256_add_ps(v_cam_y, _mm256_mul_ps(v_sin, v_dist));
+
+        int valid = _mm256_movemask_ps(_mm256_and_ps(_mm256_cmp_ps(v_dist, v_start, _CMP_GE_OQ),
+                                                     _mm256_cmp_ps(v_dist, v_end, _CMP_LE_OQ))) & alive;
+        if (!valid)
+            continue;
+
+        // Solo cerca del borde de la ventana hace falta la comprobación exacta
+        int edge = valid & ~_mm256_movemask_ps(_mm256_and_ps(_mm256_cmp_ps(v_dist, v_safe_start, _CMP_GE_OQ),
+                                                             _mm256_cmp_ps(v_dist, v_safe_end, _CMP_LE_OQ)));
+        if (edge) {
+            __m256 in_map = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(v_wx, v_zero, _CMP_GE_OQ), _mm256_cmp_ps(v_wx, v_max_x, _CMP_LT_OQ)),
+                                          _mm256_and_ps(_mm256_cmp_ps(v_wy, v_zero, _CMP_GE_OQ), _mm256_cmp_ps(v_wy, v_max_y, _CMP_LT_OQ)));
+            __m256i v_cx = _mm256_cvttps_epi32(_mm256_div_ps(v_wx, v_chunk));
+            __m256i v_cy = _mm256_cvttps_epi32(_mm256_div_ps(v_wy, v_chunk));
+            __m256i in_chunk = _mm256_and_si256(_mm256_and_si256(_mm256_cmpgt_epi32(v_cx, v_min_cx), _mm256_cmpgt_epi32(v_max_cx, v_cx)),
+                                                _mm256_and_si256(_mm256_cmpgt_epi32(v_cy, v_min_cy), _mm256_cmpgt_epi32(v_max_cy, v_cy)));
+            int inside = _mm256_movemask_ps(in_map) & _mm256_movemask_ps(_mm256_castsi256_ps(in_chunk));
+            valid &= ~edge | inside;
+            if (!valid)
+                continue;
+        }
+
+        // Registros de la fila de la muestra y de la siguiente; los carriles inválidos leen el texel 0
+        __m256i v_ix = _mm256_cvttps_epi32(v_wx);
+        __m256i v_iy = _mm256_cvttps_epi32(v_wy);
+        __m256i v_valid = _mm256_cmpgt_epi32(_mm256_and_si256(_mm256_set1_epi32(valid),
+                                                              _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128)), v_izero);
+        __m256i v_top, v_bottom;
+        if (rows) {
+            v_top = _mm256_and_si256(_mm256_add_epi32(_mm256_mullo_epi32(v_iy, v_width), v_ix), v_valid);
+            v_bottom = _mm256_add_epi32(v_top, v_width);
+        } else {
+            // En bloques la fila siguiente puede caer en otro bloque: los
+            // desplazamientos de columna y fila salen de las tablas
+            __m256i v_col = _mm256_and_si256(v_ix, v_valid);
+            __m256i v_row = _mm256_and_si256(v_iy, v_valid);
+            __m256i v_x0 = _mm256_i32gather_epi32((const int *)texel_x, v_col, 4);
+            __m256i v_y0 = _mm256_i32gather_epi32((const int *)texel_y, v_row, 4);
+            __m256i v_y1 = _mm256_i32gather_epi32((const int *)texel_y + 1, v_row, 4);
+            v_top = _mm256_add_epi32(v_x0, v_y0);
+            v_bottom = _mm256_add_epi32(v_x0, v_y1);
+        }
+
+        // Cada lectura de 32 bits trae dos alturas vecinas: la del texel en la
+        // mitad baja y la de su derecha en la alta
+        const int *records = (const int *)texels;
+        __m256i v_pair = _mm256_i32gather_epi32(records, v_top, 8);
+        __m256i v_pair_down = _mm256_i32gather_epi32(records, v_bottom, 8);
+        __m256 v_h00 = _mm256_cvtepi32_ps(_mm256_and_si256(v_pair, v_low16));
+        __m256 v_h10 = _mm256_cvtepi32_ps(_mm256_srli_epi32(v_pair, 16));
+        __m256 v_h01 = _mm256_cvtepi32_ps(_mm256_and_si256(v_pair_down, v_low16));
+        __m256 v_h11 = _mm256_cvtepi32_ps(_mm256_srli_epi32(v_pair_down, 16));
+
+        __m256 v_fx = _mm256_sub_ps(v_wx, _mm256_cvtepi32_ps(v_ix));
+        __m256 v_fy = _mm256_sub_ps(v_wy, _mm256_cvtepi32_ps(v_iy));
+        __m256 v_h0 = _mm256_add_ps(v_h00, _mm256_mul_ps(v_fx, _mm256_sub_ps(v_h10, v_h00)));
+        __m256 v_h1 = _mm256_add_ps(v_h01, _mm256_mul_ps(v_fx, _mm256_sub_ps(v_h11, v_h01)));
+        __m256 v_h = _mm256_add_ps(v_h0, _mm256_mul_ps(v_fy, _mm256_sub_ps(v_h1, v_h0)));
+        v_h = _mm256_add_ps(v_height_offset, _mm256_mul_ps(v_h, v_height_scale));
+
+        int water = water_enabled ? (_mm256_movemask_ps(_mm256_cmp_ps(v_h, v_water, _CMP_LT_OQ)) & valid) : 0;
+        int land = valid & ~water;
+
+        __m256 v_proj = _mm256_add_ps(_mm256_mul_ps(_mm256_div_ps(_mm256_sub_ps(v_cam_z, v_h), v_dist), v_scale), v_center);
+        v_proj = _mm256_add_ps(v_proj, v_pitch);
+        __m256i v_sy = _mm256_max_epi32(_mm256_cvttps_epi32(v_proj), v_izero);
+
+        __m256i visible = _mm256_and_si256(_mm256_cmpgt_epi32(v_height, v_sy), _mm256_cmpgt_epi32(v_lowest, v_sy));
+        land &= _mm256_movemask_ps(_mm256_castsi256_ps(visible));
+
+        int touched = land | water;
+        if (!touched)
+            continue;
+
+        _mm256_store_ps(wx, v_wx);
+        _mm256_store_ps(wy, v_wy);
+        _mm256_store_ps(th, v_h);
+        _mm256_store_si256((__m256i *)sy, v_sy);
+
+        for (int k = 0; k < lanes; k++) {
+            if (water & (1 << k))
+                column_sample(frame, &cols[k], distance, wx[k], wy[k], th[k]);
+            else if (land & (1 << k))
+                column_draw_span(frame, &cols[k], sy[k], distance, wx[k], wy[k], 0);
+            lowest_lane[k] = cols[k].lowest_y;
+        }
+        v_lowest = _mm256_load_si256((const __m256i *)lowest_lane);
+    }
+}
+
+#endif /* HEIGHTMAP_SIMD_X86 */
+
+// ----------------------------------------------------------------------------
+// Mezcla de niebla en punto fijo
+// ----------------------------------------------------------------------------
+// Cada byte del color se mezcla con el de la niebla como
+// (c * (255 - w) + niebla * w) / 255, truncando igual que la versión en float.
+// La división exacta por 255 de x <= 65025 es (x + 1 + (x >> 8)) >> 8, y todos
+// los kernels la usan, así que el resultado no depende del nivel SIMD.
+
+static inline uint32_t fog_blend_pixel(uint32_t color, uint32_t fog, uint32_t weight) {
+    uint32_t out = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        uint32_t x = ((color >> shift) & 0xFF) * (255 - weight) + ((fog >> shift) & 0xFF) * weight;
+        out |= ((x + 1 + (x >> 8)) >> 8) << shift;
+    }
+    return out;
+}
+
+#ifdef HEIGHTMAP_SIMD_X86
+
+__attribute__((target("sse2")))
+static inline __m128i fog_blend_sse2_half(__m128i color, __m128i fog, __m128i weight) {
+    const __m128i c255 = _mm_set1_epi16(255);
+    const __m128i one = _mm_set1_epi16(1);
+    __m128i x = _mm_add_epi16(_mm_mullo_epi16(color, _mm_sub_epi16(c255, weight)), _mm_mullo_epi16(fog, weight));
+    return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(x, one), _mm_srli_epi16(x, 8)), 8);
+}
+
+// 4 píxeles por iteración, canales en 16 bits
+__attribute__((target("sse2")))
+static int fog_blend_sse2(uint32_t *colors, const uint8_t *weights, int count, uint32_t fog_color) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i fog = _mm_unpacklo_epi8(_mm_set1_epi32((int)fog_color), zero);
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        // w0 w1 w2 w3 -> cada peso repetido en los 4 bytes de su píxel
+        uint32_t packed;
+        memcpy(&packed, weights + i, sizeof(packed));
+        __m128i w = _mm_cvtsi32_si128((int)packed);
+        w = _mm_unpacklo_epi8(w, w);
+        w = _mm_unpacklo_epi16(w, w);
+
+        __m128i c = _mm_loadu_si128((const __m128i *)(colors + i));
+        __m128i lo = fog_blend_sse2_half(_mm_unpacklo_epi8(c, zero), fog, _mm_unpacklo_epi8(w, zero));
+        __m128i hi = fog_blend_sse2_half(_mm_unpackhi_epi8(c, zero), fog, _mm_unpackhi_epi8(w, zero));
+        _mm_storeu_si128((__m128i *)(colors + i), _mm_packus_epi16(lo, hi));
+    }
+    return i;
+}
+
+// 8 píxeles por iteración; unpack y pack trabajan por mitades de 128 bits,
+// así que el orden de los píxeles se conserva
+__attribute__((target("avx2")))
+static int fog_blend_avx2(uint32_t *colors, const uint8_t *weights, int count, uint32_t fog_color) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i fog = _mm256_unpacklo_epi8(_mm256_set1_epi32((int)fog_color), zero);
+    const __m256i c255 = _mm256_set1_epi16(255);
+    const __m256i one = _mm256_set1_epi16(1);
+    const __m256i splat = _mm256_set1_epi32(0x01010101);
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m256i w = _mm256_mullo_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(weights + i))), splat);
+        __m256i c = _mm256_loadu_si256((const __m256i *)(colors + i));
+
+        __m256i w_lo = _mm256_unpacklo_epi8(w, zero);
+        __m256i w_hi = _mm256_unpackhi_epi8(w, zero);
+        __m256i x_lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(c, zero), _mm256_sub_epi16(c255, w_lo)),
+                                        _mm256_mullo_epi16(fog, w_lo));
+        __m256i x_hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(c, zero), _mm256_sub_epi16(c255, w_hi)),
+                                        _mm256_mullo_epi16(fog, w_hi));
+        x_lo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(x_lo, one), _mm256_srli_epi16(x_lo, 8)), 8);
+        x_hi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(x_hi, one), _mm256_srli_epi16(x_hi, 8)), 8);
+        _mm256_storeu_si256((__m256i *)(colors + i), _mm256_packus_epi16(x_lo, x_hi));
+    }
+    return i;
+}
+
+#endif /* HEIGHTMAP_SIMD_X86 */
+
+// Aplica la niebla a los count tramos de una columna
+static void fog_blend_spans(const VOXEL_FRAME *frame, uint32_t *colors, const uint8_t *weights, int count) {
+    int i = 0;
+
+#ifdef HEIGHTMAP_SIMD_X86
+    if (frame->simd_lanes == 8)
+        i = fog_blend_avx2(colors, weights, count, frame->fog_color);
+    else if (frame->simd_lanes == 4)
+        i = fog_blend_sse2(colors, weights, count, frame->fog_color);
+#endif
+
+    for (; i < count; i++) {
+        if (weights[i])
+            colors[i] = fog_blend_pixel(colors[i], frame->fog_color, weights[i]);
+    }
+}
+
+// Avanza un paquete de columnas con el kernel SIMD disponible
+static void render_terrain_packet(VOXEL_FRAME *frame, const int *screen_x, int lanes) {
+    TERRAIN_COLUMN cols[8];
+    for (int k = 0; k < lanes; k++)
+        column_begin(frame, &cols[k], screen_x[k]);
+
+#ifdef HEIGHTMAP_SIMD_X86
+    if (frame->simd_lanes == 8)
+        march_packet_avx2(frame, cols, lanes);
+    else
+        march_packet_sse2(frame, cols, lanes);
+#endif
+
+    for (int k = 0; k < lanes; k++)
+        column_end(frame, &cols[k]);
+}
+
+static void render_terrain_strip(void *data, int strip) {
+    VOXEL_FRAME *frame = (VOXEL_FRAME *)data;
+    int first = strip * RENDER_STRIP_WIDTH;
+    int last = first + RENDER_STRIP_WIDTH;
+    if (last > frame->column_count)
+        last = frame->column_count;
+
+    // El DDA recorre celdas distintas por columna: siempre escalar
+    if (frame->ray_traversal == RAY_TRAVERSAL_DDA) {
+        for (int column = first; column < last; column++)
+            render_terrain_column_dda(frame, frame->columns[column]);
+        return;
+    }
+
+    // Sin caché de alturas los kernels SIMD no tienen de dónde leer
+    if (frame->simd_lanes == 0 || !frame->hm->cache_valid) {
+        for (int column = first; column < last; column++)
+            render_terrain_column(frame, frame->columns[column]);
+        return;
+    }
+
+    for (int column = first; column < last; column += frame->simd_lanes) {
+        int screen_x[8];
+        int lanes = last - column;
+        if (lanes > frame->simd_lanes)
+            lanes = frame->simd_lanes;
+        for (int k = 0; k < lanes; k++)
+            screen_x[k] = frame->columns[column + k];
+        render_terrain_packet(frame, screen_x, lanes);
+    }
+}
+
+/* Seleccionar kernel del ray-march CPU: -1 = automático, 0 = escalar, 1 = SSE2, 2 = AVX2 */
+int64_t libmod_heightmap_set_render_simd(INSTANCE *my, int64_t *params) {
+    int64_t level = params[0];
+
+    if (level < -1 || level > 2) {
+        fprintf(stderr, "Error: render_simd debe estar entre -1 y 2\n");
+        return 0;
+    }
+
+    requested_render_simd = (int)level;
+    return render_simd_lanes();
+}
+
+// ============================================================================
+// REPROYECCIÓN TEMPORAL
+// ============================================================================
+// Con la cámara quieta, o girando solo en yaw, las columnas de terreno del frame
+// anterior siguen siendo válidas: se guarda por columna la lista de tramos
+// dibujados y el ángulo con el que se marchó, y se reutiliza la columna cuyo
+// ángulo esté a menos de media columna del nuevo. Solo se marchan las
+// columnas nuevas y las que tenían agua (animada).
+
+#define REPROJECTION_MAX_ERROR 0.5f   // En columnas
+
+// Doble buffer de historia: [history_current] se escribe en este frame
+
+// La historia guarda colores y alturas ya resueltos: cualquier recarga la anula
+// en todos los contextos
+static void reprojection_invalidate(void) {
+    for (int i = 0; i < MAX_RENDER_CONTEXTS; i++) {
+        if (render_contexts[i])
+            render_contexts[i]->reprojection_valid = 0;
+    }
+}
+
+static void reprojection_free(RENDER_CONTEXT *ctx) {
+    for (int i = 0; i < 2; i++) {
+        free(ctx->history_spans[i]);
+        free(ctx->history_count[i]);
+        free(ctx->history_angle[i]);
+        free(ctx->history_water[i]);
+        ctx->history_spans[i] = NULL;
+        ctx->history_count[i] = NULL;
+        ctx->history_angle[i] = NULL;
+        ctx->history_water[i] = NULL;
+    }
+    ctx->history_width = ctx->history_height = 0;
+    ctx->reprojection_valid = 0;
+}
+
+static int reprojection_alloc(RENDER_CONTEXT *ctx, int width, int height) {
+    if (ctx->history_spans[0] && ctx->history_width == width && ctx->history_height == height)
+        return 1;
+
+    reprojection_free(ctx);
+    for (int i = 0; i < 2; i++) {
+        ctx->history_spans[i] = malloc((size_t)width * height * sizeof(TERRAIN_SPAN));
+        ctx->history_count[i] = malloc(width * sizeof(int));
+        ctx->history_angle[i] = malloc(width * sizeof(float));
+        ctx->history_water[i] = malloc(width);
+        if (!ctx->history_spans[i] || !ctx->history_count[i] || !ctx->history_angle[i] || !ctx->history_water[i]) {
+            fprintf(stderr, "Error: No se pudo asignar la historia de reproyección\n");
+            reprojection_free(ctx);
+            return 0;
+        }
+    }
+    ctx->history_width = width;
+    ctx->history_height = height;
+    return 1;
+}
+
+static void reprojection_make_key(const VOXEL_FRAME *frame, REPROJECTION_KEY *key) {
+    const RENDER_CONTEXT *ctx = frame->ctx;
+    memset(key, 0, sizeof(*key));
+    key->hm = frame->hm;
+    key->height_cache = frame->hm->height_cache;
+    key->texel_cache = frame->hm->texel_cache;
+    key->camera_x = ctx->camera.x;
+    key->camera_y = ctx->camera.y;
+    key->camera_z = ctx->camera.z;
+    key->camera_pitch = ctx->camera.pitch;
+    key->max_distance = ctx->max_render_distance;
+    key->fog_intensity = ctx->fog_intensity;
+    key->water_level = water_level;
+    key->wave_amplitude = wave_amplitude;
+    key->width = frame->width;
+    key->height = frame->height;
+    key->quality_step = frame->quality_step;
+    key->ray_traversal = frame->ray_traversal;
+    key->chunk_size = chunk_size;
+    key->chunk_radius = chunk_radius;
+    key->fog_r = ctx->fog_color_r;
+    key->fog_g = ctx->fog_color_g;
+    key->fog_b = ctx->fog_color_b;
+    key->light = light_intensity;
+    key->lod_error = ctx->lod_pixel_error;
+    key->step_scale = ctx->march_step_scale;
+}
+
+// Redibuja una columna reutilizada: color en render_buffer y tramos de profundidad
+static void reprojection_replay_column(VOXEL_FRAME *frame, int screen_x) {
+    const TERRAIN_SPAN *spans = frame->history_spans + screen_x * frame->height;
+    HORIZON_SPAN *horizon = frame->horizon_spans + screen_x * frame->height;
+    int count = frame->history_count[screen_x];
+
+    for (int i = 0; i < count; i++) {
+        span_fill_column(frame->dst, screen_x, spans[i].y_start, spans[i].y_end, spans[i].color);
+        horizon[i].y_start = spans[i].y_start;
+        horizon[i].y_end = spans[i].y_end;
+        horizon[i].distance = spans[i].distance;
+    }
+    frame->horizon_count[screen_x] = count;
+}
+
+// Reutiliza las columnas posibles y devuelve en columns las que hay que marchar
+static int reprojection_begin(VOXEL_FRAME *frame, int *columns) {
+    RENDER_CONTEXT *ctx = frame->ctx;
+    int count = 0;
+
+    if (!reprojection_alloc(ctx, frame->width, frame->height)) {
+        for (int x = 0; x < frame->width; x += frame->quality_step)
+            columns[count++] = x;
+        return count;
+    }
+
+    REPROJECTION_KEY key;
+    reprojection_make_key(frame, &key);
+    int reuse = ctx->reprojection_valid && memcmp(&key, &ctx->reprojection_key, sizeof(key)) == 0;
+
+    int prev = ctx->history_current;
+    int cur = 1 - ctx->history_current;
+    frame->history_spans = ctx->history_spans[cur];
+    frame->history_count = ctx->history_count[cur];
+    frame->history_angle = ctx->history_angle[cur];
+    frame->history_water = ctx->history_water[cur];
+
+    for (int x = 0; x < frame->width; x++)
+        frame->history_count[x] = -1;
+
+    for (int x = 0; x < frame->width; x += frame->quality_step) {
+        float angle = frame->base_angle + x * frame->angle_step;
+
+        if (reuse) {
+            int src = (int)floorf((angle - ctx->reprojection_base_angle) / frame->angle_step + 0.5f);
+            if (src >= 0 && src < frame->width && ctx->history_count[prev][src] >= 0 && !ctx->history_water[prev][src] &&
+                fabsf(ctx->history_angle[prev][src] - angle) <= REPROJECTION_MAX_ERROR * frame->angle_step) {
+                memcpy(frame->history_spans + x * frame->height, ctx->history_spans[prev] + src * frame->height,
+                       ctx->history_count[prev][src] * sizeof(TERRAIN_SPAN));
+                frame->history_count[x] = ctx->history_count[prev][src];
+                frame->history_angle[x] = ctx->history_angle[prev][src];
+                frame->history_water[x] = 0;
+                reprojection_replay_column(frame, x);
+                continue;
+            }
+        }
+
+        columns[count++] = x;
+    }
+
+    ctx->reprojection_key = key;
+    return count;
+}
+
+static void reprojection_end(VOXEL_FRAME *frame) {
+    RENDER_CONTEXT *ctx = frame->ctx;
+    if (!frame->history_spans)
+        return;
+
+    ctx->history_current = 1 - ctx->history_current;
+    ctx->reprojection_base_angle = frame->base_angle;
+    ctx->reprojection_valid = 1;
+}
+
+/* Error máximo en píxeles que define el paso del ray-march (0 = tabla clásica) */
+int64_t libmod_heightmap_set_lod_error(INSTANCE *my, int64_t *params) {
+    float pixels = *(float *)&params[0];
+
+    if (pixels < 0.0f || pixels > 16.0f) {
+        fprintf(stderr, "Error: lod_error debe estar entre 0 y 16 píxeles\n");
+        return 0;
+    }
+
+    active_context->lod_pixel_error = pixels;
+    return 1;
+}
+
+/* Activar la reproyección temporal del render CPU (0 = desactivada, 1 = activada) */
+int64_t libmod_heightmap_set_reprojection(INSTANCE *my, int64_t *params) {
+    int64_t enabled = params[0];
+
+    if (enabled != 0 && enabled != 1) {
+        fprintf(stderr, "Error: reprojection debe ser 0 o 1\n");
+        return 0;
+    }
+
+    active_context->reprojection_enabled = (int)enabled;
+    if (!active_context->reprojection_enabled && !active_context->interlace_enabled)
+        reprojection_free(active_context);
+    return 1;
+}
+
+// ============================================================================
+// RENDER ENTRELAZADO
+// ============================================================================
+// Cada frame se marchan solo las columnas de una paridad (el campo) y las de la
+// otra se reconstruyen a partir de la historia de la reproyección: la columna
+// del frame anterior con el ángulo más cercano, mezclada con la media de las dos
+// vecinas recién marchadas. El peso de la media crece con el movimiento de la
+// cámara: quieta, la columna vieja es exacta; deprisa, manda la interpolación.
+// Sustituye al quality_step = 2 al moverse, que dejaba huecos de cielo.
+
+#define INTERLACE_MAX_ERROR 1.0f       // En columnas: el campo anterior va de dos en dos
+#define INTERLACE_MOTION_FULL 8.0f     // Movimiento por frame a partir del cual solo se interpola
+#define INTERLACE_PITCH_SCALE 40.0f    // Igual que pitch_offset: unidades de pitch a píxeles
+
+
+// Misma escena salvo la cámara: la posición se compensa con el peso de mezcla
+static int interlace_same_scene(const REPROJECTION_KEY *a, const REPROJECTION_KEY *b) {
+    REPROJECTION_KEY ka = *a, kb = *b;
+    ka.camera_x = kb.camera_x = 0.0f;
+    ka.camera_y = kb.camera_y = 0.0f;
+    ka.camera_z = kb.camera_z = 0.0f;
+    ka.camera_pitch = kb.camera_pitch = 0.0f;
+    return memcmp(&ka, &kb, sizeof(ka)) == 0;
+}
+
+// Elige el campo de este frame y devuelve en columns las columnas a marchar
+static int interlace_begin(VOXEL_FRAME *frame, int *columns) {
+    RENDER_CONTEXT *ctx = frame->ctx;
+    int count = 0;
+
+    ctx->interlace_field ^= 1;
+    if (!reprojection_alloc(ctx, frame->width, frame->height)) {
+        for (int x = 0; x < frame->width; x++)
+            columns[count++] = x;
+        return count;
+    }
+
+    REPROJECTION_KEY key;
+    reprojection_make_key(frame, &key);
+    ctx->interlace_history_ok = ctx->reprojection_valid && interlace_same_scene(&key, &ctx->reprojection_key);
+    if (ctx->interlace_history_ok) {
+        float motion = fabsf(key.camera_x - ctx->reprojection_key.camera_x) + fabsf(key.camera_y - ctx->reprojection_key.camera_y) +
+                       fabsf(key.camera_z - ctx->reprojection_key.camera_z) +
+                       fabsf(key.camera_pitch - ctx->reprojection_key.camera_pitch) * INTERLACE_PITCH_SCALE;
+        ctx->interlace_weight = (motion >= INTERLACE_MOTION_FULL) ? 256 : (int)(motion / INTERLACE_MOTION_FULL * 256.0f);
+    } else {
+        ctx->interlace_weight = 256;
+    }
+    ctx->reprojection_key = key;
+
+    int cur = 1 - ctx->history_current;
+    frame->history_spans = ctx->history_spans[cur];
+    frame->history_count = ctx->history_count[cur];
+    frame->history_angle = ctx->history_angle[cur];
+    frame->history_water = ctx->history_water[cur];
+    for (int x = 0; x < frame->width; x++)
+        frame->history_count[x] = -1;
+
+    for (int x = ctx->interlace_field; x < frame->width; x += 2)
+        columns[count++] = x;
+    return count;
+}
+
+// Media por canal de dos colores empaquetados
+static inline uint32_t interlace_average(uint32_t a, uint32_t b) {
+    return (a & b) + (((a ^ b) & 0xFEFEFEFEu) >> 1);
+}
+
+// a + (b - a) * weight / 256 por canal, dos canales por multiplicación
+static inline uint32_t interlace_lerp(uint32_t a, uint32_t b, uint32_t weight) {
+    uint32_t rb = ((a & 0x00FF00FFu) * (256 - weight) + (b & 0x00FF00FFu) * weight) >> 8;
+    uint32_t ag = (((a >> 8) & 0x00FF00FFu) * (256 - weight) + ((b >> 8) & 0x00FF00FFu) * weight) >> 8;
+    return (rb & 0x00FF00FFu) | ((ag & 0x00FF00FFu) << 8);
+}
+
+// Busca en la historia anterior la columna marchada más cercana al ángulo de x
+static int interlace_history_source(const VOXEL_FRAME *frame, int x, int prev) {
+    const RENDER_CONTEXT *ctx = frame->ctx;
+    float angle = frame->base_angle + x * frame->angle_step;
+    int center = (int)floorf((angle - ctx->reprojection_base_angle) / frame->angle_step + 0.5f);
+
+    for (int d = 0; d <= 1; d++) {
+        for (int side = -d; side <= d; side += (d ? 2 : 1)) {
+            int src = center + side;
+            if (src >= 0 && src < frame->width && ctx->history_count[prev][src] >= 0 && !ctx->history_water[prev][src] &&
+                fabsf(ctx->history_angle[prev][src] - angle) <= INTERLACE_MAX_ERROR * frame->angle_step)
+                return src;
+        }
+    }
+    return -1;
+}
+
+// Reconstruye la columna x del campo que no se marchó en este frame
+static void interlace_reconstruct_column(VOXEL_FRAME *frame, int x, int prev) {
+    const RENDER_CONTEXT *ctx = frame->ctx;
+    GRAPH *dst = frame->dst;
+    HORIZON_SPAN *horizon = frame->horizon_spans + x * frame->height;
+    int src = ctx->interlace_history_ok ? interlace_history_source(frame, x, prev) : -1;
+    int weight = (src >= 0) ? ctx->interlace_weight : 256;
+    int left = (x > 0) ? x - 1 : x + 1;
+    int right = (x + 1 < frame->width) ? x + 1 : x - 1;
+
+    if (src >= 0) {
+        // Columna temporal: los tramos del frame anterior, como en la reproyección
+        const TERRAIN_SPAN *spans = ctx->history_spans[prev] + src * frame->height;
+        int count = ctx->history_count[prev][src];
+        for (int i = 0; i < count; i++) {
+            span_fill_column(dst, x, spans[i].y_start, spans[i].y_end, spans[i].color);
+            horizon[i].y_start = spans[i].y_start;
+            horizon[i].y_end = spans[i].y_end;
+            horizon[i].distance = spans[i].distance;
+        }
+        frame->horizon_count[x] = count;
+    } else {
+        // Sin historia la profundidad es la de la vecina izquierda
+        frame->horizon_count[x] = frame->horizon_count[left];
+        memcpy(horizon, frame->horizon_spans + left * frame->height,
+               frame->horizon_count[left] * sizeof(HORIZON_SPAN));
+    }
+
+    if (weight == 0)
+        return;
+
+    if (span_direct_ok(dst)) {
+        int stride = span_stride(dst);
+        uint32_t *pixel = span_pixel_ptr(dst, x, 0);
+        int to_left = left - x, to_right = right - x;
+        for (int y = 0; y < frame->height; y++, pixel += stride) {
+            uint32_t spatial = interlace_average(pixel[to_left], pixel[to_right]);
+            *pixel = (weight == 256) ? spatial : interlace_lerp(*pixel, spatial, (uint32_t)weight);
+        }
+    } else {
+        for (int y = 0; y < frame->height; y++) {
+            uint32_t spatial = interlace_average(gr_get_pixel(dst, left, y), gr_get_pixel(dst, right, y));
+            uint32_t color = (weight == 256) ? spatial
+                                             : interlace_lerp(gr_get_pixel(dst, x, y), spatial, (uint32_t)weight);
+            gr_put_pixel(dst, x, y, color);
+        }
+    }
+}
+
+static void interlace_end(VOXEL_FRAME *frame) {
+    const RENDER_CONTEXT *ctx = frame->ctx;
+    if (!frame->history_spans)
+        return;
+
+    int prev = ctx->history_current;
+    for (int x = 1 - ctx->interlace_field; x < frame->width; x += 2)
+        interlace_reconstruct_column(frame, x, prev);
+    reprojection_end(frame);
+}
+
+/* Render CPU entrelazado: cada frame marcha la mitad de las columnas (0 = desactivado, 1 = activado) */
+int64_t libmod_heightmap_set_interlaced(INSTANCE *my, int64_t *params) {
+    int64_t enabled = params[0];
+
+    if (enabled != 0 && enabled != 1) {
+        fprintf(stderr, "Error: interlaced debe ser 0 o 1\n");
+        return 0;
+    }
+
+    active_context->interlace_enabled = (int)enabled;
+    reprojection_invalidate();
+    if (!active_context->interlace_enabled && !active_context->reprojection_enabled)
+        reprojection_free(active_context);
+    return 1;
+}
+
+// ============================================================================
+// RASTERIZADO DE BILLBOARDS CON PRUEBA DE PROFUNDIDAD
+// ============================================================================
+// Los sprites se escalan aquí mismo (vecino más cercano) y cada columna de
+// destino se recorta contra los tramos de profundidad del terreno, así que un
+// árbol medio tapado por una loma se dibuja solo en la parte visible. Los
+// sprites se guardan premultiplicados por su alpha en una caché indexada por
+// GRAPH (hash abierto) que crece con los gráficos distintos visibles por frame
+// y expulsa por antigüedad los que dejan de usarse.
+
+#define BILLBOARD_SPRITE_MIN_ENTRIES 32
+#define BILLBOARD_DEPTH_TOLERANCE 2.0f
+
+typedef struct {
+    GRAPH *graph;
+    int64_t code;
+    int width, height;
+    void *source_pixels;         // surface->pixels al convertir: cambia si el GRAPH se recrea
+    int64_t source_dirty;        // texture_must_update al convertir
+    uint32_t last_frame;         // Último frame en que se dibujó (LRU)
+    uint32_t *pixels;            // ARGB8888 premultiplicado
+} BILLBOARD_SPRITE;
+
+static BILLBOARD_SPRITE *billboard_sprites = NULL;   // Entradas, compactas
+static int billboard_sprite_count = 0;
+static int billboard_sprite_capacity = 0;
+static int *billboard_sprite_slots = NULL;           // Índice+1 en billboard_sprites, 0 = libre
+static int billboard_sprite_slot_mask = -1;          // Tamaño de la tabla - 1 (potencia de dos)
+static uint32_t billboard_sprite_frame = 0;
+static int billboard_sprite_working_set = 0;         // Sprites distintos usados en el frame actual
+static int billboard_sprite_peak_working_set = 0;    // Máximo reciente, decae 1/16 por frame
+
+static void free_billboard_sprites(void) {
+    for (int i = 0; i < billboard_sprite_count; i++)
+        free(billboard_sprites[i].pixels);
+    free(billboard_sprites);
+    free(billboard_sprite_slots);
+    billboard_sprites = NULL;
+    billboard_sprite_slots = NULL;
+    billboard_sprite_count = billboard_sprite_capacity = 0;
+    billboard_sprite_slot_mask = -1;
+    billboard_sprite_working_set = billboard_sprite_peak_working_set = 0;
+}
+
+static inline uint32_t billboard_sprite_hash(const GRAPH *graph) {
+    uint64_t key = (uint64_t)(uintptr_t)graph;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (uint32_t)key;
+}
+
+// Rehace la tabla hash con al menos el doble de huecos que entradas
+static int billboard_sprite_rehash(int min_entries) {
+    int size = 64;
+    while (size < min_entries * 2)
+        size <<= 1;
+
+    if (size - 1 != billboard_sprite_slot_mask) {
+        int *slots = realloc(billboard_sprite_slots, (size_t)size * sizeof(int));
+        if (!slots)
+            return 0;
+        billboard_sprite_slots = slots;
+        billboard_sprite_slot_mask = size - 1;
+    }
+    memset(billboard_sprite_slots, 0, (size_t)(billboard_sprite_slot_mask + 1) * sizeof(int));
+
+    for (int i = 0; i < billboard_sprite_count; i++) {
+        uint32_t slot = billboard_sprite_hash(billboard_sprites[i].graph) & billboard_sprite_slot_mask;
+        while (billboard_sprite_slots[slot])
+            slot = (slot + 1) & billboard_sprite_slot_mask;
+        billboard_sprite_slots[slot] = i + 1;
+    }
+    return 1;
+}
+
+static int compare_billboard_sprites_by_age(const void *a, const void *b) {
+    uint32_t frame_a = ((const BILLBOARD_SPRITE *)a)->last_frame;
+    uint32_t frame_b = ((const BILLBOARD_SPRITE *)b)->last_frame;
+    return (frame_a < frame_b) ? 1 : (frame_a > frame_b) ? -1 : 0;
+}
+
+// Abre un frame de la caché: si sobran entradas respecto al conjunto de trabajo
+// reciente descarta las más antiguas, entre ellas las de GRAPHs ya descargados.
+// El pico decae despacio para que un frame sin billboards a la vista no vacíe la caché
+static void billboard_sprites_begin_frame(void) {
+    billboard_sprite_peak_working_set -= billboard_sprite_peak_working_set / 16;
+    if (billboard_sprite_working_set > billboard_sprite_peak_working_set)
+        billboard_sprite_peak_working_set = billboard_sprite_working_set;
+    billboard_sprite_working_set = 0;
+    billboard_sprite_frame++;
+
+    int limit = billboard_sprite_peak_working_set * 2;
+    if (limit < BILLBOARD_SPRITE_MIN_ENTRIES)
+        limit = BILLBOARD_SPRITE_MIN_ENTRIES;
+    if (billboard_sprite_count <= limit)
+        return;
+
+    qsort(billboard_sprites, billboard_sprite_count, sizeof(BILLBOARD_SPRITE), compare_billboard_sprites_by_age);
+    for (int i = limit; i < billboard_sprite_count; i++)
+        free(billboard_sprites[i].pixels);
+    billboard_sprite_count = limit;
+    billboard_sprite_rehash(limit);
+}
+
+static int billboard_sprite_convert(BILLBOARD_SPRITE *sprite, GRAPH *graph) {
+    int width = (int)graph->width;
+    int height = (int)graph->height;
+    uint32_t *pixels = sprite->pixels;
+    if (!pixels || sprite->width * sprite->height != width * height) {
+        pixels = realloc(sprite->pixels, (size_t)width * height * sizeof(uint32_t));
+        if (!pixels) {
+            fprintf(stderr, "Error: No se pudo asignar el sprite de billboard %dx%d\n", width, height);
+            return 0;
+        }
+    }
+
+    int direct = span_direct_ok(graph);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            uint32_t c = direct ? *span_pixel_ptr(graph, x, y) : gr_get_pixel(graph, x, y);
+            uint32_t a = gPixelFormat->Amask ? (c & gPixelFormat->Amask) >> gPixelFormat->Ashift : 255;
+            uint32_t r = ((c >> gPixelFormat->Rshift) & 0xFF) * a / 255;
+            uint32_t g = ((c >> gPixelFormat->Gshift) & 0xFF) * a / 255;
+            uint32_t b = ((c >> gPixelFormat->Bshift) & 0xFF) * a / 255;
+            pixels[y * width + x] = (a << 24) | (r << 16) | (g << 8) | b;
+        }
+    }
+
+    sprite->graph = graph;
+    sprite->code = graph->code;
+    sprite->width = width;
+    sprite->height = height;
+    sprite->source_pixels = graph->surface ? graph->surface->pixels : NULL;
+    sprite->source_dirty = graph->texture_must_update;
+    sprite->pixels = pixels;
+    return 1;
+}
+
+static const BILLBOARD_SPRITE *billboard_sprite_get(GRAPH *graph) {
+    BILLBOARD_SPRITE *sprite = NULL;
+    uint32_t slot = billboard_sprite_hash(graph) & billboard_sprite_slot_mask;
+
+    if (billboard_sprite_slots) {
+        while (billboard_sprite_slots[slot]) {
+            BILLBOARD_SPRITE *entry = &billboard_sprites[billboard_sprite_slots[slot] - 1];
+            if (entry->graph == graph) {
+                sprite = entry;
+                break;
+            }
+            slot = (slot + 1) & billboard_sprite_slot_mask;
+        }
+    }
+
+    if (sprite) {
+        // Ya comprobado en este frame: el GRAPH no cambia mientras se dibuja
+        if (sprite->last_frame == billboard_sprite_frame)
+            return sprite;
+
+        // Mismo GRAPH pero recreado o con píxeles tocados desde la conversión:
+        // las primitivas de dibujo marcan texture_must_update al modificarlo.
+        // Un GRAPH descargado no vuelve a pedirse y su entrada sale por antigüedad
+        void *source_pixels = graph->surface ? graph->surface->pixels : NULL;
+        if (sprite->code != graph->code || sprite->width != (int)graph->width ||
+            sprite->height != (int)graph->height || sprite->source_pixels != source_pixels ||
+            sprite->source_dirty != graph->texture_must_update) {
+            if (!billboard_sprite_convert(sprite, graph))
+                return NULL;
+        }
+    } else {
+        if (billboard_sprite_count == billboard_sprite_capacity) {
+            int capacity = billboard_sprite_capacity ? billboard_sprite_capacity * 2 : BILLBOARD_SPRITE_MIN_ENTRIES;
+            BILLBOARD_SPRITE *entries = realloc(billboard_sprites, (size_t)capacity * sizeof(BILLBOARD_SPRITE));
+            if (!entries) {
+                fprintf(stderr, "Error: No se pudo ampliar la caché de billboards a %d sprites\n", capacity);
+                return NULL;
+            }
+            billboard_sprites = entries;
+            billboard_sprite_capacity = capacity;
+        }
+
+        sprite = &billboard_sprites[billboard_sprite_count];
+        memset(sprite, 0, sizeof(*sprite));
+        if (!billboard_sprite_convert(sprite, graph)) {
+            free(sprite->pixels);
+            return NULL;
+        }
+        billboard_sprite_count++;
+
+        if (billboard_sprite_count * 2 > billboard_sprite_slot_mask + 1) {
+            if (!billboard_sprite_rehash(billboard_sprite_count)) {
+                free(sprite->pixels);
+                billboard_sprite_count--;
+                fprintf(stderr, "Error: No se pudo ampliar la tabla de sprites de billboard\n");
+                return NULL;
+            }
+        } else {
+            billboard_sprite_slots[slot] = billboard_sprite_count;
+        }
+    }
+
+    if (sprite->last_frame != billboard_sprite_frame) {
+        sprite->last_frame = billboard_sprite_frame;
+        billboard_sprite_working_set++;
+    }
+    return sprite;
+}
+
+// Primera fila tapada por terreno más cercano que distance en la columna x
+static int horizon_clip_y(const VOXEL_FRAME *frame, int x, float distance) {
+    int column = x - x % frame->quality_step;   // Columnas sin marchar: la marchada a su izquierda
+    const HORIZON_SPAN *spans = frame->horizon_spans + column * frame->height;
+    int count = frame->horizon_count[column];
+    int clip_y = frame->height;
+
+    // Los tramos van de abajo arriba a distancia creciente
+    for (int i = 0; i < count && spans[i].distance + BILLBOARD_DEPTH_TOLERANCE < distance; i++)
+        clip_y = spans[i].y_start;
+    return clip_y;
+}
+
+// Mezcla un texel premultiplicado (ya multiplicado por el alpha global) sobre dst
+static inline uint32_t billboard_blend(uint32_t src, uint32_t dst) {
+    uint32_t a = src >> 24;
+    uint32_t r = (src >> 16) & 0xFF;
+    uint32_t g = (src >> 8) & 0xFF;
+    uint32_t b = src & 0xFF;
+
+    if (a < 255) {
+        uint32_t inv = 255 - a;
+        r += ((dst >> gPixelFormat->Rshift) & 0xFF) * inv / 255;
+        g += ((dst >> gPixelFormat->Gshift) & 0xFF) * inv / 255;
+        b += ((dst >> gPixelFormat->Bshift) & 0xFF) * inv / 255;
+    }
+    return (r << gPixelFormat->Rshift) | (g << gPixelFormat->Gshift) | (b << gPixelFormat->Bshift) |
+           gPixelFormat->Amask;
+}
+
+static void rasterize_billboard(const VOXEL_FRAME *frame, GRAPH *graph, const BILLBOARD_PROJECTION *proj) {
+    const BILLBOARD_SPRITE *sprite = billboard_sprite_get(graph);
+    if (!sprite || proj->alpha == 0)
+        return;
+
+    // Misma escala que el gr_blit anterior, que recibía scaled_width/height como escala en %.
+    // El pie del sprite se apoya en screen_y (la base proyectada): centrado en
+    // vertical quedaba medio hundido y el recorte por profundidad le comía el tronco
+    double scale_x = proj->scaled_width / 100.0;
+    double scale_y = proj->scaled_height / 100.0;
+    int dst_w = (int)(sprite->width * scale_x);
+    int dst_h = (int)(sprite->height * scale_y);
+    if (dst_w < 1 || dst_h < 1)
+        return;
+    int x0 = (int)(proj->screen_x - proj->scaled_width / 2 - (sprite->width / 2) * scale_x);
+    int y0 = proj->screen_y - dst_h;
+
+    int i_start = (x0 < 0) ? -x0 : 0;
+    int i_end = (x0 + dst_w > frame->width) ? frame->width - x0 : dst_w;
+    uint32_t global_alpha = proj->alpha;
+    int direct = span_direct_ok(frame->dst);
+    int stride = direct ? span_stride(frame->dst) : 0;
+    uint32_t v_step = (uint32_t)(((uint64_t)sprite->height << 16) / dst_h);
+
+    for (int i = i_start; i < i_end; i++) {
+        int x = x0 + i;
+        int y_start = (y0 < 0) ? 0 : y0;
+        int y_end = y0 + dst_h;
+        int clip_y = horizon_clip_y(frame, x, proj->ground_distance);
+        if (y_end > clip_y)
+            y_end = clip_y;
+        if (y_start >= y_end)
+            continue;   // Columna tapada por completo
+
+        const uint32_t *texels = sprite->pixels + (size_t)i * sprite->width / dst_w;
+        uint32_t v = (uint32_t)(y_start - y0) * v_step;
+        uint32_t *pixel = direct ? span_pixel_ptr(frame->dst, x, y_start) : NULL;
+
+        for (int y = y_start; y < y_end; y++, v += v_step) {
+            uint32_t src = texels[(size_t)(v >> 16) * sprite->width];
+            if (global_alpha < 255) {
+                // En premultiplicado el alpha global escala los cuatro canales por igual
+                src = ((((src >> 24) & 0xFF) * global_alpha / 255) << 24) |
+                      ((((src >> 16) & 0xFF) * global_alpha / 255) << 16) |
+                      ((((src >> 8) & 0xFF) * global_alpha / 255) << 8) |
+                      ((src & 0xFF) * global_alpha / 255);
+            }
+
+            if ((src >> 24) != 0) {
+                if (direct)
+                    *pixel = billboard_blend(src, *pixel);
+                else
+                    gr_put_pixel(frame->dst, x, y, billboard_blend(src, gr_get_pixel(frame->dst, x, y)));
+            }
+            if (direct)
+                pixel += stride;
+        }
+    }
+}
+
+// ============================================================================
+// GOBERNADOR DE PRESUPUESTO DE FRAME
+// ============================================================================
+// Con HEIGHTMAP_SET_FRAME_BUDGET el render CPU mide su propio tiempo y se mueve
+// por una escala de niveles de calidad para ajustarse al presupuesto. Cada nivel
+// alarga el paso del ray-march, baja la resolución interna o acorta la distancia, sin
+// pasar nunca de lo que fijó el usuario (nivel 0 = su configuración). Con menos
+// resolución se reescala al tamaño pedido, así que el GRAPH devuelto no cambia.
+
+typedef struct {
+    float step_scale;       // Multiplicador del paso del ray-march
+    int resolution_pct;     // Resolución interna, en % de HEIGHTMAP_SET_RENDER_RESOLUTION
+    int distance_pct;       // Distancia de dibujado, en % de HEIGHTMAP_SET_RENDER_DISTANCE
+} GOVERNOR_LEVEL;
+
+// Ordenados de menor a mayor pérdida visual: primero un paso más largo, luego
+// resolución y por último distancia
+static const GOVERNOR_LEVEL governor_levels[] = {
+    {1.00f, 100, 100},
+    {1.25f, 100, 100},
+    {1.50f, 100, 90},
+    {1.50f, 85, 90},
+    {1.75f, 75, 80},
+    {2.00f, 62, 70},
+    {2.00f, 50, 60},
+};
+#define GOVERNOR_LEVEL_COUNT ((int)(sizeof(governor_levels) / sizeof(governor_levels[0])))
+
+#define GOVERNOR_EMA 0.25f            // Peso del último frame en la media de tiempos
+#define GOVERNOR_SETTLE_FRAMES 2      // Frames ignorados tras un cambio (se rehacen tablas)
+#define GOVERNOR_RAISE_FRAMES 30      // Frames holgados seguidos antes de subir calidad
+#define GOVERNOR_RAISE_MARGIN 0.7f    // Holgado: media por debajo del 70% del presupuesto
+#define GOVERNOR_MIN_WIDTH 64
+#define GOVERNOR_MIN_HEIGHT 48
+
+
+static int64_t render_voxelspace_frame(RENDER_CONTEXT *ctx, HEIGHTMAP *hm);
+
+static void governor_free(RENDER_CONTEXT *ctx) {
+    if (ctx->governor_output) {
+        bitmap_destroy(ctx->governor_output);
+        ctx->governor_output = NULL;
+    }
+    free(ctx->governor_scale_x);
+    ctx->governor_scale_x = NULL;
+    ctx->governor_scale_width = ctx->governor_scale_source = 0;
+}
+
+// Vecino más cercano de render_buffer a governor_output; las filas repetidas se copian
+static GRAPH *governor_upscale(RENDER_CONTEXT *ctx, int width, int height) {
+    if (!ctx->governor_output || ctx->governor_output->width != width || ctx->governor_output->height != height) {
+        if (ctx->governor_output)
+            bitmap_destroy(ctx->governor_output);
+        ctx->governor_output = bitmap_new_syslib(width, height);
+        if (!ctx->governor_output) {
+            fprintf(stderr, "Error: No se pudo crear la salida reescalada %dx%d\n", width, height);
+            return NULL;
+        }
+    }
+
+    int src_width = (int)ctx->render_buffer->width;
+    int src_height = (int)ctx->render_buffer->height;
+    if (ctx->governor_scale_width != width || ctx->governor_scale_source != src_width) {
+        int *table = realloc(ctx->governor_scale_x, width * sizeof(int));
+        if (!table)
+            return NULL;
+        ctx->governor_scale_x = table;
+        for (int x = 0; x < width; x++)
+            ctx->governor_scale_x[x] = x * src_width / width;
+        ctx->governor_scale_width = width;
+        ctx->governor_scale_source = src_width;
+    }
+
+    int direct = span_direct_ok(ctx->render_buffer) && span_direct_ok(ctx->governor_output);
+    int last_src_y = -1;
+    for (int y = 0; y < height; y++) {
+        int src_y = y * src_height / height;
+
+        if (direct && src_y == last_src_y) {
+            memcpy(span_pixel_ptr(ctx->governor_output, 0, y), span_pixel_ptr(ctx->governor_output, 0, y - 1),
+                   (size_t)width * sizeof(uint32_t));
+            continue;
+        }
+        if (direct) {
+            const uint32_t *src = span_pixel_ptr(ctx->render_buffer, 0, src_y);
+            uint32_t *dst = span_pixel_ptr(ctx->governor_output, 0, y);
+            for (int x = 0; x < width; x++)
+                dst[x] = src[ctx->governor_scale_x[x]];
+        } else {
+            for (int x = 0; x < width; x++)
+                gr_put_pixel(ctx->governor_output, x, y, gr_get_pixel(ctx->render_buffer, ctx->governor_scale_x[x], src_y));
+        }
+        last_src_y = src_y;
+    }
+    span_mark_dirty(ctx->governor_output);
+    return ctx->governor_output;
+}
+
+static void governor_change_level(RENDER_CONTEXT *ctx, int level) {
+    ctx->governor_level = level;
+    ctx->governor_settle = GOVERNOR_SETTLE_FRAMES;
+    ctx->governor_slack_frames = 0;
+}
+
+// Ajusta el nivel con el tiempo del último frame
+static void governor_update(RENDER_CONTEXT *ctx, float frame_ms) {
+    if (ctx->governor_settle > 0) {
+        // Tras un cambio se rehacen tablas y buffers: esos frames no cuentan
+        ctx->governor_settle--;
+        ctx->governor_average_ms = frame_ms;
+        return;
+    }
+
+    ctx->governor_average_ms += (frame_ms - ctx->governor_average_ms) * GOVERNOR_EMA;
+
+    if (ctx->governor_average_ms > ctx->frame_budget_ms) {
+        if (ctx->governor_level < ctx->governor_max_level)
+            governor_change_level(ctx, ctx->governor_level + 1);
+    } else if (ctx->governor_average_ms < ctx->frame_budget_ms * GOVERNOR_RAISE_MARGIN && ctx->governor_level > 0) {
+        if (++ctx->governor_slack_frames >= GOVERNOR_RAISE_FRAMES)
+            governor_change_level(ctx, ctx->governor_level - 1);
+    } else {
+        ctx->governor_slack_frames = 0;
+    }
+}
+
+// Configuración del usuario mientras dura un frame con el nivel del gobernador aplicado
+typedef struct {
+    int width, height;
+    float distance;
+    Uint64 start;
+    Uint64 elapsed;      // Ticks ya imputados al frame antes de start (render en lote)
+} GOVERNOR_STATE;
+
+// Aplica el nivel actual sobre los valores del usuario solo durante el frame
+static void governor_begin(RENDER_CONTEXT *ctx, GOVERNOR_STATE *user) {
+    const GOVERNOR_LEVEL *level = &governor_levels[ctx->governor_level];
+    user->width = ctx->render_width;
+    user->height = ctx->render_height;
+    user->distance = ctx->max_render_distance;
+
+    int width = user->width * level->resolution_pct / 100;
+    int height = user->height * level->resolution_pct / 100;
+    ctx->render_width = (width < GOVERNOR_MIN_WIDTH) ? GOVERNOR_MIN_WIDTH : width;
+    ctx->render_height = (height < GOVERNOR_MIN_HEIGHT) ? GOVERNOR_MIN_HEIGHT : height;
+    ctx->max_render_distance = fmaxf(100.0f, user->distance * level->distance_pct / 100.0f);
+    ctx->march_step_scale = level->step_scale;
+    user->start = SDL_GetPerformanceCounter();
+    user->elapsed = 0;
+}
+
+// Restaura los valores del usuario, reescala si hizo falta y ajusta el nivel con
+// el tiempo transcurrido desde start más el ya imputado. Devuelve el código del GRAPH de salida.
+static int64_t governor_end(RENDER_CONTEXT *ctx, const GOVERNOR_STATE *user, int64_t code) {
+    int scaled = (ctx->render_width != user->width || ctx->render_height != user->height);
+
+    ctx->render_width = user->width;
+    ctx->render_height = user->height;
+    ctx->max_render_distance = user->distance;
+    ctx->march_step_scale = 1.0f;
+
+    if (code && scaled) {
+        GRAPH *output = governor_upscale(ctx, user->width, user->height);
+        code = output ? output->code : 0;
+    }
+
+    if (code)
+        governor_update(ctx, (float)((SDL_GetPerformanceCounter() - user->start + user->elapsed) * 1000.0 /
+                                     SDL_GetPerformanceFrequency()));
+    return code;
+}
+
+// Render CPU de un contexto, con el gobernador si tiene presupuesto. Devuelve el
+// código del GRAPH de salida (render_buffer o la salida reescalada) o 0.
+static int64_t render_voxelspace_context(RENDER_CONTEXT *ctx, HEIGHTMAP *hm) {
+    if (ctx->frame_budget_ms <= 0.0f)
+        return render_voxelspace_frame(ctx, hm);
+
+    GOVERNOR_STATE user;
+    governor_begin(ctx, &user);
+    return governor_end(ctx, &user, render_voxelspace_frame(ctx, hm));
+}
+
+int64_t libmod_heightmap_render_voxelspace(INSTANCE *my, int64_t *params) {
+    HEIGHTMAP *hm = find_heightmap_by_id(params[0]);
+    if (!hm || !hm->cache_valid)
+        return 0;
+
+    return render_voxelspace_context(active_context, hm);
+}
+
+/* Presupuesto en ms del render CPU (0 = sin gobernador) y nivel de calidad más bajo permitido (-1 = todos) */
+int64_t libmod_heightmap_set_frame_budget(INSTANCE *my, int64_t *params) {
+    float budget = *(float *)&params[0];
+    int64_t max_level = params[1];
+
+    if (budget < 0.0f || budget > 1000.0f) {
+        fprintf(stderr, "Error: frame_budget debe estar entre 0 y 1000 ms\n");
+        return 0;
+    }
+    if (max_level < -1 || max_level >= GOVERNOR_LEVEL_COUNT) {
+        fprintf(stderr, "Error: el nivel de calidad más bajo debe estar entre -1 y %d\n", GOVERNOR_LEVEL_COUNT - 1);
+        return 0;
+    }
+
+    active_context->frame_budget_ms = budget;
+    active_context->governor_max_level = (max_level < 0) ? GOVERNOR_LEVEL_COUNT - 1 : (int)max_level;
+    governor_change_level(active_context, 0);
+    if (budget <= 0.0f)
+        governor_free(active_context);
+    return 1;
+}
+
+/* Nivel de calidad actual del gobernador: 0 = configuración del usuario, mayor = más barato */
+int64_t libmod_heightmap_get_quality_level(INSTANCE *my, int64_t *params) {
+    return (active_context->frame_budget_ms > 0.0f) ? active_context->governor_level : 0;
+}
+
+// ============================================================================
+// GESTIÓN DE CONTEXTOS DE RENDER
+// ============================================================================
+
+static void render_context_free_buffers(RENDER_CONTEXT *ctx) {
+    free(ctx->horizon_spans);
+    free(ctx->horizon_count);
+    free(ctx->span_colors);
+    free(ctx->span_fog);
+    free(ctx->cos_cache);
+    free(ctx->sin_cache);
+    free(ctx->march_columns);
+    ctx->horizon_spans = NULL;
+    ctx->horizon_count = NULL;
+    ctx->span_colors = NULL;
+    ctx->span_fog = NULL;
+    ctx->cos_cache = NULL;
+    ctx->sin_cache = NULL;
+    ctx->march_columns = NULL;
+    ctx->buffer_width = ctx->buffer_height = 0;
+}
+
+// Buffers por píxel y por columna del render CPU: solo se recrean al cambiar la resolución
+static int render_context_buffers(RENDER_CONTEXT *ctx, int width, int height) {
+    if (ctx->horizon_spans && ctx->buffer_width == width && ctx->buffer_height == height)
+        return 1;
+
+    render_context_free_buffers(ctx);
+    ctx->horizon_spans = malloc((size_t)width * height * sizeof(HORIZON_SPAN));
+    ctx->horizon_count = malloc(width * sizeof(int));
+    ctx->span_colors = malloc((size_t)width * height * sizeof(uint32_t));
+    ctx->span_fog = malloc((size_t)width * height);
+    ctx->cos_cache = malloc(width * sizeof(float));
+    ctx->sin_cache = malloc(width * sizeof(float));
+    ctx->march_columns = malloc(width * sizeof(int));
+    if (!ctx->horizon_spans || !ctx->horizon_count || !ctx->span_colors || !ctx->span_fog ||
+        !ctx->cos_cache || !ctx->sin_cache || !ctx->march_columns) {
+        fprintf(stderr, "Error: No se pudieron asignar los buffers de render %dx%d\n", width, height);
+        render_context_free_buffers(ctx);
+        return 0;
+    }
+    ctx->buffer_width = width;
+    ctx->buffer_height = height;
+    return 1;
+}
+
+// Libera todo lo que posee el contexto; la configuración se conserva
+static void render_context_free(RENDER_CONTEXT *ctx) {
+    if (ctx->render_buffer) {
+        bitmap_destroy(ctx->render_buffer);
+        ctx->render_buffer = NULL;
+    }
+    render_context_free_buffers(ctx);
+    free(ctx->fog_table);
+    ctx->fog_table = NULL;
+    ctx->fog_table_size = 0;
+    ctx->fog_table_initialized = 0;
+    free(ctx->march_distances);
+    ctx->march_distances = NULL;
+    ctx->march_count = 0;
+    ctx->march_table_distance = -1.0f;
+    free_fog_lut(ctx);
+    free_sky_tables(ctx);
+    free_water_field(&ctx->water);
+    reprojection_free(ctx);
+    governor_free(ctx);
+}
+
+static RENDER_CONTEXT *find_render_context(int64_t id) {
+    if (id < 0 || id >= MAX_RENDER_CONTEXTS)
+        return NULL;
+    return render_contexts[id];
 }
 
-int64_t libmod_heightmap_render_voxelspace(INSTANCE *my, int64_t *params) {    
-    int64_t hm_id = params[0];    
-    HEIGHTMAP *hm = NULL;    
-    for (int i = 0; i < MAX_HEIGHTMAPS; i++) {    
-        if (heightmaps[i].id == hm_id) {    
-            hm = &heightmaps[i];    
-            break;    
-        }    
-    }    
-        
-    if (!hm || !hm->cache_valid)    
-        return 0;    
-            
-    if (!render_buffer) {    
-        render_buffer = bitmap_new_syslib(160, 120);    
-        if (!render_buffer) return 0;    
-    }    
-        
-    static float *depth_buffer = NULL;    
-    if (!depth_buffer) {    
-        depth_buffer = malloc(320 * 240 * sizeof(float));    
-    }    
-        
-    for (int i = 0; i < 320 * 240; i++) {    
-        depth_buffer[i] = max_render_distance;    
-    }    
-        
-    uint32_t background_color = SDL_MapRGBA(gPixelFormat, sky_color_r, sky_color_g, sky_color_b, sky_color_a);    
-        
-    static float last_camera_x = 0, last_camera_y = 0, last_camera_angle = 0;    
-    float movement = fabs(camera.x - last_camera_x) + fabs(camera.y - last_camera_y) + fabs(camera.angle - last_camera_angle);    
-    int quality_step = (movement > 15.0f) ? 2 : 1;  // Umbral más alto
-    last_camera_x = camera.x;    
-    last_camera_y = camera.y;    
-    last_camera_angle = camera.angle;    
-        
-    int chunk_x = (int)(camera.x / chunk_size);    
-    int chunk_y = (int)(camera.y / chunk_size);    
-    int min_chunk_x = chunk_x - chunk_radius;    
-    int max_chunk_x = chunk_x + chunk_radius;    
-    int min_chunk_y = chunk_y - chunk_radius;    
-    int max_chunk_y = chunk_y + chunk_radius;    
-        
-    float terrain_fov = 0.7f;    
-    float angle_step = terrain_fov / 320.0f;    
-    float base_angle = camera.angle - terrain_fov * 0.5f;    
-    float pitch_offset = camera.pitch * 40.0f;    
-    float light_factor = light_intensity / 255.0f;    
-        
-    float time = SDL_GetTicks() / 1000.0f;    
-    static float cached_water_time = 0.0f;    
-    static int water_frame_counter = 0;    
-        
-    if (water_frame_counter % 4 == 0) {    
-        cached_water_time = time;    
-    }    
-    water_frame_counter++;    
-    render_skybox(camera.angle, camera.pitch, cached_water_time, quality_step);  
-      
-   
-        
-    int camera_underwater = (camera.z < water_level);    
-        
-    if (camera_underwater) {    
-        light_factor *= 0.7f;    
-        background_color = SDL_MapRGBA(gPixelFormat,    
-            sky_color_r * 0.5f, sky_color_g * 0.7f, sky_color_b * 1.0f, sky_color_a);    
-        gr_clear_as(render_buffer, background_color);    
-    }    
-        
-    if (!fog_table_initialized || fog_table_size != (int)max_render_distance) {    
-        if (fog_table)    
-            free(fog_table);    
-        fog_table_size = (int)max_render_distance;    
-        fog_table = malloc(fog_table_size * sizeof(float));    
-            
-        for (int i = 0; i < fog_table_size; i++) {      
-        float fog = 1.0f - (i / (float)fog_table_size);  
-        // Solo aplicar mínimo si fog_intensity > 0  
-        if (fog_intensity > 0.0f) {  
-        fog_table[i] = (fog < 0.6f) ? 0.6f : fog;  
-        } else {  
-        fog_table[i] = fog;  // Sin mínimo cuando fog_intensity = 0  
-    }  
+/* Crear un contexto de render (vista) de width x height con la cámara y la configuración del contexto activo. Devuelve su id o 0 */
+int64_t libmod_heightmap_create_context(INSTANCE *my, int64_t *params) {
+    int64_t width = params[0];
+    int64_t height = params[1];
+
+    if (width < 160 || width > 1920) {
+        fprintf(stderr, "Error: render_width debe estar entre 160 y 1920\n");
+        return 0;
+    }
+    if (height < 120 || height > 1080) {
+        fprintf(stderr, "Error: render_height debe estar entre 120 y 1080\n");
+        return 0;
+    }
+
+    int id = 1;
+    while (id < MAX_RENDER_CONTEXTS && render_contexts[id])
+        id++;
+    if (id == MAX_RENDER_CONTEXTS) {
+        fprintf(stderr, "Error: No quedan contextos de render libres (máximo %d)\n", MAX_RENDER_CONTEXTS - 1);
+        return 0;
+    }
+
+    RENDER_CONTEXT *ctx = malloc(sizeof(RENDER_CONTEXT));
+    if (!ctx) {
+        fprintf(stderr, "Error: No se pudo asignar el contexto de render\n");
+        return 0;
+    }
+
+    // Se heredan la cámara y los ajustes, nunca los buffers ni las cachés
+    const RENDER_CONTEXT *source = active_context;
+    render_context_init(ctx, id);
+    ctx->camera = source->camera;
+    ctx->render_width = (int)width;
+    ctx->render_height = (int)height;
+    ctx->max_render_distance = source->max_render_distance;
+    ctx->sky_color_r = source->sky_color_r;
+    ctx->sky_color_g = source->sky_color_g;
+    ctx->sky_color_b = source->sky_color_b;
+    ctx->sky_color_a = source->sky_color_a;
+    ctx->fog_color_r = source->fog_color_r;
+    ctx->fog_color_g = source->fog_color_g;
+    ctx->fog_color_b = source->fog_color_b;
+    ctx->fog_intensity = source->fog_intensity;
+    ctx->lod_pixel_error = source->lod_pixel_error;
+    ctx->reprojection_enabled = source->reprojection_enabled;
+    ctx->interlace_enabled = source->interlace_enabled;
+    ctx->frame_budget_ms = source->frame_budget_ms;
+    ctx->governor_max_level = source->governor_max_level;
+
+    render_contexts[id] = ctx;
+    return id;
 }
-        fog_table_initialized = 1;    
-    }    
-     
-        // NUEVO: Precalcular cos/sin para todas las columnas  
-        static float cos_cache[320];  
-        static float sin_cache[320];  
-        for (int i = 0; i < 320; i++) {  
-        float angle = base_angle + i * angle_step;  
-        cos_cache[i] = cosf(angle);  
-        sin_cache[i] = sinf(angle);  
-    }
-        // Precalcular límites de FOV (ANTES del loop)  
-        float camera_fov_half = terrain_fov * 0.5f;      
-        float min_angle = camera.angle - camera_fov_half;      
-        float max_angle = camera.angle + camera_fov_half;  
-  
-        for (int screen_x = 0; screen_x < 320; screen_x += quality_step) {      
-        float angle = base_angle + screen_x * angle_step;      
-          
-        if (angle < min_angle || angle > max_angle)      
-        continue;      
-          
-        float cos_angle = cos_cache[screen_x];  
-        float sin_angle = sin_cache[screen_x];  
-        int lowest_y = 240;    
-            
-        for (float distance = 1.0f; distance < max_render_distance;   
-        distance += (distance < 50.0f ? 0.3f : distance < 200.0f ? 0.8f : 1.5f)){    
-            float world_x = camera.x + cos_angle * distance;    
-            float world_y = camera.y + sin_angle * distance;    
-            
-            if (world_x < 0 || world_x >= hm->width - 1 || world_y < 0 || world_y >= hm->height - 1)    
-                continue;    
-            
-            int current_chunk_x = (int)(world_x / chunk_size);    
-            int current_chunk_y = (int)(world_y / chunk_size);    
-            if (current_chunk_x < min_chunk_x || current_chunk_x > max_chunk_x ||    
-                current_chunk_y < min_chunk_y || current_chunk_y > max_chunk_y) {    
-                continue;    
-            }    
-            
-            float terrain_height = get_height_at(hm, world_x, world_y);    
-              
-            // Renderizar terreno/agua según su altura real    
-            float render_height;    
-            int render_water = 0;    
-                
-            if (water_level > 0 && terrain_height < water_level) {  
-            // Aproximación simple del ruido para CPU (usando múltiples ondas)  
-            float wave1 = sin(cached_water_time * 0.5f + world_x * 0.05f) * wave_amplitude * 0.5f;  
-            float wave2 = sin(cached_water_time * 0.8f + world_y * 0.03f) * wave_amplitude * 0.3f;  
-            float wave3 = sin(cached_water_time * 1.2f + (world_x + world_y) * 0.02f) * wave_amplitude * 0.2f;  
-            float simple_wave = wave1 + wave2 + wave3;  
-      
-    render_height = water_level + simple_wave;  
-    render_water = 1; 
-            } else {    
-                
-                render_height = terrain_height;    
-            }    
-                
-            float height_on_screen = (camera.z - render_height) / distance * 300.0f + 120.0f;    
-            height_on_screen += pitch_offset;    
-                
-            int screen_y = (int)height_on_screen;    
-            if (screen_y < 0)    
-                screen_y = 0;    
-            if (screen_y >= 240)    
-                continue;    
-                
-            if (screen_y < lowest_y) {    
-                int fog_index = (int)distance;    
-                if (fog_index >= fog_table_size)    
-                    fog_index = fog_table_size - 1;    
-                float fog = fog_table[fog_index];    
-                    
-                if (render_water) {    
-                    // Renderizar agua (sin cambios)  
-                if (water_texture && water_texture->width > 0 && water_texture->height > 0) {  
-                float u = (world_x * 0.01f + cached_water_time * 0.1f);  
-                float v = (world_y * 0.01f + cached_water_time * 0.05f);  
-      
-                u = u - floor(u);  
-                v = v - floor(v);  
-      
-                int tex_x = (int)(u * water_texture->width);  
-                int tex_y = (int)(v * water_texture->height);  
-      
-                 // Clamp en lugar de modulo para evitar valores negativos  
-                tex_x = (tex_x < 0) ? 0 : (tex_x >= water_texture->width) ? water_texture->width - 1 : tex_x;  
-                tex_y = (tex_y < 0) ? 0 : (tex_y >= water_texture->height) ? water_texture->height - 1 : tex_y;   
-                            
-                      //                        uint32_t water_color = gr_get_pixel(water_texture, tex_x, tex_y);
-//
-                        BGD_Rect clip;
-                        clip.x = tex_x;
-                        clip.y = tex_y;
-                        clip.w = 1;
-                        clip.h = 1;
-
-//                        {
-//                            uint8_t r, g, b;
-//                            SDL_GetRGB(water_color, gPixelFormat, &r, &g, &b);
-//                            water_color = SDL_MapRGBA(gPixelFormat, r, g, b, 128);
-//                        }
-
-                        gr_blit(render_buffer, NULL,
-                               screen_x, screen_y,
-                               0,
-                               0,
-                               100, 100*(lowest_y-screen_y+1),
-                               0, 0,
-                               water_texture, &clip, 128, 255, 255, 255, BLEND_NORMAL, NULL);
-
-                        for (int y = screen_y; y < lowest_y; y++) {
-//                            gr_put_pixel(render_buffer, screen_x, y, water_color);
-                            int depth_index = y * 320 + screen_x;
-                            if (depth_index >= 0 && depth_index < 320 * 240) {
-                                depth_buffer[depth_index] = distance;
-                            }
-                        } 
-                    }
-                } else {    
-                    // Renderizar terreno normal con efectos atmosféricos avanzados  
-                    GRAPH* texture_to_use = hm->texturemap;    
-                    Uint8 terrain_r = 0, terrain_g = 0, terrain_b = 0;    
-                        
-                    if (texture_to_use) {    
-                        uint32_t tex = get_texture_color_bilinear(texture_to_use, world_x, world_y);    
-                        if (tex == 0) {    
-                            int tx = (int)world_x;    
-                            int ty = (int)world_y;    
-                            while (tx >= texture_to_use->width)    
-                                tx -= texture_to_use->width;    
-                            while (ty >= texture_to_use->height)    
-                                ty -= texture_to_use->height;    
-                            while (tx < 0)    
-                                tx += texture_to_use->width;    
-                            while (ty < 0)    
-                                ty += texture_to_use->height;    
-                            tex = gr_get_pixel(texture_to_use, tx, ty);    
-                        }    
-
-                    // DESPUÉS (versión correcta):  
-                    terrain_r = (tex >> gPixelFormat->Rshift) & 0xFF;  
-                    terrain_g = (tex >> gPixelFormat->Gshift) & 0xFF;  
-                    terrain_b = (tex >> gPixelFormat->Bshift) & 0xFF;
-
-                    } else {    
-                        int base = (int)(terrain_height * 2.5f) + 20;    
-                        if (base > 255) base = 255;    
-                        if (base < 0) base = 0;    
-                            
-                        int grid_x = (int)(world_x * 2.0f) % 8;    
-                        int grid_y = (int)(world_y * 2.0f) % 8;    
-                        int grid_variation = (grid_x + grid_y) % 3 - 1;    
-                        base += grid_variation * 15;    
-                        if (base > 255) base = 255;    
-                        if (base < 0) base = 0;    
-                            
-                        terrain_r = (Uint8)((base + 60));    
-                        terrain_g = (Uint8)((base + 30));    
-                        terrain_b = (Uint8)(base);    
-                    }    
-                        
-                 uint32_t terrain_color = SDL_MapRGB(gPixelFormat, terrain_r, terrain_g, terrain_b);  
-// NIEBLA FORZADA - después de la línea 946  
-if (fog_intensity > 0.0f) {  
-    // Aplicar niebla desde distancias más cercanas  
-    if (distance > max_render_distance * 0.2f) {  
-        float fog_progress = (distance - max_render_distance * 0.2f) / (max_render_distance * 0.8f);  
-          
-        // Factor de niebla MUY agresivo para que se vea  
-        float fog_factor = fog_progress * fog_intensity * 2.0f; // Multiplicador x2  
-          
-        if (fog_factor > 0.9f) fog_factor = 0.9f; // Permitir hasta 90% de niebla  
-          
-        if (fog_factor > 0.1f) { // Aplicar desde 10% en adelante  
-            float terrain_factor = 1.0f - fog_factor;  
-              
-            Uint8 final_r = (Uint8)(terrain_r * terrain_factor + fog_color_r * fog_factor);  
-            Uint8 final_g = (Uint8)(terrain_g * terrain_factor + fog_color_g * fog_factor);  
-            Uint8 final_b = (Uint8)(terrain_b * terrain_factor + fog_color_b * fog_factor);  
-              
-            terrain_color = SDL_MapRGB(gPixelFormat, final_r, final_g, final_b);  
-        }  
-    }  
+
+/* Activar un contexto de render: las demás funciones actúan sobre él (0 = por defecto). Devuelve el que estaba activo o -1 */
+int64_t libmod_heightmap_select_context(INSTANCE *my, int64_t *params) {
+    RENDER_CONTEXT *ctx = find_render_context(params[0]);
+    if (!ctx) {
+        fprintf(stderr, "Error: Contexto de render %" PRId64 " no encontrado\n", params[0]);
+        return -1;
+    }
+
+    int64_t previous = active_context->id;
+    active_context = ctx;
+    return previous;
 }
-                    for (int y = screen_y; y < lowest_y; y++) {    
-                        gr_put_pixel(render_buffer, screen_x, y, terrain_color);    
-                        int depth_index = y * 320 + screen_x;    
-                        if (depth_index >= 0 && depth_index < 320 * 240) {    
-                            depth_buffer[depth_index] = distance;    
-                        }    
-                    }    
-                }    
-                    
-                lowest_y = screen_y;    
-            }    
-            if (lowest_y <= 0)    
-                break;    
-        }    
-    }    
-        
-        
-// Array temporal para todos los billboards visibles    
-BILLBOARD_RENDER_DATA visible_billboards[MAX_STATIC_BILLBOARDS + MAX_DYNAMIC_BILLBOARDS];    
-int visible_count = 0;    
-    
-// PASO 4A: Recopilar billboards estáticos visibles    
-collect_visible_billboards_from_array(static_billboards, static_billboard_count,   
-                                     visible_billboards, &visible_count, terrain_fov); 
-    
-// PASO 4B: Recopilar billboards dinámicos visibles    
-collect_visible_billboards_from_array(dynamic_billboards, MAX_DYNAMIC_BILLBOARDS,   
-                                     visible_billboards, &visible_count, terrain_fov);
-    
-// PASO 4C: Ordenar por distancia (más lejanos primero)    
-qsort(visible_billboards, visible_count, sizeof(BILLBOARD_RENDER_DATA), compare_billboards_by_distance);    
-    
-// PASO 4D: Renderizar en orden correcto con fade-out mejorado  
-for (int i = 0; i < visible_count; i++) {    
-    BILLBOARD_RENDER_DATA *render_data = &visible_billboards[i];    
-    BILLBOARD_PROJECTION proj = render_data->projection;    
-        
-    // Aplicar la verificación de oclusión mejorada    
-    int billboard_visible = 1;    
-    int center_x = proj.screen_x;    
-    int center_y = proj.screen_y;    
-    int half_width = proj.scaled_width / 2;    
-    int half_height = proj.scaled_height / 2;    
-        
-    float depth_tolerance = 2.0f;    
-    int occlusion_samples = 0;    
-    int total_samples = 0;    
-    
-    for (int check_y = center_y - half_height; check_y <= center_y + half_height; check_y += 8) {    
-        for (int check_x = center_x - half_width; check_x <= center_x + half_width; check_x += 8) {    
-            if (check_x >= 0 && check_x < 320 && check_y >= 0 && check_y < 240) {    
-                int depth_index = check_y * 320 + check_x;    
-                total_samples++;    
-                if (proj.distance > depth_buffer[depth_index] + depth_tolerance) {    
-                    occlusion_samples++;    
-                }    
-            }    
-        }    
-    }    
-        
-    if (total_samples > 0 && (float)occlusion_samples / total_samples > 0.75f) {    
-        billboard_visible = 0;    
-    }    
-    
-    if (!billboard_visible) continue;    
-    
-    // Renderizar billboard con alpha mejorado (incluye fade-out)  
-    gr_blit(render_buffer, NULL,    
-           proj.screen_x - proj.scaled_width/2,    
-           proj.screen_y - proj.scaled_height/2,    
-           0, 0, proj.scaled_width, proj.scaled_height,    
-           render_data->graph->width/2, render_data->graph->height/2,    
-           render_data->graph, NULL, 255, 255, 255, proj.alpha, 0, NULL);    
-    
-    // Actualizar depth buffer    
-    int update_radius = 2;    
-    for (int y = center_y - update_radius; y <= center_y + update_radius; y++) {    
-        for (int x = center_x - update_radius; x <= center_x + update_radius; x++) {    
-            if (x >= 0 && x < 320 && y >= 0 && y < 240) {    
-                int idx = y * 320 + x;    
-                if (proj.distance < depth_buffer[idx]) {    
-                    depth_buffer[idx] = proj.distance;    
-                }    
-            }    
-        }    
-    }    
+
+/* Destruir un contexto de render y su GRAPH de salida. El contexto 0 no se puede destruir */
+int64_t libmod_heightmap_destroy_context(INSTANCE *my, int64_t *params) {
+    int64_t id = params[0];
+
+    if (id == 0) {
+        fprintf(stderr, "Error: El contexto de render por defecto no se puede destruir\n");
+        return 0;
+    }
+    RENDER_CONTEXT *ctx = find_render_context(id);
+    if (!ctx) {
+        fprintf(stderr, "Error: Contexto de render %" PRId64 " no encontrado\n", id);
+        return 0;
+    }
+
+    if (active_context == ctx)
+        active_context = &default_context;
+    render_context_free(ctx);
+    free(ctx);
+    render_contexts[id] = NULL;
+    return 1;
 }
-      
-    return render_buffer->code;  
+
+#define CPU_TERRAIN_FOV 0.7f
+
+// Tick de agua del contexto: se refresca cada 4 frames
+static float render_water_time(RENDER_CONTEXT *ctx) {
+    float time = SDL_GetTicks() / 1000.0f;
+    if (ctx->water_frame_counter % 4 == 0) {
+        ctx->cached_water_time = time;
+    }
+    ctx->water_frame_counter++;
+    return ctx->cached_water_time;
+}
+
+// Ventana de chunks alrededor de la cámara, recortada al mapa
+static void render_chunk_window(const RENDER_CONTEXT *ctx, const HEIGHTMAP *hm, VOXEL_FRAME *frame) {
+    int chunk_x = (int)(ctx->camera.x / chunk_size);
+    int chunk_y = (int)(ctx->camera.y / chunk_size);
+
+    frame->min_chunk_x = chunk_x - chunk_radius;
+    frame->max_chunk_x = chunk_x + chunk_radius;
+    frame->min_chunk_y = chunk_y - chunk_radius;
+    frame->max_chunk_y = chunk_y + chunk_radius;
+    frame->window_x0 = fmaxf(0.0f, (float)(frame->min_chunk_x * chunk_size));
+    frame->window_x1 = fminf((float)(hm->width - 1), (float)((frame->max_chunk_x + 1) * chunk_size));
+    frame->window_y0 = fmaxf(0.0f, (float)(frame->min_chunk_y * chunk_size));
+    frame->window_y1 = fminf((float)(hm->height - 1), (float)((frame->max_chunk_y + 1) * chunk_size));
+}
+
+// Prepara el frame de un contexto: buffer de salida, cielo, tablas y columnas a
+// marchar. Con shared_water se usa ese campo de agua, ya construido para una
+// ventana que contiene la de esta vista; si no, se construye el del contexto.
+static int render_frame_begin(RENDER_CONTEXT *ctx, HEIGHTMAP *hm, float water_time,
+                              const PRECALC_WATER_DATA *shared_water, VOXEL_FRAME *frame) {
+    // Resolución interna fijada con HEIGHTMAP_SET_RENDER_RESOLUTION
+    int render_width = ctx->render_width;
+    int render_height = ctx->render_height;
+
+    if (!ctx->render_buffer || ctx->render_buffer->width != render_width || ctx->render_buffer->height != render_height) {
+        if (ctx->render_buffer) bitmap_destroy(ctx->render_buffer);
+        ctx->render_buffer = bitmap_new_syslib(render_width, render_height);
+        if (!ctx->render_buffer) return 0;
+    }
+
+    // Buffers por píxel y por columna: solo se recrean al cambiar la resolución
+    if (!render_context_buffers(ctx, render_width, render_height))
+        return 0;
+
+    // Sin tramos la columna es todo cielo
+    memset(ctx->horizon_count, 0, render_width * sizeof(int));
+
+    uint32_t background_color = SDL_MapRGBA(gPixelFormat, ctx->sky_color_r, ctx->sky_color_g, ctx->sky_color_b, ctx->sky_color_a);
+
+    float movement = fabs(ctx->camera.x - ctx->last_camera_x) + fabs(ctx->camera.y - ctx->last_camera_y) +
+                     fabs(ctx->camera.angle - ctx->last_camera_angle);
+    // Con entrelazado o con presupuesto de frame la calidad la decide otro mecanismo
+    int quality_step = (!ctx->interlace_enabled && ctx->frame_budget_ms <= 0.0f && movement > 15.0f) ? 2 : 1;  // Umbral más alto
+    ctx->last_camera_x = ctx->camera.x;
+    ctx->last_camera_y = ctx->camera.y;
+    ctx->last_camera_angle = ctx->camera.angle;
+
+    float terrain_fov = CPU_TERRAIN_FOV;
+    float angle_step = terrain_fov / (float)render_width;
+    float base_angle = ctx->camera.angle - terrain_fov * 0.5f;
+    float light_factor = light_intensity / 255.0f;
+
+    // Bajo el agua el fondo es un color plano: no hace falta dibujar el cielo
+    int camera_underwater = (ctx->camera.z < water_level);
+
+    if (camera_underwater) {
+        light_factor *= 0.7f;
+        background_color = SDL_MapRGBA(gPixelFormat,
+            ctx->sky_color_r * 0.5f, ctx->sky_color_g * 0.7f, ctx->sky_color_b * 1.0f, ctx->sky_color_a);
+        gr_clear_as(ctx->render_buffer, background_color);
+    } else {
+        render_skybox(ctx, water_time, quality_step);
+    }
+
+    if (!ctx->fog_table_initialized || ctx->fog_table_size != (int)ctx->max_render_distance) {
+        if (ctx->fog_table)
+            free(ctx->fog_table);
+        ctx->fog_table_size = (int)ctx->max_render_distance;
+        ctx->fog_table = malloc(ctx->fog_table_size * sizeof(float));
+
+        for (int i = 0; i < ctx->fog_table_size; i++) {
+            float fog = 1.0f - (i / (float)ctx->fog_table_size);
+            // Solo aplicar mínimo si fog_intensity > 0
+            if (ctx->fog_intensity > 0.0f) {
+                ctx->fog_table[i] = (fog < 0.6f) ? 0.6f : fog;
+            } else {
+                ctx->fog_table[i] = fog;  // Sin mínimo cuando fog_intensity = 0
+            }
+        }
+        ctx->fog_table_initialized = 1;
+    }
+
+    if (!build_march_distances(ctx, angle_step))
+        return 0;
+
+    // Texels de altura y color: se rehacen si cambió la textura o la luz
+    if (!hm->texel_cache || hm->texel_cache_texture != hm->texturemap || hm->texel_cache_light != light_intensity) {
+        if (!build_texel_cache(hm))
+            return 0;
+    }
+
+    // Precalcular cos/sin para todas las columnas
+    for (int i = 0; i < render_width; i++) {
+        float angle = base_angle + i * angle_step;
+        ctx->cos_cache[i] = cosf(angle);
+        ctx->sin_cache[i] = sinf(angle);
+    }
+
+    frame->ctx = ctx;
+    frame->hm = hm;
+    frame->dst = ctx->render_buffer;
+    frame->camera = ctx->camera;
+    frame->max_distance = ctx->max_render_distance;
+    frame->horizon_spans = ctx->horizon_spans;
+    frame->horizon_count = ctx->horizon_count;
+    frame->span_colors = ctx->span_colors;
+    frame->span_fog = ctx->span_fog;
+    frame->fog_lut = NULL;
+    frame->fog_lut_size = 0;
+    frame->fog_visible_from = 0.0f;
+    frame->fog_color = SDL_MapRGB(gPixelFormat, ctx->fog_color_r, ctx->fog_color_g, ctx->fog_color_b);
+    if (ctx->fog_intensity > 0.0f) {
+        if (!build_fog_lut(ctx))
+            return 0;
+        frame->fog_lut = ctx->fog_lut;
+        frame->fog_lut_size = ctx->fog_lut_size;
+        frame->fog_visible_from = ctx->fog_lut_visible_from;
+    }
+    frame->cos_cache = ctx->cos_cache;
+    frame->sin_cache = ctx->sin_cache;
+    frame->base_angle = base_angle;
+    frame->angle_step = angle_step;
+    frame->min_angle = ctx->camera.angle - terrain_fov * 0.5f;
+    frame->max_angle = ctx->camera.angle + terrain_fov * 0.5f;
+    float resolution_scale = render_resolution_scale(ctx);
+    frame->pitch_offset = ctx->camera.pitch * 40.0f * resolution_scale;
+    frame->projection_scale = PROJECTION_HEIGHT_SCALE * resolution_scale;
+    frame->center_y = PROJECTION_CENTER_Y * resolution_scale;
+    frame->water_time = water_time;
+    render_chunk_window(ctx, hm, frame);
+    if (hm->pager) {
+        // Paginado, tienen que estar cargados los texels que puede leer esta vista:
+        // su ventana de chunks sin pasar de la distancia de render, más el vecino
+        // de la interpolación
+        float reach = frame->max_distance + 2.0f;
+        terrain_pager_require(hm,
+                              (int)fmaxf(frame->window_x0, floorf(ctx->camera.x - reach)),
+                              (int)fmaxf(frame->window_y0, floorf(ctx->camera.y - reach)),
+                              (int)fminf(frame->window_x1 + 1.0f, ctx->camera.x + reach),
+                              (int)fminf(frame->window_y1 + 1.0f, ctx->camera.y + reach));
+    }
+    frame->water = shared_water ? shared_water : &ctx->water;
+    if (water_level > 0 && !shared_water &&
+        !build_water_field(&ctx->water, frame->window_x0, frame->window_x1, frame->window_y0, frame->window_y1, water_time))
+        return 0;
+    frame->width = render_width;
+    frame->height = render_height;
+    frame->quality_step = quality_step;
+    frame->simd_lanes = render_simd_lanes();
+    frame->ray_traversal = ray_traversal_mode;
+    frame->march_distances = ctx->march_distances;
+    frame->march_count = ctx->march_count;
+
+    // Columnas a marchar: todas las de quality_step, salvo las que se reproyectan
+    // o, en modo entrelazado, las del campo que no toca en este frame
+    int *march_columns = ctx->march_columns;
+    frame->columns = march_columns;
+    frame->history_spans = NULL;
+    frame->history_count = NULL;
+    frame->history_angle = NULL;
+    frame->history_water = NULL;
+
+    if (ctx->interlace_enabled) {
+        frame->column_count = interlace_begin(frame, march_columns);
+    } else if (ctx->reprojection_enabled) {
+        frame->column_count = reprojection_begin(frame, march_columns);
+    } else {
+        frame->column_count = 0;
+        for (int x = 0; x < render_width; x += quality_step)
+            march_columns[frame->column_count++] = x;
+    }
+    return 1;
+}
+
+// Cierra el frame tras el ray-march: historia de columnas y billboards
+static void render_frame_end(VOXEL_FRAME *frame, const BILLBOARD_SOURCE *sources, int source_count) {
+    RENDER_CONTEXT *ctx = frame->ctx;
+
+    if (ctx->interlace_enabled)
+        interlace_end(frame);
+    else if (ctx->reprojection_enabled)
+        reprojection_end(frame);
+    span_mark_dirty(ctx->render_buffer);
+
+    // Billboards visibles en esta vista, de más lejano a más cercano, con alpha
+    // (incluye fade-out) y recortados por columna contra el terreno que tienen delante
+    BILLBOARD_RENDER_DATA visible_billboards[MAX_STATIC_BILLBOARDS + MAX_DYNAMIC_BILLBOARDS];
+    int visible_count = project_billboard_sources(ctx, sources, source_count, visible_billboards, CPU_TERRAIN_FOV);
+    qsort(visible_billboards, visible_count, sizeof(BILLBOARD_RENDER_DATA), compare_billboards_by_distance);
+
+    for (int i = 0; i < visible_count; i++)
+        rasterize_billboard(frame, visible_billboards[i].graph, &visible_billboards[i].projection);
+}
+
+static int64_t render_voxelspace_frame(RENDER_CONTEXT *ctx, HEIGHTMAP *hm) {
+    VOXEL_FRAME frame;
+    terrain_pager_begin(hm);
+    if (!render_frame_begin(ctx, hm, render_water_time(ctx), NULL, &frame))
+        return 0;
+
+    int strip_count = (frame.column_count + RENDER_STRIP_WIDTH - 1) / RENDER_STRIP_WIDTH;
+    render_pool_run(render_terrain_strip, &frame, strip_count);
+
+    BILLBOARD_SOURCE sources[MAX_STATIC_BILLBOARDS + MAX_DYNAMIC_BILLBOARDS];
+    billboard_sprites_begin_frame();
+    render_frame_end(&frame, sources, gather_billboard_sources(sources));
+    return ctx->render_buffer->code;
+}
+
+// ============================================================================
+// RENDER EN LOTE DE VARIAS VISTAS
+// ============================================================================
+// HEIGHTMAP_RENDER_VIEWS dibuja varios contextos (jugador, retrovisor, mapa...)
+// en una sola pasada. El tick y el campo de agua, la caché de texels y la lista
+// de billboards se preparan una vez para todas, y las tiras de columnas de todas
+// las vistas entran en un único reparto del pool: los hilos que terminan una
+// vista pequeña roban tiras de la grande en lugar de esperar a la siguiente.
+// Al gobernador de cada vista se le imputa su preparación y su cierre, más la
+// parte del reparto común proporcional al tiempo de sus propias tiras.
+
+typedef struct {
+    VOXEL_FRAME *frames;
+    int first_strip[MAX_RENDER_CONTEXTS + 1];   // Primera tira de cada vista; la última es el total
+    int measure;                                // Alguna vista tiene presupuesto: se mide cada tira
+    SDL_atomic_t strip_us[MAX_RENDER_CONTEXTS]; // Microsegundos de tiras por vista, sumando hilos
+} VOXEL_BATCH;
+
+static void render_batch_strip(void *data, int strip) {
+    VOXEL_BATCH *batch = (VOXEL_BATCH *)data;
+    int view = 0;
+    while (strip >= batch->first_strip[view + 1])
+        view++;
+
+    if (!batch->measure) {
+        render_terrain_strip(&batch->frames[view], strip - batch->first_strip[view]);
+        return;
+    }
+    Uint64 start = SDL_GetPerformanceCounter();
+    render_terrain_strip(&batch->frames[view], strip - batch->first_strip[view]);
+    Uint64 ticks = SDL_GetPerformanceCounter() - start;
+    SDL_AtomicAdd(&batch->strip_us[view], (int)(ticks * 1000000 / SDL_GetPerformanceFrequency()));
+}
+
+/* Renderizar varias vistas en lote: contexts son count ids de contexto y en graphs se devuelve el GRAPH de cada vista (0 si falló). Devuelve cuántas se dibujaron */
+int64_t libmod_heightmap_render_views(INSTANCE *my, int64_t *params) {
+    HEIGHTMAP *hm = find_heightmap_by_id(params[0]);
+    int64_t *contexts = (int64_t *)params[1];
+    int64_t count = params[2];
+    int64_t *graphs = (int64_t *)params[3];
+
+    if (!hm || !hm->cache_valid)
+        return 0;
+    if (!contexts || !graphs || count < 1 || count > MAX_RENDER_CONTEXTS) {
+        fprintf(stderr, "Error: el número de vistas debe estar entre 1 y %d\n", MAX_RENDER_CONTEXTS);
+        return 0;
+    }
+
+    RENDER_CONTEXT *views[MAX_RENDER_CONTEXTS];
+    for (int v = 0; v < count; v++)
+        graphs[v] = 0;
+    for (int v = 0; v < count; v++) {
+        views[v] = find_render_context(contexts[v]);
+        if (!views[v]) {
+            fprintf(stderr, "Error: Contexto de render %" PRId64 " no encontrado\n", contexts[v]);
+            return 0;
+        }
+        // Cada vista escribe en los buffers de su contexto
+        for (int w = 0; w < v; w++) {
+            if (views[w] == views[v]) {
+                fprintf(stderr, "Error: El contexto de render %" PRId64 " aparece dos veces en el lote\n", contexts[v]);
+                return 0;
+            }
+        }
+    }
+
+    VOXEL_BATCH batch;
+    GOVERNOR_STATE user[MAX_RENDER_CONTEXTS];
+    int timed[MAX_RENDER_CONTEXTS];
+    int timed_views = 0;
+    for (int v = 0; v < count; v++) {
+        timed[v] = (views[v]->frame_budget_ms > 0.0f);
+        SDL_AtomicSet(&batch.strip_us[v], 0);
+        if (timed[v]) {
+            governor_begin(views[v], &user[v]);
+            timed_views++;
+        }
+    }
+    batch.measure = (timed_views > 0);
+    Uint64 shared_start = SDL_GetPerformanceCounter();
+
+    // Mismo tick de agua en todas las vistas y un solo campo para la unión de sus ventanas
+    float water_time = render_water_time(views[0]);
+    for (int v = 1; v < count; v++) {
+        views[v]->cached_water_time = water_time;
+        views[v]->water_frame_counter++;
+    }
+    VOXEL_FRAME frames[MAX_RENDER_CONTEXTS];
+    const PRECALC_WATER_DATA *shared_water = NULL;
+    if (water_level > 0) {
+        float x0 = 0.0f, x1 = 0.0f, y0 = 0.0f, y1 = 0.0f;
+        for (int v = 0; v < count; v++) {
+            render_chunk_window(views[v], hm, &frames[v]);
+            if (v == 0 || frames[v].window_x0 < x0) x0 = frames[v].window_x0;
+            if (v == 0 || frames[v].window_x1 > x1) x1 = frames[v].window_x1;
+            if (v == 0 || frames[v].window_y0 < y0) y0 = frames[v].window_y0;
+            if (v == 0 || frames[v].window_y1 > y1) y1 = frames[v].window_y1;
+        }
+        // Si falla, cada vista construye el suyo
+        if (build_water_field(&batch_water, x0, x1, y0, y1, water_time))
+            shared_water = &batch_water;
+    }
+
+    int ready[MAX_RENDER_CONTEXTS];
+    int strip_count = 0;
+    batch.frames = frames;
+    terrain_pager_begin(hm);   // Las teselas de todas las vistas quedan fijadas hasta el siguiente lote
+
+    // Agua y paginación son comunes: se reparten a partes iguales entre las vistas medidas
+    Uint64 now = SDL_GetPerformanceCounter();
+    for (int v = 0; v < count; v++) {
+        if (timed[v])
+            user[v].elapsed += (now - shared_start) / timed_views;
+    }
+
+    for (int v = 0; v < count; v++) {
+        Uint64 view_start = SDL_GetPerformanceCounter();
+        batch.first_strip[v] = strip_count;
+        ready[v] = render_frame_begin(views[v], hm, water_time, shared_water, &frames[v]);
+        if (ready[v])
+            strip_count += (frames[v].column_count + RENDER_STRIP_WIDTH - 1) / RENDER_STRIP_WIDTH;
+        if (timed[v])
+            user[v].elapsed += SDL_GetPerformanceCounter() - view_start;
+    }
+    batch.first_strip[count] = strip_count;
+
+    Uint64 dispatch_start = SDL_GetPerformanceCounter();
+    render_pool_run(render_batch_strip, &batch, strip_count);
+    Uint64 dispatch_ticks = SDL_GetPerformanceCounter() - dispatch_start;
+
+    // El tiempo real del reparto se imputa según lo que pesó cada vista en él
+    if (batch.measure) {
+        double total_us = 0.0;
+        for (int v = 0; v < count; v++)
+            total_us += SDL_AtomicGet(&batch.strip_us[v]);
+        for (int v = 0; v < count; v++) {
+            if (timed[v] && total_us > 0.0)
+                user[v].elapsed += (Uint64)(dispatch_ticks * (SDL_AtomicGet(&batch.strip_us[v]) / total_us));
+        }
+    }
+
+    BILLBOARD_SOURCE sources[MAX_STATIC_BILLBOARDS + MAX_DYNAMIC_BILLBOARDS];
+    billboard_sprites_begin_frame();
+    int source_count = gather_billboard_sources(sources);
+
+    int rendered = 0;
+    for (int v = 0; v < count; v++) {
+        int64_t code = 0;
+        if (timed[v])
+            user[v].start = SDL_GetPerformanceCounter();   // Desde aquí, solo el cierre de esta vista
+        if (ready[v]) {
+            render_frame_end(&frames[v], sources, source_count);
+            code = views[v]->render_buffer->code;
+        }
+        if (timed[v])
+            code = governor_end(views[v], &user[v], code);
+        graphs[v] = code;
+        if (code)
+            rendered++;
+    }
+    return rendered;
 }
  
 // ============================================================================  
@@ -1696,7 +4863,7 @@ static int setup_shader_parameters(HEIGHTMAP *hm) {
     // Configurar texturas (pasar GRAPH* directamente)  
     if (loc_heightmap >= 0) {  
         shader_set_param(voxel_params, SHADER_IMAGE, loc_heightmap, 0,  
-                        hm->heightmap, 0, 0, 0, 0, 0);  
+                        heightmap_graph(hm), 0, 0, 0, 0, 0);  
     }  
       
     if (loc_texturemap >= 0 && hm->texturemap) {  
@@ -1706,20 +4873,20 @@ static int setup_shader_parameters(HEIGHTMAP *hm) {
       
     // Configurar vec3 u_camera_pos  
     if (loc_camera_pos >= 0) {  
-        float camera_pos[3] = { camera.x, camera.y, camera.z };  
+        float camera_pos[3] = { active_context->camera.x, active_context->camera.y, active_context->camera.z };  
         shader_set_param(voxel_params, UNIFORM_FLOAT3_ARRAY, loc_camera_pos, 1,  
                         camera_pos, 0, 0, 0, 0, 0);  
     }  
       
     // Configurar floats individuales  
     if (loc_camera_angle >= 0) {  
-        float angle_val = camera.angle;  
+        float angle_val = active_context->camera.angle;  
         shader_set_param(voxel_params, UNIFORM_FLOAT, loc_camera_angle, 0,  
                         (void*)(intptr_t)*(int32_t*)&angle_val, 0, 0, 0, 0, 0);  
     }  
       
     if (loc_camera_pitch >= 0) {  
-        float pitch_val = camera.pitch;  
+        float pitch_val = active_context->camera.pitch;  
         shader_set_param(voxel_params, UNIFORM_FLOAT, loc_camera_pitch, 0,  
                         (void*)(intptr_t)*(int32_t*)&pitch_val, 0, 0, 0, 0, 0);  
     }  
@@ -1732,7 +4899,7 @@ static int setup_shader_parameters(HEIGHTMAP *hm) {
       
     if (loc_max_distance >= 0) {  
         shader_set_param(voxel_params, UNIFORM_FLOAT, loc_max_distance, 0,  
-                        (void*)(intptr_t)*(int32_t*)&max_render_distance, 0, 0, 0, 0, 0);  
+                        (void*)(intptr_t)*(int32_t*)&active_context->max_render_distance, 0, 0, 0, 0, 0);  
     }  
       
     if (loc_water_level >= 0) {  
@@ -1755,9 +4922,9 @@ static int setup_shader_parameters(HEIGHTMAP *hm) {
       
     if (loc_sky_color >= 0) {  
         float sky_color[3] = {  
-            sky_color_r / 255.0f,  
-            sky_color_g / 255.0f,  
-            sky_color_b / 255.0f  
+            active_context->sky_color_r / 255.0f,  
+            active_context->sky_color_g / 255.0f,  
+            active_context->sky_color_b / 255.0f  
         };  
         shader_set_param(voxel_params, UNIFORM_FLOAT3_ARRAY, loc_sky_color, 1,  
                         sky_color, 0, 0, 0, 0, 0);  
@@ -1792,26 +4959,26 @@ int64_t libmod_heightmap_render_voxelspace_gpu(INSTANCE *my, int64_t *params) {
         return 0;                
     }                
                     
-    if (!render_buffer || render_buffer->width != render_width ||                 
-        render_buffer->height != render_height) {                
-        if (render_buffer) {                
-            bitmap_destroy(render_buffer);                
+    if (!active_context->render_buffer || active_context->render_buffer->width != render_width ||                 
+        active_context->render_buffer->height != render_height) {                
+        if (active_context->render_buffer) {                
+            bitmap_destroy(active_context->render_buffer);                
         }                
-        render_buffer = bitmap_new_syslib(render_width, render_height);                
-        if (!render_buffer) {                
+        active_context->render_buffer = bitmap_new_syslib(render_width, render_height);                
+        if (!active_context->render_buffer) {                
             fprintf(stderr, "ERROR: No se pudo crear render_buffer\n");                
             return 0;                
         }       
         // Actualizar variables globales con las nuevas dimensiones    
-        current_render_width = render_width;    
-        current_render_height = render_height;             
+        active_context->render_width = render_width;    
+        active_context->render_height = render_height;             
     }                
                     
-    uint32_t sky_color = SDL_MapRGBA(gPixelFormat, sky_color_r, sky_color_g, sky_color_b, 255);                
-    gr_clear_as(render_buffer, sky_color);                
+    uint32_t sky_color = SDL_MapRGBA(gPixelFormat, active_context->sky_color_r, active_context->sky_color_g, active_context->sky_color_b, 255);                
+    gr_clear_as(active_context->render_buffer, sky_color);                
             
     if (sky_texture) {        
-        render_skybox(camera.angle, camera.pitch, water_time, 1);        
+        render_skybox(active_context, water_time, 1);        
     }        
                     
     static GRAPH *quad_source = NULL;              
@@ -1887,7 +5054,7 @@ int64_t libmod_heightmap_render_voxelspace_gpu(INSTANCE *my, int64_t *params) {
     static float chunk_max[2];
 
     // Configurar texturas del heightmap (sin condicionales)  
-    if (loc_heightmap >= 0 && hm->heightmap) {  
+    if (loc_heightmap >= 0 && heightmap_graph(hm)) {  
         shader_set_param(voxel_params, SHADER_IMAGE, loc_heightmap, 0,  
                         (void*)hm->heightmap, 0, 0, 0, 0, 0);  
     }  
@@ -1905,21 +5072,21 @@ int64_t libmod_heightmap_render_voxelspace_gpu(INSTANCE *my, int64_t *params) {
     shader_activate(voxel_shader);          
               
     if (loc_camera_pos >= 0) {                
-        camera_pos[0] = camera.x;              
-        camera_pos[1] = camera.y;              
-        camera_pos[2] = camera.z;              
+        camera_pos[0] = active_context->camera.x;              
+        camera_pos[1] = active_context->camera.y;              
+        camera_pos[2] = active_context->camera.z;              
         shader_set_param(voxel_params, UNIFORM_FLOAT3_ARRAY, loc_camera_pos, 1,                
                         (void*)camera_pos, 0, 0, 0, 0, 0);                
     }                
                     
     if (loc_camera_angle >= 0) {                
-        float angle_val = camera.angle;        
+        float angle_val = active_context->camera.angle;        
         shader_set_param(voxel_params, UNIFORM_FLOAT, loc_camera_angle, 0,                
                         *(int32_t*)&angle_val, 0, 0, 0, 0, 0);                
     }                
                     
     if (loc_camera_pitch >= 0) {                
-        float pitch_val = camera.pitch;        
+        float pitch_val = active_context->camera.pitch;        
         shader_set_param(voxel_params, UNIFORM_FLOAT, loc_camera_pitch, 0,                
                         *(int32_t*)&pitch_val, 0, 0, 0, 0, 0);                
     }                
@@ -1932,7 +5099,7 @@ int64_t libmod_heightmap_render_voxelspace_gpu(INSTANCE *my, int64_t *params) {
                     
     if (loc_max_distance >= 0) {                
         shader_set_param(voxel_params, UNIFORM_FLOAT, loc_max_distance, 0,                
-                        *(int32_t*)&max_render_distance, 0, 0, 0, 0, 0);                
+                        *(int32_t*)&active_context->max_render_distance, 0, 0, 0, 0, 0);                
     }                
                     
     if (loc_water_level >= 0) {                
@@ -1955,24 +5122,24 @@ int64_t libmod_heightmap_render_voxelspace_gpu(INSTANCE *my, int64_t *params) {
     }              
                   
     if (loc_sky_color >= 0) {              
-        sky_color_arr[0] = sky_color_r / 255.0f;            
-        sky_color_arr[1] = sky_color_g / 255.0f;            
-        sky_color_arr[2] = sky_color_b / 255.0f;            
+        sky_color_arr[0] = active_context->sky_color_r / 255.0f;            
+        sky_color_arr[1] = active_context->sky_color_g / 255.0f;            
+        sky_color_arr[2] = active_context->sky_color_b / 255.0f;            
         shader_set_param(voxel_params, UNIFORM_FLOAT3_ARRAY, loc_sky_color, 1,              
                         (void*)sky_color_arr, 0, 0, 0, 0, 0);              
     }        
             
     if (loc_fog_color >= 0) {        
-        fog_color_arr[0] = fog_color_r / 255.0f;        
-        fog_color_arr[1] = fog_color_g / 255.0f;        
-        fog_color_arr[2] = fog_color_b / 255.0f;        
+        fog_color_arr[0] = active_context->fog_color_r / 255.0f;        
+        fog_color_arr[1] = active_context->fog_color_g / 255.0f;        
+        fog_color_arr[2] = active_context->fog_color_b / 255.0f;        
         shader_set_param(voxel_params, UNIFORM_FLOAT3_ARRAY, loc_fog_color, 1,        
                         (void*)fog_color_arr, 0, 0, 0, 0, 0);        
     }        
             
     if (loc_fog_intensity >= 0) {        
         shader_set_param(voxel_params, UNIFORM_FLOAT, loc_fog_intensity, 0,        
-                        *(int32_t*)&fog_intensity, 0, 0, 0, 0, 0);        
+                        *(int32_t*)&active_context->fog_intensity, 0, 0, 0, 0, 0);        
     }      
           
     if (loc_water_time >= 0) {      
@@ -1985,8 +5152,8 @@ int64_t libmod_heightmap_render_voxelspace_gpu(INSTANCE *my, int64_t *params) {
                         *(int32_t*)&wave_amplitude, 0, 0, 0, 0, 0);      
     }      
           
-    int chunk_x = (int)(camera.x / chunk_size);      
-    int chunk_y = (int)(camera.y / chunk_size);      
+    int chunk_x = (int)(active_context->camera.x / chunk_size);      
+    int chunk_y = (int)(active_context->camera.y / chunk_size);      
     int min_chunk_x = chunk_x - chunk_radius;      
     int max_chunk_x = chunk_x + chunk_radius;      
     int min_chunk_y = chunk_y - chunk_radius;      
@@ -2007,7 +5174,7 @@ int64_t libmod_heightmap_render_voxelspace_gpu(INSTANCE *my, int64_t *params) {
     }    
 
        // BUCLE DE RENDERIZADO DEL SHADER  
-    for (float distance = max_render_distance; distance >= 1.0; ) {        
+    for (float distance = active_context->max_render_distance; distance >= 1.0; ) {        
         float step;        
         if (distance < 100.0f) {        
             step = 1.5f;      
@@ -2025,7 +5192,7 @@ int64_t libmod_heightmap_render_voxelspace_gpu(INSTANCE *my, int64_t *params) {
         shader_apply_parameters(voxel_params);              
                       
         gr_blit(              
-            render_buffer,            
+            active_context->render_buffer,            
             NULL,            
             0, 0,      
             0, 0,            
@@ -2055,9 +5222,9 @@ int64_t libmod_heightmap_render_voxelspace_gpu(INSTANCE *my, int64_t *params) {
         
     // Recopilar billboards visibles    
     float terrain_fov = 0.7f;    
-    collect_visible_billboards_from_array(static_billboards, static_billboard_count,    
+    collect_visible_billboards_from_array(active_context, static_billboards, static_billboard_count,    
                                          visible_billboards, &visible_count, terrain_fov);    
-    collect_visible_billboards_from_array(dynamic_billboards, MAX_DYNAMIC_BILLBOARDS,    
+    collect_visible_billboards_from_array(active_context, dynamic_billboards, MAX_DYNAMIC_BILLBOARDS,    
                                          visible_billboards, &visible_count, terrain_fov);    
         
     // Ordenar por distancia (más lejanos primero)    
@@ -2092,20 +5259,20 @@ int64_t libmod_heightmap_render_voxelspace_gpu(INSTANCE *my, int64_t *params) {
             
         // EFECTO AVANZADO 2: Aplicar tintado de niebla    
         if (proj.fog_tint_factor > 0.0f) {    
-            r_mod = (int)(r_mod * (1.0f - proj.fog_tint_factor) + fog_color_r * proj.fog_tint_factor);    
-            g_mod = (int)(g_mod * (1.0f - proj.fog_tint_factor) + fog_color_g * proj.fog_tint_factor);    
-            b_mod = (int)(b_mod * (1.0f - proj.fog_tint_factor) + fog_color_b * proj.fog_tint_factor);    
+            r_mod = (int)(r_mod * (1.0f - proj.fog_tint_factor) + active_context->fog_color_r * proj.fog_tint_factor);    
+            g_mod = (int)(g_mod * (1.0f - proj.fog_tint_factor) + active_context->fog_color_g * proj.fog_tint_factor);    
+            b_mod = (int)(b_mod * (1.0f - proj.fog_tint_factor) + active_context->fog_color_b * proj.fog_tint_factor);    
         }    
             
         // EFECTO AVANZADO 3: Soft edges basado en distancia    
         int alpha = proj.alpha;    
-        if (proj.distance > max_render_distance * 0.8f) {    
-            float fade = 1.0f - ((proj.distance - max_render_distance * 0.8f) / (max_render_distance * 0.2f));    
+        if (proj.distance > active_context->max_render_distance * 0.8f) {    
+            float fade = 1.0f - ((proj.distance - active_context->max_render_distance * 0.8f) / (active_context->max_render_distance * 0.2f));    
             alpha = (int)(alpha * fade);    
         }    
             
         // Renderizar billboard con todos los efectos aplicados    
-        gr_blit(render_buffer, NULL,    
+        gr_blit(active_context->render_buffer, NULL,    
                proj.screen_x - proj.scaled_width/2,    
                proj.screen_y - proj.scaled_height/2,    
                0, 0, proj.scaled_width, proj.scaled_height,    
@@ -2114,62 +5281,1299 @@ int64_t libmod_heightmap_render_voxelspace_gpu(INSTANCE *my, int64_t *params) {
                r_mod, g_mod, b_mod, alpha, 0, NULL);    
     }    
                   
-    return render_buffer->code;                
+    return active_context->render_buffer->code;                
+}
+
+
+// ============================================================================
+// DISPOSICIÓN EN BLOQUES DE HEIGHT_CACHE Y COLOR_CACHE
+// ============================================================================
+// Por filas, un rayo en diagonal salta una fila entera en cada paso y cada
+// lectura cae en otra línea de caché (y a menudo en otra página). En bloques,
+// los texels de un bloque de 8x8 o 16x16 son contiguos, los bloques siguen el
+// orden Z dentro de supertexelas de 8x8 bloques y las supertexelas van por
+// filas, así que los vecinos en cualquier dirección suelen compartir línea.
+// La posición del texel (x, y) es texel_x[x] + texel_y[y]: la columna aporta
+// los bits pares del orden Z y la fila los impares. El mapa se rellena hasta
+// un número entero de supertexelas (128x128 texels con bloques de 16).
+
+// Separa los bits bajos de v para intercalarlos en orden Z (bit i -> bit 2i)
+static uint32_t morton_spread(uint32_t v) {
+    uint32_t result = 0;
+    for (int bit = 0; bit < TEXEL_SUPER_SHIFT; bit++)
+        result |= ((v >> bit) & 1u) << (2 * bit);
+    return result;
+}
+
+// Tablas de desplazamientos de columna y fila para un mapa w x h
+static int texel_tables_build(int w, int h, int brick, uint32_t **out_x, uint32_t **out_y, size_t *out_count) {
+    size_t count;
+    if (brick == TEXEL_LAYOUT_ROWS) {
+        count = (size_t)w * h;
+    } else {
+        size_t super_side = (size_t)brick << TEXEL_SUPER_SHIFT;
+        count = ((w + super_side - 1) / super_side) * ((h + super_side - 1) / super_side) * super_side * super_side;
+    }
+    // Los gathers AVX2 usan índices de 32 bits con signo
+    if (count > INT32_MAX) {
+        fprintf(stderr, "Error: heightmap %dx%d demasiado grande para la caché de alturas\n", w, h);
+        return 0;
+    }
+
+    uint32_t *tx = malloc((size_t)w * sizeof(uint32_t));
+    uint32_t *ty = malloc((size_t)h * sizeof(uint32_t));
+    if (!tx || !ty) {
+        free(tx);
+        free(ty);
+        fprintf(stderr, "Error: No se pudo asignar la disposición de texels para heightmap %dx%d\n", w, h);
+        return 0;
+    }
+
+    if (brick == TEXEL_LAYOUT_ROWS) {
+        for (int x = 0; x < w; x++)
+            tx[x] = (uint32_t)x;
+        for (int y = 0; y < h; y++)
+            ty[y] = (uint32_t)((size_t)y * w);
+    } else {
+        int shift = (brick == 16) ? 4 : 3;
+        uint32_t brick_area = (uint32_t)(brick * brick);
+        uint32_t super_side = (uint32_t)brick << TEXEL_SUPER_SHIFT;
+        uint32_t super_area = super_side * super_side;
+        uint32_t super_row = (((uint32_t)w + super_side - 1) / super_side) * super_area;
+        uint32_t brick_mask = (1u << TEXEL_SUPER_SHIFT) - 1;
+
+        for (int x = 0; x < w; x++)
+            tx[x] = (x / super_side) * super_area + morton_spread((x >> shift) & brick_mask) * brick_area +
+                    (x & (brick - 1));
+        for (int y = 0; y < h; y++)
+            ty[y] = (y / super_side) * super_row + (morton_spread((y >> shift) & brick_mask) << 1) * brick_area +
+                    (y & (brick - 1)) * brick;
+    }
+
+    *out_x = tx;
+    *out_y = ty;
+    *out_count = count;
+    return 1;
+}
+
+static void free_texel_layout(HEIGHTMAP *hm) {
+    free(hm->texel_x);
+    free(hm->texel_y);
+    hm->texel_x = NULL;
+    hm->texel_y = NULL;
+    hm->texel_count = 0;
+}
+
+/* Cambia la disposición del mapa y recoloca texel_cache (que lleva las alturas)
+   o, si aún no existe, height_cache. */
+static int texel_layout_set(HEIGHTMAP *hm, int brick) {
+    uint32_t *tx, *ty;
+    size_t count;
+    if (!texel_tables_build((int)hm->width, (int)hm->height, brick, &tx, &ty, &count))
+        return 0;
+
+    if (hm->texel_cache) {
+        TERRAIN_TEXEL *texels = calloc(count, sizeof(TERRAIN_TEXEL));
+        if (!texels) {
+            free(tx);
+            free(ty);
+            fprintf(stderr, "Error: No se pudo asignar texel_cache para heightmap %dx%d\n",
+                    (int)hm->width, (int)hm->height);
+            return 0;
+        }
+        for (int y = 0; y < hm->height; y++)
+            for (int x = 0; x < hm->width; x++)
+                texels[tx[x] + ty[y]] = hm->texel_cache[texel_index(hm, x, y)];
+        free(hm->texel_cache);
+        hm->texel_cache = texels;
+        free_height_cache(hm);   // Un .hmt por filas aún apuntaba al fichero
+    } else if (hm->height_cache) {
+        uint16_t *cache = calloc(count, sizeof(uint16_t));
+        if (!cache) {
+            free(tx);
+            free(ty);
+            fprintf(stderr, "Error: No se pudo asignar height_cache para heightmap %dx%d\n",
+                    (int)hm->width, (int)hm->height);
+            return 0;
+        }
+        for (int y = 0; y < hm->height; y++)
+            for (int x = 0; x < hm->width; x++)
+                cache[tx[x] + ty[y]] = hm->height_cache[texel_index(hm, x, y)];
+        free_height_cache(hm);
+        hm->height_cache = cache;
+    }
+
+    free_texel_layout(hm);
+    hm->texel_x = tx;
+    hm->texel_y = ty;
+    hm->texel_count = count;
+    hm->texel_brick = brick;
+
+    reprojection_invalidate();
+    return 1;
+}
+
+/* Disposición de las cachés de un mapa: 0 por filas, 8 o 16 para bloques de
+   ese lado en orden Z. Conviene con cámaras que giran libremente sobre mapas
+   grandes; el resultado del render es idéntico. */
+int64_t libmod_heightmap_set_tiled_layout(INSTANCE *my, int64_t *params)
+{
+    HEIGHTMAP *hm = find_heightmap_by_id(params[0]);
+    int brick = (int)params[1];
+
+    if (!hm || !hm->cache_valid)
+        return 0;
+    if (brick != TEXEL_LAYOUT_ROWS && brick != 8 && brick != 16) {
+        fprintf(stderr, "Error: tamaño de bloque %d no válido (0, 8 o 16)\n", brick);
+        return 0;
+    }
+    if (hm->pager) {
+        fprintf(stderr, "Error: la disposición de un mapa paginado la fija HEIGHTMAP_SET_PAGING\n");
+        return 0;
+    }
+    if (brick == hm->texel_brick)
+        return 1;
+
+    return texel_layout_set(hm, brick);
+}
+
+
+// ============================================================================
+// ALTURAS CUANTIZADAS Y CARGA DE 16 BITS
+// ============================================================================
+// height_cache guarda un uint16_t por texel y cada mapa tiene su escala y su
+// desplazamiento. Los mapas de 8 bits (canal rojo) conservan sus valores 0-255;
+// los de 16 bits (PNG de 16 bits, .r16 o rojo+verde) cubren por defecto el
+// mismo rango 0-255 con 65536 niveles. HEIGHTMAP_SET_HEIGHT_RANGE lo cambia.
+
+// Rango por defecto: 0-255 unidades, el mismo que dan los heightmaps de 8 bits
+static void height_default_range(HEIGHTMAP *hm) {
+    hm->height_offset = 0.0f;
+    hm->height_scale = 255.0f / (float)((1 << hm->height_bits) - 1);
+}
+
+// Termina una caché recién rellenada: rango por defecto si no se fijó otro y pirámide
+static void height_cache_ready(HEIGHTMAP *hm) {
+    if (hm->height_bits != 16)
+        hm->height_bits = 8;
+    if (hm->height_scale <= 0.0f)
+        height_default_range(hm);
+
+    reprojection_invalidate();
+    hm->cache_valid = 1;
+    build_height_pyramid(hm);
+}
+
+static int has_extension(const char *filename, const char *extension) {
+    size_t length = strlen(filename);
+    size_t ext_length = strlen(extension);
+    return length >= ext_length && strcasecmp(filename + length - ext_length, extension) == 0;
+}
+
+// .r16: alturas de 16 bits little-endian sin cabecera; el mapa es cuadrado
+static int load_heights_r16(const char *filename, uint16_t **heights, int64_t *width, int64_t *height) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        fprintf(stderr, "Error: No se pudo abrir %s\n", filename);
+        return -1;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    int64_t side = (int64_t)sqrt((double)(size / 2));
+    while (side * side * 2 < size)
+        side++;
+    if (side < 2 || side * side * 2 != size) {
+        fprintf(stderr, "Error: %s no es un .r16 cuadrado (%ld bytes)\n", filename, size);
+        fclose(f);
+        return -1;
+    }
+
+    uint16_t *data = malloc((size_t)size);
+    if (!data) {
+        fprintf(stderr, "Error: No se pudo asignar height_cache para heightmap %dx%d\n", (int)side, (int)side);
+        fclose(f);
+        return -1;
+    }
+    if (fread(data, 1, (size_t)size, f) != (size_t)size) {
+        fprintf(stderr, "Error: Lectura incompleta de %s\n", filename);
+        free(data);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    // El formato es little-endian
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (int64_t i = 0; i < side * side; i++)
+        data[i] = (uint16_t)(bytes[i * 2] | (bytes[i * 2 + 1] << 8));
+
+    *heights = data;
+    *width = side;
+    *height = side;
+    return 1;
+}
+
+// PNG de 16 bits por canal (gris o color): se usa el primer canal. Devuelve 0 si
+// el archivo no es un PNG de 16 bits, para que lo cargue gr_load_img.
+static int load_heights_png16(const char *filename, uint16_t **heights, int64_t *width, int64_t *height) {
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+        return 0;
+
+    png_byte signature[8];
+    if (fread(signature, 1, sizeof(signature), f) != sizeof(signature) || png_sig_cmp(signature, 0, sizeof(signature))) {
+        fclose(f);
+        return 0;
+    }
+
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png ? png_create_info_struct(png) : NULL;
+    if (!info) {
+        png_destroy_read_struct(&png, NULL, NULL);
+        fclose(f);
+        return -1;
+    }
+
+    uint16_t *data = NULL;
+    png_bytep row = NULL;
+    if (setjmp(png_jmpbuf(png))) {
+        fprintf(stderr, "Error: PNG de 16 bits dañado: %s\n", filename);
+        free(data);
+        free(row);
+        png_destroy_read_struct(&png, &info, NULL);
+        fclose(f);
+        return -1;
+    }
+
+    png_init_io(png, f);
+    png_set_sig_bytes(png, sizeof(signature));
+    png_read_info(png, info);
+
+    if (png_get_bit_depth(png, info) != 16) {
+        png_destroy_read_struct(&png, &info, NULL);
+        fclose(f);
+        return 0;
+    }
+
+    png_uint_32 w = png_get_image_width(png, info);
+    png_uint_32 h = png_get_image_height(png, info);
+    int channels = png_get_channels(png, info);
+    if (png_get_interlace_type(png, info) != PNG_INTERLACE_NONE || w < 2 || h < 2) {
+        fprintf(stderr, "Error: %s: los PNG de 16 bits deben tener al menos 2x2 y no ser entrelazados\n", filename);
+        png_destroy_read_struct(&png, &info, NULL);
+        fclose(f);
+        return -1;
+    }
+
+    data = malloc((size_t)w * h * sizeof(uint16_t));
+    row = malloc(png_get_rowbytes(png, info));
+    if (!data || !row) {
+        fprintf(stderr, "Error: No se pudo asignar height_cache para heightmap %dx%d\n", (int)w, (int)h);
+        free(data);
+        free(row);
+        png_destroy_read_struct(&png, &info, NULL);
+        fclose(f);
+        return -1;
+    }
+
+    // Las muestras de 16 bits del PNG son big-endian
+    for (png_uint_32 y = 0; y < h; y++) {
+        png_read_row(png, row, NULL);
+        uint16_t *dst = data + (size_t)y * w;
+        for (png_uint_32 x = 0; x < w; x++)
+            dst[x] = (uint16_t)((row[x * channels * 2] << 8) | row[x * channels * 2 + 1]);
+    }
+
+    free(row);
+    png_destroy_read_struct(&png, &info, NULL);
+    fclose(f);
+
+    *heights = data;
+    *width = w;
+    *height = h;
+    return 1;
+}
+
+// Alturas de 16 bits desde .r16 o PNG de 16 bits. 1 = cargado, 0 = no es de
+// 16 bits (se carga con gr_load_img), -1 = error
+static int load_heights_16(const char *filename, uint16_t **heights, int64_t *width, int64_t *height) {
+    if (has_extension(filename, ".r16"))
+        return load_heights_r16(filename, heights, width, height);
+    return load_heights_png16(filename, heights, width, height);
+}
+
+// GRAPH en grises con el byte alto de cada altura, para el render GPU y las
+// funciones que trabajan con el GRAPH del heightmap
+static GRAPH *height_preview_graph(const uint16_t *heights, int64_t width, int64_t height, int bits) {
+    GRAPH *graph = bitmap_new_syslib(width, height);
+    if (!graph)
+        return NULL;
+
+    int direct = span_direct_ok(graph);
+    for (int y = 0; y < height; y++) {
+        uint32_t *pixel = direct ? span_pixel_ptr(graph, 0, y) : NULL;
+        for (int x = 0; x < width; x++) {
+            Uint8 level = (Uint8)(heights[(size_t)y * width + x] >> (bits - 8));
+            uint32_t color = SDL_MapRGB(gPixelFormat, level, level, level);
+            if (direct)
+                pixel[x] = color;
+            else
+                gr_put_pixel(graph, x, y, color);
+        }
+    }
+    span_mark_dirty(graph);
+    return graph;
+}
+
+// ============================================================================
+// FICHERO DE TERRENO MAPEADO (.hmt)
+// ============================================================================
+// HEIGHTMAP_LOAD con un .hmt (ver terrain_format.h y la herramienta terrain/)
+// no decodifica nada: el fichero se mapea en memoria de solo lectura y
+// height_cache, la pirámide y los colores apuntan a sus secciones. La carga
+// solo valida la cabecera; el sistema trae las páginas a medida que el render
+// las toca y los procesos que abren el mismo mapa comparten esas páginas.
+// Lo que hay que rehacer (disposición en bloques, caché de texels) se copia aparte.
+
+static const uint8_t *terrain_file_map(const char *filename, size_t *size) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    LARGE_INTEGER length;
+    if (!GetFileSizeEx(file, &length) || length.QuadPart == 0) {
+        CloseHandle(file);
+        return NULL;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping)
+        return NULL;
+
+    // La vista mantiene vivo el objeto de mapeo
+    const uint8_t *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!data)
+        return NULL;
+
+    *size = (size_t)length.QuadPart;
+    return data;
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    *size = (size_t)st.st_size;
+    return data;
+#endif
+}
+
+static void terrain_file_unmap(const uint8_t *data, size_t size) {
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(data);
+#else
+    munmap((void *)data, size);
+#endif
+}
+
+// Indica si un bloque de datos del mapa vive dentro del fichero mapeado (y no hay que liberarlo)
+static inline int terrain_file_owns(const HEIGHTMAP *hm, const void *data) {
+    const uint8_t *bytes = data;
+    return hm->file_data && bytes >= hm->file_data && bytes < hm->file_data + hm->file_size;
+}
+
+static void free_height_cache(HEIGHTMAP *hm) {
+    if (!terrain_file_owns(hm, hm->height_cache))
+        free(hm->height_cache);
+    hm->height_cache = NULL;
+}
+
+static void free_terrain_file(HEIGHTMAP *hm) {
+    if (hm->file_data)
+        terrain_file_unmap(hm->file_data, hm->file_size);
+    hm->file_data = NULL;
+    hm->file_size = 0;
+    hm->file_colors = NULL;
+}
+
+// Una sección es válida si empieza tras la cabecera, alineada, y cabe entera en el fichero
+static int terrain_section_ok(size_t file_size, uint64_t offset, uint64_t bytes, uint64_t align) {
+    return offset >= sizeof(TERRAIN_FILE_HEADER) && offset % align == 0 &&
+           offset <= file_size && bytes <= file_size - offset;
+}
+
+// Usa la pirámide del fichero si tiene los niveles que generaría build_height_pyramid
+static int terrain_file_pyramid(HEIGHTMAP *hm, const TERRAIN_FILE_HEADER *header) {
+    if (header->pyramid_shift != HEIGHT_PYRAMID_BASE_SHIFT)
+        return 0;
+
+    int block = 1 << HEIGHT_PYRAMID_BASE_SHIFT;
+    int level_w = ((int)hm->width - 1 + block - 1) / block;
+    int level_h = ((int)hm->height - 1 + block - 1) / block;
+    float *levels[HEIGHT_PYRAMID_MAX_LEVELS];
+    int widths[HEIGHT_PYRAMID_MAX_LEVELS], heights[HEIGHT_PYRAMID_MAX_LEVELS];
+    int count = 0;
+
+    for (;;) {
+        if (count >= (int)header->pyramid_levels || count >= TERRAIN_FILE_MAX_LEVELS)
+            return 0;
+        uint64_t offset = header->pyramid_offset[count];
+        if (!terrain_section_ok(hm->file_size, offset, (uint64_t)level_w * level_h * sizeof(float), sizeof(float)))
+            return 0;
+
+        levels[count] = (float *)(hm->file_data + offset);
+        widths[count] = level_w;
+        heights[count] = level_h;
+        count++;
+
+        if (count >= HEIGHT_PYRAMID_MAX_LEVELS || (level_w <= 1 && level_h <= 1))
+            break;
+        level_w = (level_w + 1) / 2;
+        level_h = (level_h + 1) / 2;
+    }
+
+    free_height_pyramid(hm);
+    for (int level = 0; level < count; level++) {
+        hm->height_max[level] = levels[level];
+        hm->height_max_width[level] = widths[level];
+        hm->height_max_height[level] = heights[level];
+    }
+    hm->height_max_levels = count;
+    return 1;
+}
+
+static int64_t load_terrain_file(const char *filename) {
+    size_t size = 0;
+    const uint8_t *data = terrain_file_map(filename, &size);
+    if (!data) {
+        fprintf(stderr, "Error: No se pudo mapear %s\n", filename);
+        return 0;
+    }
+
+    const TERRAIN_FILE_HEADER *header = (const TERRAIN_FILE_HEADER *)data;
+    if (size < sizeof(TERRAIN_FILE_HEADER) || memcmp(header->magic, TERRAIN_FILE_MAGIC, 4) != 0) {
+        fprintf(stderr, "Error: %s no es un fichero de terreno .hmt\n", filename);
+        terrain_file_unmap(data, size);
+        return 0;
+    }
+    if (header->version != TERRAIN_FILE_VERSION) {
+        fprintf(stderr, "Error: %s tiene la versión %u del formato y se esperaba la %d\n",
+                filename, header->version, TERRAIN_FILE_VERSION);
+        terrain_file_unmap(data, size);
+        return 0;
+    }
+
+    uint64_t texels = (uint64_t)header->width * header->height;
+    if (header->width < 2 || header->height < 2 ||
+        (header->height_bits != 8 && header->height_bits != 16) || !(header->height_scale > 0.0f) ||
+        !terrain_section_ok(size, header->heights_offset, texels * sizeof(uint16_t), sizeof(uint16_t)) ||
+        (header->colors_offset && !terrain_section_ok(size, header->colors_offset, texels * 4, 4))) {
+        fprintf(stderr, "Error: cabecera no válida en %s\n", filename);
+        terrain_file_unmap(data, size);
+        return 0;
+    }
+
+    int slot = -1;
+    for (int i = 0; i < MAX_HEIGHTMAPS; i++) {
+        if (!heightmaps[i].heightmap && !heightmaps[i].file_data) {
+            slot = i;
+            break;
+        }
+    }
+
+    if (slot == -1) {
+        fprintf(stderr, "Error: MAX_HEIGHTMAPS (%d) alcanzado\n", MAX_HEIGHTMAPS);
+        terrain_file_unmap(data, size);
+        return 0;
+    }
+
+    // Verificar que next_heightmap_id no desborde
+    if (next_heightmap_id >= INT64_MAX - 1) {
+        fprintf(stderr, "Error: next_heightmap_id overflow\n");
+        terrain_file_unmap(data, size);
+        return 0;
+    }
+
+    HEIGHTMAP *hm = &heightmaps[slot];
+    hm->id = next_heightmap_id++;
+    hm->type = MAP_TYPE_HEIGHTMAP;
+    hm->heightmap = NULL;   // Solo se crea si lo pide el render GPU (ver heightmap_graph)
+    hm->texturemap = NULL;
+    hm->width = header->width;
+    hm->height = header->height;
+    hm->height_bits = (int)header->height_bits;
+    hm->height_scale = header->height_scale;
+    hm->height_offset = header->height_offset;
+    hm->file_data = data;
+    hm->file_size = size;
+    hm->file_colors = header->colors_offset ? data + header->colors_offset : NULL;
+
+    if (!texel_layout_set(hm, TEXEL_LAYOUT_ROWS)) {
+        free_terrain_file(hm);
+        memset(hm, 0, sizeof(HEIGHTMAP));
+        return 0;
+    }
+
+    // Las alturas se usan en su sitio: height_cache nunca se escribe sin copiarla
+    // antes (texel_layout_set, build_height_cache)
+    hm->height_cache = (uint16_t *)(data + header->heights_offset);
+    reprojection_invalidate();
+    hm->cache_valid = 1;
+    if (!terrain_file_pyramid(hm, header))
+        build_height_pyramid(hm);
+
+    return hm->id;
 }
 
+// GRAPH del heightmap para el render GPU. Los mapas .hmt no lo crean al
+// cargar: se genera a partir de las alturas la primera vez que se pide
+static GRAPH *heightmap_graph(HEIGHTMAP *hm) {
+    if (!hm->heightmap && hm->file_data) {
+        hm->heightmap = height_preview_graph(terrain_file_heights(hm), hm->width, hm->height, hm->height_bits);
+    }
+    return hm->heightmap;
+}
 
 /* Funciones auxiliares */
 void build_height_cache(HEIGHTMAP *hm)
+{
+    if (!hm->heightmap)
+        return;
+
+    reprojection_invalidate();
+
+    if (hm->height_cache) {
+        free_height_cache(hm);
+        hm->cache_valid = 0;
+    }
+    free_height_pyramid(hm);
+    free_texel_cache(hm);   // Sin textura los colores dependen de la altura
+
+    // Tablas de la disposición actual del mapa (por filas salvo HEIGHTMAP_SET_TILED_LAYOUT)
+    if (!texel_layout_set(hm, hm->texel_brick)) {
+        hm->cache_valid = 0;
+        return;
+    }
+
+    hm->height_cache = calloc(hm->texel_count, sizeof(uint16_t));
+    if (!hm->height_cache) {
+        hm->cache_valid = 0;
+        fprintf(stderr, "Error: No se pudo asignar height_cache para heightmap %dx%d\n",
+                (int)hm->width, (int)hm->height);
+        return;
+    }
+
+    // 8 bits: canal rojo. 16 bits (HEIGHTMAP_LOAD_RG): rojo es el byte alto y verde el bajo
+    int rg_encoded = (hm->height_bits == 16);
+    for (int y = 0; y < hm->height; y++) {
+        for (int x = 0; x < hm->width; x++) {
+            uint32_t pixel = gr_get_pixel(hm->heightmap, x, y);
+            uint16_t value = (pixel >> 16) & 0xFF;
+            if (rg_encoded)
+                value = (uint16_t)((value << 8) | ((pixel >> 8) & 0xFF));
+            hm->height_cache[texel_index(hm, x, y)] = value;
+        }
+    }
+
+    height_cache_ready(hm);
+}
 
+static void free_height_pyramid(HEIGHTMAP *hm)
 {
+    for (int level = 0; level < HEIGHT_PYRAMID_MAX_LEVELS; level++) {
+        if (!terrain_file_owns(hm, hm->height_max[level]))
+            free(hm->height_max[level]);
+        hm->height_max[level] = NULL;
+        hm->height_max_width[level] = 0;
+        hm->height_max_height[level] = 0;
+    }
+    hm->height_max_levels = 0;
+}
 
-    if (!hm->heightmap)
+/* Pirámide de alturas máximas. Cada valor del nivel 0 es el máximo de las
+   alturas que puede devolver get_height_at dentro de su bloque de 4x4 celdas
+   (incluye la fila y columna vecinas que usa la interpolación bilineal). */
+static void build_height_pyramid(HEIGHTMAP *hm)
+{
+    free_height_pyramid(hm);
 
+    if (!hm->cache_valid || hm->width < 2 || hm->height < 2)
         return;
 
+    int cells_w = (int)hm->width - 1;
+    int cells_h = (int)hm->height - 1;
+    int block = 1 << HEIGHT_PYRAMID_BASE_SHIFT;
+    int level_w = (cells_w + block - 1) / block;
+    int level_h = (cells_h + block - 1) / block;
 
-   if (hm->height_cache)  
-{  
-    free(hm->height_cache);  
-    hm->height_cache = NULL;  
-    hm->cache_valid = 0;  
-}  
-  
-hm->height_cache = malloc(hm->width * hm->height * sizeof(float));  
-if (!hm->height_cache)  
-{  
-    hm->cache_valid = 0;  
-    fprintf(stderr, "Error: No se pudo asignar height_cache para heightmap %ldx%ld\n",   
-            (int)hm->width, (int)hm->height);  
-    return;  
+    float *base = malloc((size_t)level_w * level_h * sizeof(float));
+    if (!base) {
+        fprintf(stderr, "Error: No se pudo asignar la pirámide de alturas\n");
+        return;
+    }
+
+    // Paginado no hay height_cache: se leen las alturas del fichero, por filas
+    const uint16_t *rows = hm->pager ? terrain_file_heights(hm) : NULL;
+
+    for (int by = 0; by < level_h; by++) {
+        int y0 = by * block;
+        int y1 = (y0 + block < cells_h) ? y0 + block : cells_h;
+        for (int bx = 0; bx < level_w; bx++) {
+            int x0 = bx * block;
+            int x1 = (x0 + block < cells_w) ? x0 + block : cells_w;
+            uint16_t max_height = 0;
+            for (int y = y0; y <= y1; y++) {
+                for (int x = x0; x <= x1; x++) {
+                    uint16_t value = rows ? rows[(size_t)y * hm->width + x] : texel_height_value(hm, x, y);
+                    if (value > max_height)
+                        max_height = value;
+                }
+            }
+            base[by * level_w + bx] = height_dequantize(hm, max_height);
+        }
+    }
+
+    hm->height_max[0] = base;
+    hm->height_max_width[0] = level_w;
+    hm->height_max_height[0] = level_h;
+    hm->height_max_levels = 1;
+
+    // Cada nivel es el máximo de 2x2 bloques del anterior
+    while (hm->height_max_levels < HEIGHT_PYRAMID_MAX_LEVELS && (level_w > 1 || level_h > 1)) {
+        int prev = hm->height_max_levels - 1;
+        const float *src = hm->height_max[prev];
+        int src_w = level_w, src_h = level_h;
+        level_w = (src_w + 1) / 2;
+        level_h = (src_h + 1) / 2;
+
+        float *dst = malloc((size_t)level_w * level_h * sizeof(float));
+        if (!dst)
+            break;
+
+        for (int y = 0; y < level_h; y++) {
+            int sy0 = y * 2, sy1 = (y * 2 + 1 < src_h) ? y * 2 + 1 : y * 2;
+            for (int x = 0; x < level_w; x++) {
+                int sx0 = x * 2, sx1 = (x * 2 + 1 < src_w) ? x * 2 + 1 : x * 2;
+                float a = fmaxf(src[sy0 * src_w + sx0], src[sy0 * src_w + sx1]);
+                float b = fmaxf(src[sy1 * src_w + sx0], src[sy1 * src_w + sx1]);
+                dst[y * level_w + x] = fmaxf(a, b);
+            }
+        }
+
+        hm->height_max[prev + 1] = dst;
+        hm->height_max_width[prev + 1] = level_w;
+        hm->height_max_height[prev + 1] = level_h;
+        hm->height_max_levels++;
+    }
 }
 
 
-    for (int y = 0; y < hm->height; y++)
+/* Devuelve un color RGB interpolado usando funciones SDL */
+static void free_texel_cache(HEIGHTMAP *hm)
+{
+    // Paginado se conserva la reserva y solo se descartan las teselas cargadas
+    if (hm->pager) {
+        terrain_pager_reset(hm);
+        return;
+    }
+    // Si las alturas solo estaban aquí se van con los registros
+    if (hm->texel_cache && !hm->height_cache && !hm->file_data)
+        hm->cache_valid = 0;
+    free(hm->texel_cache);
+    hm->texel_cache = NULL;
+    hm->texel_cache_texture = NULL;
+    hm->texel_cache_light = -1;
+}
 
-    {
+// Lo que decide el color de los texels. El paginador guarda una copia para que
+// su hilo no lea el HEIGHTMAP mientras el juego cambia la textura o el rango
+typedef struct {
+    GRAPH *texture;                 // Tiene prioridad sobre file_colors
+    const uint8_t *file_colors;
+    int light;                      // light_intensity recortada a 0-255
+    float height_scale;
+    float height_offset;
+} TEXEL_SHADING;
+
+static void texel_shading_current(const HEIGHTMAP *hm, TEXEL_SHADING *shading)
+{
+    // La textura cargada tiene prioridad sobre el color que traiga el fichero .hmt
+    shading->texture = hm->texturemap;
+    shading->file_colors = hm->texturemap ? NULL : hm->file_colors;
+    shading->light = (light_intensity < 0) ? 0 : (light_intensity > 255) ? 255 : light_intensity;
+    shading->height_scale = hm->height_scale;
+    shading->height_offset = hm->height_offset;
+}
 
-        for (int x = 0; x < hm->width; x++)
+/* Rellena los texels [x0, x1) x [y0, y1) de texel_cache. La altura sale de
+   height_cache (o del propio registro si ya solo está ahí) o, si se pasa rows,
+   de esas alturas por filas (fichero .hmt). */
+static void shade_texel_rect(const HEIGHTMAP *hm, const TEXEL_SHADING *shading, const uint16_t *rows,
+                             int x0, int y0, int x1, int y1)
+{
+    GRAPH *texture = shading->texture;
+    const uint8_t *file_colors = shading->file_colors;
+    int light = shading->light;
+
+    for (int y = y0; y < y1; y++) {
+        TERRAIN_TEXEL *row = hm->texel_cache + hm->texel_y[y];
+        int ty = texture ? (int)(y % texture->height) : 0;
+
+        for (int x = x0; x < x1; x++) {
+            TERRAIN_TEXEL *texel = row + hm->texel_x[x];
+            int r, g, b;
+
+            int right = (x + 1 < hm->width) ? x + 1 : x;
+            if (rows) {
+                texel->height = rows[(size_t)y * hm->width + x];
+                texel->height_right = rows[(size_t)y * hm->width + right];
+            } else {
+                texel->height = texel_height_value(hm, x, y);
+                texel->height_right = texel_height_value(hm, right, y);
+            }
+            if (texture) {
+                uint32_t tex = gr_get_pixel(texture, x % texture->width, ty);
+                r = (tex >> gPixelFormat->Rshift) & 0xFF;
+                g = (tex >> gPixelFormat->Gshift) & 0xFF;
+                b = (tex >> gPixelFormat->Bshift) & 0xFF;
+            } else if (file_colors) {
+                const uint8_t *rgba = file_colors + ((size_t)y * hm->width + x) * 4;
+                r = rgba[0];
+                g = rgba[1];
+                b = rgba[2];
+            } else {
+                int base = (int)((shading->height_offset + texel->height * shading->height_scale) * 2.5f) + 20;
+                if (base > 255) base = 255;
+                if (base < 0) base = 0;
+
+                int grid_variation = ((x * 2) % 8 + (y * 2) % 8) % 3 - 1;
+                base += grid_variation * 15;
+                if (base > 255) base = 255;
+                if (base < 0) base = 0;
+
+                r = (Uint8)(base + 60);
+                g = (Uint8)(base + 30);
+                b = (Uint8)base;
+            }
 
-        {
+            texel->color = SDL_MapRGB(gPixelFormat, (Uint8)(r * light / 255), (Uint8)(g * light / 255), (Uint8)(b * light / 255));
+        }
+    }
+}
 
-            uint32_t pixel = gr_get_pixel(hm->heightmap, x, y);
+/* Caché de texels del terreno: por celda del heightmap, la altura cuantizada,
+   la de su derecha y un píxel ya empaquetado en gPixelFormat con la textura
+   (repetida en mosaico) o el sombreado procedural por altura, y con
+   light_intensity aplicada. El render CPU lee la altura y el color de cada
+   muestra de los mismos registros. Una vez hecha, height_cache sobra: se libera
+   y get_height_at y la pirámide leen las alturas de los registros. Si ya
+   existía, solo se vuelven a sombrear en su sitio. */
+static int build_texel_cache(HEIGHTMAP *hm)
+{
+    if (!hm->cache_valid)
+        return 0;
 
-            float height = (float)((pixel >> 16) & 0xFF);
+    reprojection_invalidate();
 
-            hm->height_cache[y * hm->width + x] = height;
+    // Paginado, cada tesela se sombrea al cargarla
+    if (hm->pager) {
+        terrain_pager_reset(hm);
+        return 1;
+    }
 
+    if (!hm->texel_cache) {
+        hm->texel_cache = calloc(hm->texel_count, sizeof(TERRAIN_TEXEL));
+        if (!hm->texel_cache) {
+            fprintf(stderr, "Error: No se pudo asignar texel_cache para heightmap %dx%d\n",
+                    (int)hm->width, (int)hm->height);
+            return 0;
         }
+    }
+
+    TEXEL_SHADING shading;
+    texel_shading_current(hm, &shading);
+    shade_texel_rect(hm, &shading, NULL, 0, 0, (int)hm->width, (int)hm->height);
+
+    // Las alturas de un .hmt por filas son el propio fichero: no ocupan memoria
+    if (!terrain_file_owns(hm, hm->height_cache))
+        free_height_cache(hm);
+
+    hm->texel_cache_texture = hm->texturemap;
+    hm->texel_cache_light = light_intensity;
+    return 1;
+}
+
+// ============================================================================
+// PAGINACIÓN DEL TERRENO (.hmt)
+// ============================================================================
+// Un mapa de 32768x32768 necesita 8 GB de texel_cache. Con HEIGHTMAP_SET_PAGING
+// solo se reserva el espacio de direcciones: texel_cache pasa a la disposición
+// en bloques de 16, cuyas supertexelas de 128x128 texels (128 KB) son
+// contiguas, y cada una ocupa memoria solo mientras está cargada. Antes de
+// dibujar cada vista se cargan las que cubre su ventana de chunks, recortada a
+// la distancia de render. Un hilo carga en segundo plano las de alrededor,
+// hasta prefetch chunks más allá y de la más cercana a la más lejana, y cuando
+// las cargadas superan el presupuesto se descartan las que llevan más renders
+// sin usarse. El fichero .hmt mapeado hace de almacén: las alturas para
+// colisiones y para la pirámide se leen directamente de él.
+
+#define PAGER_TILE_SIDE      (16 << TEXEL_SUPER_SHIFT)   // Lado de la supertexela con bloques de 16
+#define PAGER_MAX_PREFETCH   8
+
+enum { PAGER_TILE_EMPTY, PAGER_TILE_QUEUED, PAGER_TILE_LOADING, PAGER_TILE_READY };
+
+typedef struct TERRAIN_PAGER {
+    HEIGHTMAP *hm;
+    TERRAIN_TEXEL *region;          // Reserva de texel_cache completa
+    size_t region_bytes;
+    int tiles_x, tiles_y, tile_count;
+    uint8_t *state;                 // PAGER_TILE_* por supertexela
+    uint32_t *last_used;            // Época del último render que la necesitó
+    uint32_t epoch;                 // Sube en cada render; lo marcado con ella no se descarta
+    uint32_t generation;            // Sube al cambiar el sombreado y anula las cargas en curso
+    TEXEL_SHADING shading;
+    int *resident;                  // Teselas que ocupan memoria (en carga o cargadas)
+    int resident_count;
+    int budget_tiles;
+    int prefetch;                   // Chunks de margen que se cargan en segundo plano
+    int warned;                     // Ya se avisó de que las vistas no caben en el presupuesto
+    int *queue;                     // Cola circular del hilo del paginador
+    int queue_head, queue_count;
+    int *missing;                   // Teselas que carga el render antes de dibujar
+    int missing_count;
+    TEXEL_SHADING missing_shading;
+    SDL_mutex *lock;
+    SDL_cond *wake;                 // Hay trabajo en la cola o hay que salir
+    SDL_cond *loaded;               // El hilo del paginador terminó una tesela
+    SDL_Thread *thread;
+    int quit;
+} TERRAIN_PAGER;
+
+static inline TERRAIN_TEXEL *pager_tile_texels(const TERRAIN_PAGER *pager, int tile) {
+    return pager->region + (size_t)tile * PAGER_TILE_SIDE * PAGER_TILE_SIDE;
+}
+
+static void *pager_region_reserve(size_t bytes) {
+#ifdef _WIN32
+    return VirtualAlloc(NULL, bytes, MEM_RESERVE, PAGE_READWRITE);
+#else
+    // Las páginas se crean al escribirlas; las no cargadas se leen a cero
+    void *region = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return (region == MAP_FAILED) ? NULL : region;
+#endif
+}
+
+static void pager_region_release(void *region, size_t bytes) {
+#ifdef _WIN32
+    (void)bytes;
+    VirtualFree(region, 0, MEM_RELEASE);
+#else
+    munmap(region, bytes);
+#endif
+}
+
+static int pager_tile_commit(TERRAIN_PAGER *pager, int tile) {
+#ifdef _WIN32
+    size_t bytes = (size_t)PAGER_TILE_SIDE * PAGER_TILE_SIDE * sizeof(TERRAIN_TEXEL);
+    return VirtualAlloc(pager_tile_texels(pager, tile), bytes, MEM_COMMIT, PAGE_READWRITE) != NULL;
+#else
+    (void)pager;
+    (void)tile;
+    return 1;
+#endif
+}
+
+static void pager_tile_decommit(TERRAIN_PAGER *pager, int tile) {
+    size_t bytes = (size_t)PAGER_TILE_SIDE * PAGER_TILE_SIDE * sizeof(TERRAIN_TEXEL);
+#ifdef _WIN32
+    // Los carriles inactivos de los gathers AVX2 leen el texel 0: su tesela no se libera nunca
+    if (tile != 0)
+        VirtualFree(pager_tile_texels(pager, tile), bytes, MEM_DECOMMIT);
+#else
+    madvise(pager_tile_texels(pager, tile), bytes, MADV_DONTNEED);
+#endif
+}
 
+// Las funciones pager_tile_* se llaman con el cerrojo tomado
+
+static int pager_tile_start(TERRAIN_PAGER *pager, int tile) {
+    if (!pager_tile_commit(pager, tile)) {
+        fprintf(stderr, "Error: No se pudo asignar memoria para la tesela %d del terreno\n", tile);
+        pager->state[tile] = PAGER_TILE_EMPTY;
+        return 0;
+    }
+    pager->state[tile] = PAGER_TILE_LOADING;
+    pager->resident[pager->resident_count++] = tile;
+    return 1;
+}
+
+static void pager_tile_drop(TERRAIN_PAGER *pager, int tile) {
+    pager_tile_decommit(pager, tile);
+    for (int i = 0; i < pager->resident_count; i++) {
+        if (pager->resident[i] == tile) {
+            pager->resident[i] = pager->resident[--pager->resident_count];
+            break;
+        }
     }
+    pager->state[tile] = PAGER_TILE_EMPTY;
+}
 
+// Una carga empezada antes de cambiar el sombreado se tira
+static void pager_tile_finish(TERRAIN_PAGER *pager, int tile, uint32_t generation) {
+    if (generation == pager->generation)
+        pager->state[tile] = PAGER_TILE_READY;
+    else
+        pager_tile_drop(pager, tile);
+}
 
-    hm->cache_valid = 1;
+static void pager_queue_push(TERRAIN_PAGER *pager, int tile) {
+    pager->queue[(pager->queue_head + pager->queue_count) % pager->tile_count] = tile;
+    pager->queue_count++;
+    pager->state[tile] = PAGER_TILE_QUEUED;
+}
 
+static int pager_queue_pop(TERRAIN_PAGER *pager) {
+    int tile = pager->queue[pager->queue_head];
+    pager->queue_head = (pager->queue_head + 1) % pager->tile_count;
+    pager->queue_count--;
+    return tile;
 }
 
+// Sombrea una tesela en carga. Sin cerrojo: nadie más escribe su memoria
+static void pager_tile_fill(TERRAIN_PAGER *pager, const TEXEL_SHADING *shading, int tile) {
+    const HEIGHTMAP *hm = pager->hm;
+    int x0 = (tile % pager->tiles_x) * PAGER_TILE_SIDE;
+    int y0 = (tile / pager->tiles_x) * PAGER_TILE_SIDE;
+    int x1 = min(x0 + PAGER_TILE_SIDE, (int)hm->width);
+    int y1 = min(y0 + PAGER_TILE_SIDE, (int)hm->height);
+    shade_texel_rect(hm, shading, terrain_file_heights(hm), x0, y0, x1, y1);
+}
+
+static void pager_missing_job(void *data, int index) {
+    TERRAIN_PAGER *pager = (TERRAIN_PAGER *)data;
+    pager_tile_fill(pager, &pager->missing_shading, pager->missing[index]);
+}
+
+static int terrain_pager_main(void *data) {
+    TERRAIN_PAGER *pager = (TERRAIN_PAGER *)data;
+
+    SDL_LockMutex(pager->lock);
+    while (!pager->quit) {
+        if (pager->queue_count == 0) {
+            SDL_CondWait(pager->wake, pager->lock);
+            continue;
+        }
+
+        // El render puede haberla cargado ya por su cuenta
+        int tile = pager_queue_pop(pager);
+        if (pager->state[tile] != PAGER_TILE_QUEUED || !pager_tile_start(pager, tile))
+            continue;
+
+        TEXEL_SHADING shading = pager->shading;
+        uint32_t generation = pager->generation;
+        SDL_UnlockMutex(pager->lock);
+        pager_tile_fill(pager, &shading, tile);
+        SDL_LockMutex(pager->lock);
+
+        pager_tile_finish(pager, tile, generation);
+        SDL_CondBroadcast(pager->loaded);
+    }
+    SDL_UnlockMutex(pager->lock);
+    return 0;
+}
+
+static void pager_destroy(TERRAIN_PAGER *pager) {
+    if (pager->thread) {
+        SDL_LockMutex(pager->lock);
+        pager->quit = 1;
+        SDL_CondSignal(pager->wake);
+        SDL_UnlockMutex(pager->lock);
+        SDL_WaitThread(pager->thread, NULL);
+    }
+    if (pager->region)
+        pager_region_release(pager->region, pager->region_bytes);
+    if (pager->lock) SDL_DestroyMutex(pager->lock);
+    if (pager->wake) SDL_DestroyCond(pager->wake);
+    if (pager->loaded) SDL_DestroyCond(pager->loaded);
+    free(pager->state);
+    free(pager->last_used);
+    free(pager->resident);
+    free(pager->queue);
+    free(pager->missing);
+    free(pager);
+}
+
+static void terrain_pager_free(HEIGHTMAP *hm) {
+    if (!hm->pager)
+        return;
+    pager_destroy(hm->pager);
+    hm->pager = NULL;
+    hm->texel_cache = NULL;
+    hm->texel_cache_texture = NULL;
+    hm->texel_cache_light = -1;
+    reprojection_invalidate();
+}
+
+// Descarta las teselas cargadas; las que están en carga las tira quien las carga
+static void terrain_pager_reset(HEIGHTMAP *hm) {
+    TERRAIN_PAGER *pager = hm->pager;
+
+    SDL_LockMutex(pager->lock);
+    pager->generation++;
+    texel_shading_current(hm, &pager->shading);
+    for (int i = pager->resident_count - 1; i >= 0; i--) {
+        int tile = pager->resident[i];
+        if (pager->state[tile] == PAGER_TILE_READY)
+            pager_tile_drop(pager, tile);
+    }
+    SDL_UnlockMutex(pager->lock);
+
+    hm->texel_cache_texture = hm->texturemap;
+    hm->texel_cache_light = light_intensity;
+    reprojection_invalidate();
+}
+
+// Empieza un render (de una vista o de un lote): la cola del hilo se rehace
+// con las vistas de este render
+static void terrain_pager_begin(HEIGHTMAP *hm) {
+    TERRAIN_PAGER *pager = hm->pager;
+    if (!pager)
+        return;
+
+    SDL_LockMutex(pager->lock);
+    pager->epoch++;
+    while (pager->queue_count > 0) {
+        int tile = pager_queue_pop(pager);
+        if (pager->state[tile] == PAGER_TILE_QUEUED)
+            pager->state[tile] = PAGER_TILE_EMPTY;
+    }
+    SDL_UnlockMutex(pager->lock);
+}
+
+/* Deja cargados los texels [x0, x1] x [y0, y1] para la vista que se va a
+   dibujar, encola los de alrededor para el hilo del paginador y descarta los
+   más antiguos si se pasa del presupuesto. */
+static void terrain_pager_require(HEIGHTMAP *hm, int x0, int y0, int x1, int y1) {
+    TERRAIN_PAGER *pager = hm->pager;
+
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > hm->width - 1) x1 = (int)hm->width - 1;
+    if (y1 > hm->height - 1) y1 = (int)hm->height - 1;
+    if (x0 > x1 || y0 > y1)
+        return;
+
+    int tx0 = x0 / PAGER_TILE_SIDE, tx1 = x1 / PAGER_TILE_SIDE;
+    int ty0 = y0 / PAGER_TILE_SIDE, ty1 = y1 / PAGER_TILE_SIDE;
+
+    SDL_LockMutex(pager->lock);
+    for (;;) {
+        int loading = 0;
+        pager->missing_count = 0;
+        for (int ty = ty0; ty <= ty1; ty++) {
+            for (int tx = tx0; tx <= tx1; tx++) {
+                int tile = ty * pager->tiles_x + tx;
+                pager->last_used[tile] = pager->epoch;
+                if (pager->state[tile] == PAGER_TILE_LOADING)
+                    loading = 1;
+                else if (pager->state[tile] != PAGER_TILE_READY && pager_tile_start(pager, tile))
+                    pager->missing[pager->missing_count++] = tile;
+            }
+        }
+
+        if (pager->missing_count > 0) {
+            // Las que faltan se reparten entre los hilos del render
+            uint32_t generation = pager->generation;
+            pager->missing_shading = pager->shading;
+            SDL_UnlockMutex(pager->lock);
+            render_pool_run(pager_missing_job, pager, pager->missing_count);
+            SDL_LockMutex(pager->lock);
+            for (int i = 0; i < pager->missing_count; i++)
+                pager_tile_finish(pager, pager->missing[i], generation);
+            continue;
+        }
+        if (!loading)
+            break;
+        // Las termina el hilo del paginador
+        SDL_CondWait(pager->loaded, pager->lock);
+    }
+
+    // Anillos de supertexelas alrededor, de dentro afuera, hasta prefetch chunks más allá.
+    // Se marcan como usadas en el render anterior: por detrás de las visibles, por
+    // delante de las demás
+    int rings = (pager->prefetch * chunk_size + PAGER_TILE_SIDE - 1) / PAGER_TILE_SIDE;
+    int queued = 0;
+    for (int ring = 1; ring <= rings; ring++) {
+        for (int ty = max(ty0 - ring, 0); ty <= min(ty1 + ring, pager->tiles_y - 1); ty++) {
+            for (int tx = max(tx0 - ring, 0); tx <= min(tx1 + ring, pager->tiles_x - 1); tx++) {
+                if (ty != ty0 - ring && ty != ty1 + ring && tx != tx0 - ring && tx != tx1 + ring)
+                    continue;
+                int tile = ty * pager->tiles_x + tx;
+                if (pager->last_used[tile] != pager->epoch)
+                    pager->last_used[tile] = pager->epoch - 1;
+                if (pager->state[tile] == PAGER_TILE_EMPTY &&
+                    pager->resident_count + pager->queue_count < pager->budget_tiles) {
+                    pager_queue_push(pager, tile);
+                    queued = 1;
+                }
+            }
+        }
+    }
+    if (queued)
+        SDL_CondSignal(pager->wake);
+
+    // Por encima del presupuesto se descartan las que llevan más renders sin usarse
+    while (pager->resident_count > pager->budget_tiles) {
+        int oldest = -1;
+        uint32_t oldest_age = 0;
+        for (int i = 0; i < pager->resident_count; i++) {
+            int tile = pager->resident[i];
+            uint32_t age = pager->epoch - pager->last_used[tile];
+            if (pager->state[tile] == PAGER_TILE_READY && age > oldest_age) {
+                oldest = tile;
+                oldest_age = age;
+            }
+        }
+        if (oldest < 0) {
+            if (!pager->warned)
+                fprintf(stderr, "Error: las vistas necesitan %d teselas de terreno y el presupuesto es de %d\n",
+                        pager->resident_count, pager->budget_tiles);
+            pager->warned = 1;
+            break;
+        }
+        pager_tile_drop(pager, oldest);
+    }
+    SDL_UnlockMutex(pager->lock);
+}
+
+static int terrain_pager_enable(HEIGHTMAP *hm, int budget_tiles, int prefetch) {
+    uint32_t *tx, *ty;
+    size_t count;
+    if (!texel_tables_build((int)hm->width, (int)hm->height, 16, &tx, &ty, &count))
+        return 0;
+
+    TERRAIN_PAGER *pager = calloc(1, sizeof(TERRAIN_PAGER));
+    if (!pager) {
+        free(tx);
+        free(ty);
+        fprintf(stderr, "Error: No se pudo asignar el paginador del terreno\n");
+        return 0;
+    }
+
+    pager->hm = hm;
+    pager->tiles_x = ((int)hm->width + PAGER_TILE_SIDE - 1) / PAGER_TILE_SIDE;
+    pager->tiles_y = ((int)hm->height + PAGER_TILE_SIDE - 1) / PAGER_TILE_SIDE;
+    pager->tile_count = pager->tiles_x * pager->tiles_y;
+    pager->region_bytes = count * sizeof(TERRAIN_TEXEL);
+    pager->region = pager_region_reserve(pager->region_bytes);
+    pager->state = calloc(pager->tile_count, sizeof(uint8_t));
+    pager->last_used = calloc(pager->tile_count, sizeof(uint32_t));
+    pager->resident = malloc(pager->tile_count * sizeof(int));
+    pager->queue = malloc(pager->tile_count * sizeof(int));
+    pager->missing = malloc(pager->tile_count * sizeof(int));
+    pager->lock = SDL_CreateMutex();
+    pager->wake = SDL_CreateCond();
+    pager->loaded = SDL_CreateCond();
+    pager->budget_tiles = budget_tiles;
+    pager->prefetch = prefetch;
+
+    // Los carriles inactivos de los gathers AVX2 leen el texel 0: su tesela tiene que existir
+    if (!pager->region || !pager->state || !pager->last_used || !pager->resident || !pager->queue ||
+        !pager->missing || !pager->lock || !pager->wake || !pager->loaded || !pager_tile_commit(pager, 0)) {
+        free(tx);
+        free(ty);
+        pager_destroy(pager);
+        fprintf(stderr, "Error: No se pudo reservar la paginación para heightmap %dx%d\n",
+                (int)hm->width, (int)hm->height);
+        return 0;
+    }
+
+    // Desde aquí el render lee los texels de la reserva y las alturas, del fichero
+    free_texel_cache(hm);
+    free_height_cache(hm);
+    free_texel_layout(hm);
+    hm->texel_x = tx;
+    hm->texel_y = ty;
+    hm->texel_count = count;
+    hm->texel_brick = 16;
+    hm->texel_cache = pager->region;
+    hm->pager = pager;
+    terrain_pager_reset(hm);
+
+    pager->thread = SDL_CreateThread(terrain_pager_main, "heightmap_pager", pager);
+    if (!pager->thread)
+        fprintf(stderr, "Error: No se pudo crear el hilo del paginador, solo se carga lo visible\n");
+    return 1;
+}
+
+/* Paginación de un mapa .hmt: los texels se cargan por supertexelas alrededor
+   de las cámaras sin pasar de budget_mb megas, y el hilo del paginador
+   adelanta las que están a menos de prefetch chunks (0-8) de lo visible.
+   budget_mb = 0 la desactiva. El resultado del render es idéntico. */
+int64_t libmod_heightmap_set_paging(INSTANCE *my, int64_t *params)
+{
+    HEIGHTMAP *hm = find_heightmap_by_id(params[0]);
+    int64_t budget_mb = params[1];
+    int64_t prefetch = params[2];
+
+    if (!hm || !hm->cache_valid)
+        return 0;
+    if (!hm->file_data) {
+        fprintf(stderr, "Error: solo se pueden paginar los terrenos .hmt\n");
+        return 0;
+    }
+    if (budget_mb < 0 || prefetch < 0 || prefetch > PAGER_MAX_PREFETCH) {
+        fprintf(stderr, "Error: paginación no válida (presupuesto >= 0 MB, prefetch entre 0 y %d chunks)\n",
+                PAGER_MAX_PREFETCH);
+        return 0;
+    }
+
+    if (budget_mb == 0) {
+        if (!hm->pager)
+            return 1;
+        // De vuelta a las alturas del fichero en su sitio, por filas
+        terrain_pager_free(hm);
+        if (!texel_layout_set(hm, TEXEL_LAYOUT_ROWS)) {
+            hm->cache_valid = 0;
+            return 0;
+        }
+        hm->height_cache = (uint16_t *)terrain_file_heights(hm);
+        return 1;
+    }
+
+    int64_t tile_bytes = (int64_t)PAGER_TILE_SIDE * PAGER_TILE_SIDE * sizeof(TERRAIN_TEXEL);
+    int64_t budget_tiles = (budget_mb < INT_MAX / 8 ? budget_mb : INT_MAX / 8) * 1024 * 1024 / tile_bytes;
+    if (budget_tiles < 1)
+        budget_tiles = 1;
+
+    if (hm->pager) {
+        SDL_LockMutex(hm->pager->lock);
+        hm->pager->budget_tiles = (int)budget_tiles;
+        hm->pager->prefetch = (int)prefetch;
+        hm->pager->warned = 0;
+        SDL_UnlockMutex(hm->pager->lock);
+        return 1;
+    }
+    return terrain_pager_enable(hm, (int)budget_tiles, (int)prefetch);
+}
 
-/* Devuelve un color RGB interpolado usando funciones SDL */
 uint32_t get_texture_color_bilinear(GRAPH *texture, float x, float y) {  
     if (!texture)  
         return 0;  
@@ -2209,11 +6613,8 @@ uint32_t get_texture_color_bilinear(GRAPH *texture, float x, float y) {
     Uint8 r01, g01, b01, a01 = 255;  
     Uint8 r11, g11, b11, a11 = 255;  
   
-  // Al inicio de la función, después de las validaciones  
-static int cached_bytes_per_pixel = 0;  
-if (cached_bytes_per_pixel == 0) {  
-    cached_bytes_per_pixel = gPixelFormat->BytesPerPixel;  
-}  
+  // Local (no static): la función se llama desde los hilos de render  
+int cached_bytes_per_pixel = gPixelFormat->BytesPerPixel;  
   
 // Extraer componentes usando los shifts correctos del formato  
 if (cached_bytes_per_pixel == 4) {  
@@ -2294,15 +6695,15 @@ void clamp_camera_to_terrain(HEIGHTMAP *hm)
         return;
 
     // Obtener altura del terreno en posición de cámara
-    float terrain_height = get_height_at(hm, camera.x, camera.y);
+    float terrain_height = get_height_at(hm, active_context->camera.x, active_context->camera.y);
 
     // Altura mínima sobre el terreno (por ejemplo, 5 unidades)
     float min_height_above_terrain = 5.0f;
 
     // Ajustar Z de cámara si está muy cerca del terreno
-    if (camera.z < terrain_height + min_height_above_terrain)
+    if (active_context->camera.z < terrain_height + min_height_above_terrain)
     {
-        camera.z = terrain_height + min_height_above_terrain;
+        active_context->camera.z = terrain_height + min_height_above_terrain;
     }
 }
 
@@ -2316,16 +6717,16 @@ void clamp_camera_to_bounds(HEIGHTMAP *hm)
     float margin = 2.0f;
 
     // Limitar X
-    if (camera.x < margin)
-        camera.x = margin;
-    if (camera.x >= hm->width - margin)
-        camera.x = hm->width - margin - 0.1f;
+    if (active_context->camera.x < margin)
+        active_context->camera.x = margin;
+    if (active_context->camera.x >= hm->width - margin)
+        active_context->camera.x = hm->width - margin - 0.1f;
 
     // Limitar Y
-    if (camera.y < margin)
-        camera.y = margin;
-    if (camera.y >= hm->height - margin)
-        camera.y = hm->height - margin - 0.1f;
+    if (active_context->camera.y < margin)
+        active_context->camera.y = margin;
+    if (active_context->camera.y >= hm->height - margin)
+        active_context->camera.y = hm->height - margin - 0.1f;
 }
 
 /* Inicializar cámara en posición válida del terreno */
@@ -2386,25 +6787,25 @@ int64_t libmod_heightmap_init_camera_on_terrain(INSTANCE *my, int64_t *params)
         y = hm->height - margin - 1;
 
 
-    camera.x = x;
+    active_context->camera.x = x;
 
-    camera.y = y;
+    active_context->camera.y = y;
 
 
     // Obtener altura del terreno y situar cámara justo encima
 
-    float terrain_height = get_height_at(hm, camera.x, camera.y);
+    float terrain_height = get_height_at(hm, active_context->camera.x, active_context->camera.y);
 
-    camera.z = terrain_height + 80.0f;
+    active_context->camera.z = terrain_height + 80.0f;
 
 
     // Ángulos iniciales
 
-    camera.angle = 0.0f;
+    active_context->camera.angle = 0.0f;
 
-    camera.pitch = 0.0f;
+    active_context->camera.pitch = 0.0f;
 
-    camera.fov = DEFAULT_FOV;
+    active_context->camera.fov = DEFAULT_FOV;
 
 
     return 1;
@@ -2425,7 +6826,7 @@ int64_t libmod_heightmap_set_control_sensitivity(INSTANCE *my, int64_t *params)
 int64_t libmod_heightmap_look_horizontal(INSTANCE *my, int64_t *params)
 {
     float delta = (float)params[0];
-    camera.angle += delta * mouse_sensitivity / 1000.0f;
+    active_context->camera.angle += delta * mouse_sensitivity / 1000.0f;
     return 1;
 }
 
@@ -2433,14 +6834,14 @@ int64_t libmod_heightmap_look_horizontal(INSTANCE *my, int64_t *params)
 int64_t libmod_heightmap_look_vertical(INSTANCE *my, int64_t *params)
 {
     float delta = (float)params[0];
-    camera.pitch -= delta * mouse_sensitivity / 1000.0f;
+    active_context->camera.pitch -= delta * mouse_sensitivity / 1000.0f;
 
     // Limitar pitch
     const float max_pitch = M_PI_2 * 0.99f;
-    if (camera.pitch > max_pitch)
-        camera.pitch = max_pitch;
-    if (camera.pitch < -max_pitch)
-        camera.pitch = -max_pitch;
+    if (active_context->camera.pitch > max_pitch)
+        active_context->camera.pitch = max_pitch;
+    if (active_context->camera.pitch < -max_pitch)
+        active_context->camera.pitch = -max_pitch;
 
     return 1;
 }
@@ -2449,9 +6850,9 @@ int64_t libmod_heightmap_look_vertical(INSTANCE *my, int64_t *params)
 int64_t libmod_heightmap_adjust_height(INSTANCE *my, int64_t *params)
 {
     float delta = (float)params[0];
-    camera.z += delta * height_speed / 2.0f;
-    if (camera.z < 20)
-        camera.z = 20;
+    active_context->camera.z += delta * height_speed / 2.0f;
+    if (active_context->camera.z < 20)
+        active_context->camera.z = 20;
     return 1;
 }
 
@@ -2495,7 +6896,7 @@ int64_t libmod_heightmap_create_procedural(INSTANCE *my, int64_t *params)
     int slot = -1;
     for (int i = 0; i < MAX_HEIGHTMAPS; i++)
     {
-        if (!heightmaps[i].heightmap)
+        if (!heightmaps[i].heightmap && !heightmaps[i].file_data)
         {
             slot = i;
             break;
@@ -2533,11 +6934,11 @@ int64_t libmod_heightmap_get_camera_position(INSTANCE *my, int64_t *params)
     int64_t *camera_pitch_ptr = (int64_t *)params[4];
 
     // Actualizar las variables del PRG con los valores del módulo
-    *camera_x_ptr = (int64_t)camera.x;
-    *camera_y_ptr = (int64_t)camera.y;
-    *camera_z_ptr = (int64_t)camera.z;
-    *camera_angle_ptr = (int64_t)(camera.angle * 1000.0f);
-    *camera_pitch_ptr = (int64_t)(camera.pitch * 1000.0f);
+    *camera_x_ptr = (int64_t)active_context->camera.x;
+    *camera_y_ptr = (int64_t)active_context->camera.y;
+    *camera_z_ptr = (int64_t)active_context->camera.z;
+    *camera_angle_ptr = (int64_t)(active_context->camera.angle * 1000.0f);
+    *camera_pitch_ptr = (int64_t)(active_context->camera.pitch * 1000.0f);
 
     return 1;
 }
@@ -2553,15 +6954,15 @@ int64_t libmod_heightmap_check_terrain_collision(INSTANCE *my, int64_t *params)
         return 0;
 
     // Obtener altura del terreno en la posición actual de la cámara
-    float terrain_height = get_height_at(hm, camera.x, camera.y);
+    float terrain_height = get_height_at(hm, active_context->camera.x, active_context->camera.y);
 
     // Altura mínima sobre el terreno (altura del jugador)
     float min_height_above_terrain = 5.0f;
 
     // Si la cámara está por debajo del terreno + altura mínima, ajustar
-    if (camera.z < terrain_height + min_height_above_terrain)
+    if (active_context->camera.z < terrain_height + min_height_above_terrain)
     {
-        camera.z = terrain_height + min_height_above_terrain;
+        active_context->camera.z = terrain_height + min_height_above_terrain;
         return 1; // Colisión detectada y corregida
     }
 
@@ -2680,32 +7081,32 @@ int64_t libmod_heightmap_world_to_screen(INSTANCE *my, int64_t *params)
     int64_t *screen_x = (int64_t *)params[3];      
     int64_t *screen_y = (int64_t *)params[4];      
           
-    float dx = world_x - camera.x;      
-    float dy = world_y - camera.y;      
-    float dz = world_z - camera.z;      
+    float dx = world_x - active_context->camera.x;      
+    float dy = world_y - active_context->camera.y;      
+    float dz = world_z - active_context->camera.z;      
           
     float distance_3d = sqrtf(dx * dx + dy * dy + dz * dz);    
         
-    float cos_a = cosf(camera.angle);      
-    float sin_a = sinf(camera.angle);      
+    float cos_a = cosf(active_context->camera.angle);      
+    float sin_a = sinf(active_context->camera.angle);      
           
     float forward = dx * cos_a + dy * sin_a;      
     float right = -dx * sin_a + dy * cos_a;      
           
-    if (forward > 1.0f && forward < max_render_distance) {      
+    if (forward > 1.0f && forward < active_context->max_render_distance) {      
         float perspective_factor = 100.0f / distance_3d;  
           
         // CORREGIDO: Usar dimensiones dinámicas  
-        float half_width = current_render_width / 2.0f;  
-        float half_height = current_render_height / 2.0f;  
+        float half_width = active_context->render_width / 2.0f;  
+        float half_height = active_context->render_height / 2.0f;  
           
         float projected_x = half_width + (right * perspective_factor);      
-        float projected_y = half_height - (dz * perspective_factor) + (camera.pitch * 30.0f);      
+        float projected_y = half_height - (dz * perspective_factor) + (active_context->camera.pitch * 30.0f);      
           
         // CORREGIDO: Límites dinámicos extendidos  
         float margin = 100.0f;  
-        if (projected_x >= -margin && projected_x <= current_render_width + margin &&      
-            projected_y >= -margin && projected_y <= current_render_height + margin) {      
+        if (projected_x >= -margin && projected_x <= active_context->render_width + margin &&      
+            projected_y >= -margin && projected_y <= active_context->render_height + margin) {      
                   
             *screen_x = (int64_t)projected_x;      
             *screen_y = (int64_t)projected_y;      
@@ -2738,8 +7139,8 @@ if (world_x < 0 || world_x >= hm->width ||
 }  
   
 // Calcular distancia a la cámara para fog  
-float dx = world_x - camera.x;  
-float dy = world_y - camera.y;  
+float dx = world_x - active_context->camera.x;  
+float dy = world_y - active_context->camera.y;  
 float distance = sqrtf(dx * dx + dy * dy);  
   
 float fog = 1.0f - (distance / FOG_MAX_DISTANCE);  
@@ -2784,25 +7185,25 @@ int64_t libmod_heightmap_update_camera_follow(INSTANCE *my, int64_t *params)
 
     // Los offsets también deben estar en la misma escala  
 
-  camera.x = world_x + camera_follow_offset_x;  // Sin multiplicar por 10  
+  active_context->camera.x = world_x + camera_follow_offset_x;  // Sin multiplicar por 10  
 
-camera.y = world_y + camera_follow_offset_y;  // Sin multiplicar por 10    
+active_context->camera.y = world_y + camera_follow_offset_y;  // Sin multiplicar por 10    
 
-camera.z = world_z + camera_follow_offset_z;  // Sin multiplicar por 10
+active_context->camera.z = world_z + camera_follow_offset_z;  // Sin multiplicar por 10
 
   
 
     // Calcular ángulo para que la cámara mire hacia la nave  
 
-    float dx = world_x - camera.x;  
+    float dx = world_x - active_context->camera.x;  
 
-    float dy = world_y - camera.y;  
+    float dy = world_y - active_context->camera.y;  
 
       
 
     if (dx != 0.0f || dy != 0.0f) {  
 
-        camera.angle = atan2f(dy, dx);  
+        active_context->camera.angle = atan2f(dy, dx);  
 
     }  
 
@@ -2810,7 +7211,7 @@ camera.z = world_z + camera_follow_offset_z;  // Sin multiplicar por 10
 
     // Pitch para tercera persona  
 
-    camera.pitch = -0.3f;  
+    active_context->camera.pitch = -0.3f;  
 
   
 
@@ -2845,10 +7246,10 @@ int64_t libmod_heightmap_update_water_time(INSTANCE *my, int64_t *params)
 
 int64_t libmod_heightmap_set_sky_color(INSTANCE *my, int64_t *params)
 {
-    sky_color_r = (Uint8)params[0];
-    sky_color_g = (Uint8)params[1];
-    sky_color_b = (Uint8)params[2];
-    sky_color_a = (Uint8)params[3];
+    active_context->sky_color_r = (Uint8)params[0];
+    active_context->sky_color_g = (Uint8)params[1];
+    active_context->sky_color_b = (Uint8)params[2];
+    active_context->sky_color_a = (Uint8)params[3];
     return 1;
 }
 
@@ -2862,11 +7263,11 @@ int64_t libmod_heightmap_set_render_distance(INSTANCE *my, int64_t *params)
         return 0;  
     }  
       
-    max_render_distance = requested;  
-    if (max_render_distance < 100.0f)  
-        max_render_distance = 100.0f;  
-    if (max_render_distance > 2000.0f)  
-        max_render_distance = 2000.0f;  
+    active_context->max_render_distance = requested;  
+    if (active_context->max_render_distance < 100.0f)  
+        active_context->max_render_distance = 100.0f;  
+    if (active_context->max_render_distance > 2000.0f)  
+        active_context->max_render_distance = 2000.0f;  
       
     return 1;  
 }
@@ -3001,10 +7402,10 @@ int64_t libmod_heightmap_project_billboard(INSTANCE *my, int64_t *params)
     if (heightmap_id < 0 || heightmap_id >= MAX_HEIGHTMAPS)    
         return 0;    
     
-    float dx = wx - camera.x;    
-    float dy = wy - camera.y;    
+    float dx = wx - active_context->camera.x;    
+    float dy = wy - active_context->camera.y;    
     
-    float angle_rad = -camera.angle * M_PI / 180.0f;    
+    float angle_rad = -active_context->camera.angle * M_PI / 180.0f;    
     float x_cam = dx * cosf(angle_rad) - dy * sinf(angle_rad);    
     float z_cam = dx * sinf(angle_rad) + dy * cosf(angle_rad);    
     
@@ -3012,17 +7413,17 @@ int64_t libmod_heightmap_project_billboard(INSTANCE *my, int64_t *params)
         return 0;    
     
     // CORREGIDO: Usar dimensiones dinámicas  
-    float half_width = current_render_width / 2.0f;  
-    float half_height = current_render_height / 2.0f;  
+    float half_width = active_context->render_width / 2.0f;  
+    float half_height = active_context->render_height / 2.0f;  
       
-    float fov_scale = (current_render_height * 0.5f) / tanf(camera.fov * 0.5f * M_PI / 180.0f);    
+    float fov_scale = (active_context->render_height * 0.5f) / tanf(active_context->camera.fov * 0.5f * M_PI / 180.0f);    
     int screen_x = (int)(half_width + x_cam * fov_scale / z_cam);  
-    int screen_y = (int)(half_height - (wz - camera.z) * fov_scale / z_cam);  
+    int screen_y = (int)(half_height - (wz - active_context->camera.z) * fov_scale / z_cam);  
     
     // CORREGIDO: Límites dinámicos  
     float margin = 50.0f;  
-    if (screen_x < -margin || screen_x > current_render_width + margin ||   
-        screen_y < -margin || screen_y > current_render_height + margin)    
+    if (screen_x < -margin || screen_x > active_context->render_width + margin ||   
+        screen_y < -margin || screen_y > active_context->render_height + margin)    
         return 0;    
     
     uint32_t z_as_uint = *(uint32_t*)&z_cam;    
@@ -3235,15 +7636,15 @@ int64_t libmod_heightmap_set_fog_color(INSTANCE *my, int64_t *params)
     float new_intensity = (float)params[3] / 1000.0f;  
       
     // Invalidar tabla si los parámetros cambiaron  
-    if (new_r != fog_color_r || new_g != fog_color_g ||   
-        new_b != fog_color_b || new_intensity != fog_intensity) {  
-        fog_table_initialized = 0;  
+    if (new_r != active_context->fog_color_r || new_g != active_context->fog_color_g ||   
+        new_b != active_context->fog_color_b || new_intensity != active_context->fog_intensity) {  
+        active_context->fog_table_initialized = 0;  
     }  
       
-    fog_color_r = new_r;  
-    fog_color_g = new_g;  
-    fog_color_b = new_b;  
-    fog_intensity = new_intensity;  
+    active_context->fog_color_r = new_r;  
+    active_context->fog_color_g = new_g;  
+    active_context->fog_color_b = new_b;  
+    active_context->fog_intensity = new_intensity;  
       
     return 1;  
 }
@@ -3260,8 +7661,8 @@ int64_t libmod_heightmap_set_billboard_fov(INSTANCE *my, int64_t *params) {
 // Funciones helper internas - NO exportadas  
 static void move_camera_direction(float angle_offset, float speed_factor, float speed) {  
     float final_speed = (speed > 0) ? speed : move_speed;  
-    camera.x += cosf(camera.angle + angle_offset) * final_speed / speed_factor;  
-    camera.y += sinf(camera.angle + angle_offset) * final_speed / speed_factor;  
+    active_context->camera.x += cosf(active_context->camera.angle + angle_offset) * final_speed / speed_factor;  
+    active_context->camera.y += sinf(active_context->camera.angle + angle_offset) * final_speed / speed_factor;  
 }  
   
 // Funciones exportadas simplificadas  
@@ -3295,8 +7696,8 @@ static int move_camera_with_collision(int64_t hm_id, float angle_offset, float s
     HEIGHTMAP *hm = find_heightmap_by_id(hm_id);  
     if (!hm || !hm->cache_valid) return 0;  
       
-    float new_x = camera.x + cosf(camera.angle + angle_offset) * speed / speed_factor;  
-    float new_y = camera.y + sinf(camera.angle + angle_offset) * speed / speed_factor;  
+    float new_x = active_context->camera.x + cosf(active_context->camera.angle + angle_offset) * speed / speed_factor;  
+    float new_y = active_context->camera.y + sinf(active_context->camera.angle + angle_offset) * speed / speed_factor;  
       
     return apply_terrain_collision(hm, new_x, new_y);  
 }  
@@ -3317,16 +7718,16 @@ static int apply_terrain_collision(HEIGHTMAP *hm, float new_x, float new_y) {
         new_y >= 2.0f && new_y < hm->height - 2.0f) {  
           
         float terrain_height = get_height_at(hm, new_x, new_y);  
-        float current_terrain_height = get_height_at(hm, camera.x, camera.y);  
+        float current_terrain_height = get_height_at(hm, active_context->camera.x, active_context->camera.y);  
         float height_diff = fabs(terrain_height - current_terrain_height);  
           
         if (height_diff < 20.0f) {  
-            camera.x = new_x;  
-            camera.y = new_y;  
+            active_context->camera.x = new_x;  
+            active_context->camera.y = new_y;  
               
             float min_height = terrain_height + 5.0f;  
-            if (camera.z < min_height) {  
-                camera.z = min_height;  
+            if (active_context->camera.z < min_height) {  
+                active_context->camera.z = min_height;  
             }  
         }  
     }  
@@ -3380,7 +7781,7 @@ float libmod_heightmap_convert_screen_to_world_y(INSTANCE *my, int64_t *params)
     return convert_screen_to_world_coordinate(heightmap_id, screen_y, 0); // 0 = eje Y  
 }
 
-static void collect_visible_billboards_from_array(VOXEL_BILLBOARD *billboard_array, int array_size,   
+static void collect_visible_billboards_from_array(const RENDER_CONTEXT *ctx, VOXEL_BILLBOARD *billboard_array, int array_size,   
                                                   BILLBOARD_RENDER_DATA *visible_billboards,   
                                                   int *visible_count, float terrain_fov) {  
     for (int i = 0; i < array_size; i++) {  
@@ -3391,7 +7792,7 @@ static void collect_visible_billboards_from_array(VOXEL_BILLBOARD *billboard_arr
           
         if (!billboard_graph) continue;  
           
-        BILLBOARD_PROJECTION proj = calculate_proyection(bb, billboard_graph, terrain_fov);  
+        BILLBOARD_PROJECTION proj = calculate_proyection(ctx, bb, billboard_graph, terrain_fov);  
         if (!proj.valid) continue;  
           
         visible_billboards[*visible_count].billboard = bb;  
@@ -3402,6 +7803,47 @@ static void collect_visible_billboards_from_array(VOXEL_BILLBOARD *billboard_arr
     }  
 }
 
+// Billboards activos (estáticos y después dinámicos) con GRAPH válido
+static int gather_billboard_sources(BILLBOARD_SOURCE *sources) {
+    int count = 0;
+
+    for (int i = 0; i < static_billboard_count; i++) {
+        if (!static_billboards[i].active) continue;
+        GRAPH *graph = bitmap_get(0, static_billboards[i].graph_id);
+        if (!graph) continue;
+        sources[count].billboard = &static_billboards[i];
+        sources[count].graph = graph;
+        count++;
+    }
+    for (int i = 0; i < MAX_DYNAMIC_BILLBOARDS; i++) {
+        if (!dynamic_billboards[i].active) continue;
+        GRAPH *graph = bitmap_get(0, dynamic_billboards[i].graph_id);
+        if (!graph) continue;
+        sources[count].billboard = &dynamic_billboards[i];
+        sources[count].graph = graph;
+        count++;
+    }
+    return count;
+}
+
+// Proyecta los billboards reunidos con la cámara de ctx; devuelve cuántos son visibles
+static int project_billboard_sources(const RENDER_CONTEXT *ctx, const BILLBOARD_SOURCE *sources, int source_count,
+                                     BILLBOARD_RENDER_DATA *visible_billboards, float terrain_fov) {
+    int visible_count = 0;
+
+    for (int i = 0; i < source_count; i++) {
+        BILLBOARD_PROJECTION proj = calculate_proyection(ctx, sources[i].billboard, sources[i].graph, terrain_fov);
+        if (!proj.valid) continue;
+
+        visible_billboards[visible_count].billboard = sources[i].billboard;
+        visible_billboards[visible_count].projection = proj;
+        visible_billboards[visible_count].graph = sources[i].graph;
+        visible_billboards[visible_count].distance = proj.distance;
+        visible_count++;
+    }
+    return visible_count;
+}
+
 int64_t libmod_heightmap_set_render_resolution(INSTANCE *my, int64_t *params) {  
     int64_t width = params[0];  
     int64_t height = params[1];  
@@ -3416,13 +7858,13 @@ int64_t libmod_heightmap_set_render_resolution(INSTANCE *my, int64_t *params) {
         return 0;  
     }  
       
-    current_render_width = width;  
-    current_render_height = height;  
+    active_context->render_width = width;  
+    active_context->render_height = height;  
       
     // Forzar recreación del render_buffer en el próximo frame  
-    if (render_buffer) {  
-        bitmap_destroy(render_buffer);  
-        render_buffer = NULL;  
+    if (active_context->render_buffer) {  
+        bitmap_destroy(active_context->render_buffer);  
+        active_context->render_buffer = NULL;  
     }  
       
     return 1;  
@@ -3464,10 +7906,10 @@ int64_t libmod_heightmap_get_map_type(INSTANCE *my, int64_t *params) {
       
     float terrain_fov = 0.7f;  
       
-    collect_visible_billboards_from_array(static_billboards, static_billboard_count,  
+    collect_visible_billboards_from_array(active_context, static_billboards, static_billboard_count,  
                                          visible_billboards, &visible_count, terrain_fov);  
       
-    collect_visible_billboards_from_array(dynamic_billboards, MAX_DYNAMIC_BILLBOARDS,  
+    collect_visible_billboards_from_array(active_context, dynamic_billboards, MAX_DYNAMIC_BILLBOARDS,  
                                          visible_billboards, &visible_count, terrain_fov);  
       
     qsort(visible_billboards, visible_count, sizeof(BILLBOARD_RENDER_DATA), compare_billboards_by_distance);  
@@ -3850,18 +8292,18 @@ void wld_render_2d(WLD_Map *map, int screen_w, int screen_h)
       
     printf("DEBUG: Iniciando renderizado 2D - pantalla: %dx%d\n", screen_w, screen_h);  
       
-    // Usar el render_buffer global  
-    if (!render_buffer || render_buffer->width != screen_w || render_buffer->height != screen_h) {  
-        if (render_buffer) bitmap_destroy(render_buffer);  
-        render_buffer = bitmap_new_syslib(screen_w, screen_h);  
-        if (!render_buffer) {  
+    // Usar el render_buffer del contexto activo  
+    if (!active_context->render_buffer || active_context->render_buffer->width != screen_w || active_context->render_buffer->height != screen_h) {  
+        if (active_context->render_buffer) bitmap_destroy(active_context->render_buffer);  
+        active_context->render_buffer = bitmap_new_syslib(screen_w, screen_h);  
+        if (!active_context->render_buffer) {  
             printf("ERROR: No se pudo crear render_buffer\n");  
             return;  
         }  
     }  
       
     // Limpiar pantalla  
-    gr_clear_as(render_buffer, 0x404040);  
+    gr_clear_as(active_context->render_buffer, 0x404040);  
       
     // Analizar rango de coordenadas para ajustar escala automáticamente  
     int min_x = INT_MAX, max_x = INT_MIN;  
@@ -3946,7 +8388,7 @@ void wld_render_2d(WLD_Map *map, int screen_w, int screen_h)
               
             while (1) {  
                 if (x1 >= 0 && x1 < screen_w && y1 >= 0 && y1 < screen_h) {  
-                    gr_put_pixel(render_buffer, x1, y1, 0xFFFFFF);  
+                    gr_put_pixel(active_context->render_buffer, x1, y1, 0xFFFFFF);  
                 }  
                   
                 if (x1 == x2 && y1 == y2) break;  
@@ -3994,8 +8436,8 @@ int64_t libmod_heightmap_render_wld_2d(INSTANCE *my, int64_t *params)
       
     wld_render_2d(&wld_map, width, height);  
       
-    // Devolver el código del render_buffer global  
-    return render_buffer ? render_buffer->code : 0;  
+    // Devolver el código del render_buffer del contexto activo  
+    return active_context->render_buffer ? active_context->render_buffer->code : 0;  
 }
 
 int64_t libmod_heightmap_test_render_buffer(INSTANCE *my, int64_t *params)  
@@ -4003,22 +8445,22 @@ int64_t libmod_heightmap_test_render_buffer(INSTANCE *my, int64_t *params)
     int width = params[0];  
     int height = params[1];  
       
-    if (!render_buffer || render_buffer->width != width || render_buffer->height != height) {  
-        if (render_buffer) bitmap_destroy(render_buffer);  
-        render_buffer = bitmap_new_syslib(width, height);  
-        if (!render_buffer) return 0;  
+    if (!active_context->render_buffer || active_context->render_buffer->width != width || active_context->render_buffer->height != height) {  
+        if (active_context->render_buffer) bitmap_destroy(active_context->render_buffer);  
+        active_context->render_buffer = bitmap_new_syslib(width, height);  
+        if (!active_context->render_buffer) return 0;  
     }  
       
     // Dibujar patrón de prueba  
     for (int y = 0; y < height; y++) {  
         for (int x = 0; x < width; x++) {  
             uint32_t color = ((x * 255) / width) | (((y * 255) / height) << 8);  
-            gr_put_pixel(render_buffer, x, y, color);  
+            gr_put_pixel(active_context->render_buffer, x, y, color);  
         }  
     }  
       
     printf("DEBUG: Patrón de prueba dibujado en %dx%d\n", width, height);  
-    return render_buffer->code;  
+    return active_context->render_buffer->code;  
 }
 
 // Función auxiliar para verificar si punto está en región  
@@ -4136,7 +8578,8 @@ void render_floor_and_ceiling(WLD_Map *map, WLD_Region *region, int col,
     
     if (ceil_start < ceil_end) {  
         GRAPH *ceil_tex = get_tex_image(region->ceil_tex);  
-        if (ceil_tex) {  
+        SPAN_COLUMN column;
+        if (ceil_tex && span_column_begin(&column, active_context->render_buffer, col, &ceil_start, &ceil_end)) {  
             for (int y = ceil_start; y < ceil_end; y++) {  
                 float y_diff = (float)y - (screen_h / 2.0f);  
                 if (fabs(y_diff) < 0.1f) continue;  
@@ -4146,8 +8589,8 @@ void render_floor_and_ceiling(WLD_Map *map, WLD_Region *region, int col,
                   
                 if (ceil_distance < 0.1f) continue;  
                   
-                float hit_x = cam_x + cos(camera.angle + ((col - screen_w/2.0f) * wld_angle_step)) * ceil_distance;  
-                float hit_y = cam_y + sin(camera.angle + ((col - screen_w/2.0f) * wld_angle_step)) * ceil_distance;  
+                float hit_x = cam_x + cos(active_context->camera.angle + ((col - screen_w/2.0f) * wld_angle_step)) * ceil_distance;  
+                float hit_y = cam_y + sin(active_context->camera.angle + ((col - screen_w/2.0f) * wld_angle_step)) * ceil_distance;  
                   
                 int tex_x = ((int)(hit_x * 0.5f)) % ceil_tex->width;  
                 int tex_y = ((int)(hit_y * 0.5f)) % ceil_tex->height;  
@@ -4161,14 +8604,14 @@ void render_floor_and_ceiling(WLD_Map *map, WLD_Region *region, int col,
                 uint8_t b = (pixel >> gPixelFormat->Bshift) & 0xFF;  
                   
                 // Fog para techo
-                float dist_factor = 1.0f - (ceil_distance / max_render_distance);
+                float dist_factor = 1.0f - (ceil_distance / active_context->max_render_distance);
                 if (dist_factor < 0.0f) dist_factor = 0.0f;
                 r = (uint8_t)(r * dist_factor);
                 g = (uint8_t)(g * dist_factor);
                 b = (uint8_t)(b * dist_factor);
                   
                 uint32_t color = SDL_MapRGB(gPixelFormat, r, g, b);  
-                gr_put_pixel(render_buffer, col, y, color);  
+                span_column_put(&column, y, color);  
             }  
         }  
     }  
@@ -4179,8 +8622,10 @@ void render_floor_and_ceiling(WLD_Map *map, WLD_Region *region, int col,
     
     if (floor_start < floor_end) {  
         GRAPH *floor_tex = get_tex_image(region->floor_tex);  
-        if (floor_tex) {  
-            for (int y = floor_start; y <= floor_end; y++) {  
+        int floor_limit = floor_end + 1;
+        SPAN_COLUMN column;
+        if (floor_tex && span_column_begin(&column, active_context->render_buffer, col, &floor_start, &floor_limit)) {  
+            for (int y = floor_start; y < floor_limit; y++) {  
                 float y_diff = (float)y - (screen_h / 2.0f);  
                 if (fabs(y_diff) < 0.1f) continue;  
                   
@@ -4189,8 +8634,8 @@ void render_floor_and_ceiling(WLD_Map *map, WLD_Region *region, int col,
                   
                 if (floor_distance < 0.1f) continue;  
                   
-                float hit_x = cam_x + cos(camera.angle + ((col - screen_w/2.0f) * wld_angle_step)) * floor_distance;  
-                float hit_y = cam_y + sin(camera.angle + ((col - screen_w/2.0f) * wld_angle_step)) * floor_distance;  
+                float hit_x = cam_x + cos(active_context->camera.angle + ((col - screen_w/2.0f) * wld_angle_step)) * floor_distance;  
+                float hit_y = cam_y + sin(active_context->camera.angle + ((col - screen_w/2.0f) * wld_angle_step)) * floor_distance;  
                   
                 int tex_x = ((int)(hit_x * 0.5f)) % floor_tex->width;  
                 int tex_y = ((int)(hit_y * 0.5f)) % floor_tex->height;  
@@ -4204,14 +8649,14 @@ void render_floor_and_ceiling(WLD_Map *map, WLD_Region *region, int col,
                 uint8_t b = (pixel >> gPixelFormat->Bshift) & 0xFF;  
                   
                 // Fog para suelo
-                float dist_factor = 1.0f - (floor_distance / max_render_distance);
+                float dist_factor = 1.0f - (floor_distance / active_context->max_render_distance);
                 if (dist_factor < 0.0f) dist_factor = 0.0f;
                 r = (uint8_t)(r * dist_factor);
                 g = (uint8_t)(g * dist_factor);
                 b = (uint8_t)(b * dist_factor);
                   
                 uint32_t color = SDL_MapRGB(gPixelFormat, r, g, b);  
-                gr_put_pixel(render_buffer, col, y, color);  
+                span_column_put(&column, y, color);  
             }  
         }  
     }  
@@ -4261,8 +8706,8 @@ void render_wall_column(WLD_Map *map, WLD_Wall *wall, int region_idx,
             float y2 = map->points[p2]->y;
             
             float angle_offset = ((float)col - screen_w/2.0f) * wld_angle_step;
-            float ray_dir_x = cos(camera.angle + angle_offset);
-            float ray_dir_y = sin(camera.angle + angle_offset);
+            float ray_dir_x = cos(active_context->camera.angle + angle_offset);
+            float ray_dir_y = sin(active_context->camera.angle + angle_offset);
             
             float hit_x = cam_x + ray_dir_x * distance;
             float hit_y = cam_y + ray_dir_y * distance;
@@ -4277,7 +8722,7 @@ void render_wall_column(WLD_Map *map, WLD_Wall *wall, int region_idx,
             }
         }
         
-        float fog_factor = 1.0f - (distance / max_render_distance);
+        float fog_factor = 1.0f - (distance / active_context->max_render_distance);
         if (fog_factor < 0.0f) fog_factor = 0.0f;
         
         render_wall_section(map, wall->texture, col, draw_top, draw_bot, wall_u, fog_factor, "WALL");
@@ -4301,21 +8746,21 @@ void render_wld(WLD_Map *map, int screen_w, int screen_h)
     if (!map || !map->loaded) return;  
       
     // Crear buffer si es necesario  
-    if (!render_buffer || render_buffer->width != screen_w || render_buffer->height != screen_h) {  
-        if (render_buffer) bitmap_destroy(render_buffer);  
-        render_buffer = bitmap_new_syslib(screen_w, screen_h);  
-        if (!render_buffer) return;  
+    if (!active_context->render_buffer || active_context->render_buffer->width != screen_w || active_context->render_buffer->height != screen_h) {  
+        if (active_context->render_buffer) bitmap_destroy(active_context->render_buffer);  
+        active_context->render_buffer = bitmap_new_syslib(screen_w, screen_h);  
+        if (!active_context->render_buffer) return;  
     }  
       
     // Skybox  
-    uint32_t sky_color = SDL_MapRGBA(gPixelFormat, sky_color_r, sky_color_g, sky_color_b, sky_color_a);  
-    gr_clear_as(render_buffer, sky_color);  
+    uint32_t sky_color = SDL_MapRGBA(gPixelFormat, active_context->sky_color_r, active_context->sky_color_g, active_context->sky_color_b, active_context->sky_color_a);  
+    gr_clear_as(active_context->render_buffer, sky_color);  
       
     // Encontrar región actual  
     int current_region = -1;  
     for (int i = 0; i < map->num_regions; i++) {  
         if (map->regions[i] && map->regions[i]->active &&        
-            point_in_region(camera.x, camera.y, i, map)) {  
+            point_in_region(active_context->camera.x, active_context->camera.y, i, map)) {  
             current_region = i;  
             break;  
         }  
@@ -4329,8 +8774,8 @@ void render_wld(WLD_Map *map, int screen_w, int screen_h)
     // Renderizar cada columna con raycasting continuo  
     for (int col = 0; col < screen_w; col++) {  
         float angle_offset = ((float)col - screen_w/2.0f) * wld_angle_step;  // Usar wld_angle_step  
-        float ray_dir_x = cos(camera.angle + angle_offset);  
-        float ray_dir_y = sin(camera.angle + angle_offset);  
+        float ray_dir_x = cos(active_context->camera.angle + angle_offset);  
+        float ray_dir_y = sin(active_context->camera.angle + angle_offset);  
           
         // Inicializar clipping vertical para esta columna
         int clip_top = 0;
@@ -4342,14 +8787,14 @@ void render_wld(WLD_Map *map, int screen_w, int screen_h)
         int max_depth = 16; // Aumentado para permitir más profundidad
         int depth = 0;  
           
-        while (depth < max_depth && total_distance < max_render_distance) {  
+        while (depth < max_depth && total_distance < active_context->max_render_distance) {  
             WLD_Wall *hit_wall;  
             int hit_region, adjacent_region;  
             float hit_distance;  
               
             scan_walls_from_region(map, current_sector,     
-                                  camera.x + ray_dir_x * total_distance,  
-                                  camera.y + ray_dir_y * total_distance,  
+                                  active_context->camera.x + ray_dir_x * total_distance,  
+                                  active_context->camera.y + ray_dir_y * total_distance,  
                                   ray_dir_x, ray_dir_y, &hit_distance,  
                                   &hit_wall, &hit_region, &adjacent_region);  
               
@@ -4359,7 +8804,7 @@ void render_wld(WLD_Map *map, int screen_w, int screen_h)
                 // Si es pared sólida, renderizar y terminar  
                 if (adjacent_region == -1) {  
                     render_wall_column(map, hit_wall, hit_region, col, screen_w, screen_h,  
-                                      camera.x, camera.y, camera.z, total_distance, clip_top, clip_bottom);  
+                                      active_context->camera.x, active_context->camera.y, active_context->camera.z, total_distance, clip_top, clip_bottom);  
                     break;  
                 }  
                   
@@ -4387,8 +8832,8 @@ void render_wld(WLD_Map *map, int screen_w, int screen_h)
                         float x2 = map->points[p2]->x;  
                         float y2 = map->points[p2]->y;  
                           
-                        float hit_x = camera.x + ray_dir_x * total_distance;  
-                        float hit_y = camera.y + ray_dir_y * total_distance;  
+                        float hit_x = active_context->camera.x + ray_dir_x * total_distance;  
+                        float hit_y = active_context->camera.y + ray_dir_y * total_distance;  
                           
                         float wall_dx = x2 - x1;  
                         float wall_dy = y2 - y1;  
@@ -4400,7 +8845,7 @@ void render_wld(WLD_Map *map, int screen_w, int screen_h)
                         }  
                     }  
                       
-                    float fog_factor = 1.0f - (total_distance / (max_render_distance * 2.0f));  
+                    float fog_factor = 1.0f - (total_distance / (active_context->max_render_distance * 2.0f));  
                     if (fog_factor < 0.3f) fog_factor = 0.3f;  
                     if (fog_factor > 1.0f) fog_factor = 1.0f;  
                       
@@ -4408,7 +8853,7 @@ void render_wld(WLD_Map *map, int screen_w, int screen_h)
                     render_complex_wall_section(map, hit_wall, map->regions[hit_region],       
                                                hit_region, col, screen_w, screen_h,  
                                                0, screen_h, wall_u, fog_factor,  
-                                               camera.x, camera.y, camera.z, total_distance, clip_top, clip_bottom);  
+                                               active_context->camera.x, active_context->camera.y, active_context->camera.z, total_distance, clip_top, clip_bottom);  
                       
                     // CALCULAR NUEVOS CLIPS PARA EL SIGUIENTE SECTOR
                     WLD_Region *current = map->regions[hit_region];
@@ -4422,8 +8867,8 @@ void render_wld(WLD_Map *map, int screen_w, int screen_h)
                     // Proyectar a pantalla
                     float t1 = 300.0f / total_distance;
                     
-                    float t_floor = (camera.z - open_floor);
-                    float t_ceil = (camera.z - open_ceil);
+                    float t_floor = (active_context->camera.z - open_floor);
+                    float t_ceil = (active_context->camera.z - open_ceil);
                     
                     int screen_floor = (screen_h/2.0f) + t_floor * t1;
                     int screen_ceil = (screen_h/2.0f) + t_ceil * t1;
@@ -4531,7 +8976,8 @@ int64_t libmod_heightmap_render_wld_3d(INSTANCE *my, int64_t *params) {
     }  
       
     render_wld(&wld_map, width, height);  
-    return render_buffer ? render_buffer->code : 0;  
+    span_mark_dirty(active_context->render_buffer);
+    return active_context->render_buffer ? active_context->render_buffer->code : 0;  
 }
 
 
@@ -5058,8 +9504,15 @@ void render_wall_section(WLD_Map *map, int texture_index, int col,
     if (tex_x >= tex_graph->width) tex_x = tex_graph->width - 1;  
       
     float wall_height = y_end - y_start;  
+
+    // Solo se recorre la parte visible; v sigue calculándose sobre el tramo completo
+    SPAN_COLUMN column;
+    int draw_start = y_start;
+    int draw_end = y_end;
+    if (!span_column_begin(&column, active_context->render_buffer, col, &draw_start, &draw_end))
+        return;
       
-    for (int y = y_start; y < y_end; y++) {  
+    for (int y = draw_start; y < draw_end; y++) {  
         float v = (float)(y - y_start) / wall_height;  
         int tex_y = (int)(v * tex_graph->height) % tex_graph->height;  
           
@@ -5074,7 +9527,7 @@ void render_wall_section(WLD_Map *map, int texture_index, int col,
         b = (uint8_t)(b * fog_factor);  
           
         uint32_t color = SDL_MapRGB(gPixelFormat, r, g, b);  
-        gr_put_pixel(render_buffer, col, y, color);  
+        span_column_put(&column, y, color);  
     }  
 }
 
@@ -5150,8 +9603,8 @@ void render_complex_wall_section(WLD_Map *map, WLD_Wall *wall, WLD_Region *regio
                 
             // Calcular punto de impacto del rayo    
             float angle_offset = ((float)col - screen_w/2.0f) * 0.003f;    
-            float ray_dir_x = cos(camera.angle + angle_offset);    
-            float ray_dir_y = sin(camera.angle + angle_offset);    
+            float ray_dir_x = cos(active_context->camera.angle + angle_offset);    
+            float ray_dir_y = sin(active_context->camera.angle + angle_offset);    
                 
             float hit_x = cam_x + ray_dir_x * hit_distance;    
             float hit_y = cam_y + ray_dir_y * hit_distance;    
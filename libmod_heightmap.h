@@ -159,6 +159,26 @@ typedef enum {
     MAP_TYPE_HEIGHTMAP = 0,  // Terreno exterior voxelspace               
 } MAP_TYPE;      
                
+// Niveles de la pirámide de alturas máximas: el nivel 0 agrupa bloques de
+// 4x4 celdas y cada nivel siguiente duplica el lado del bloque
+#define HEIGHT_PYRAMID_BASE_SHIFT 2
+#define HEIGHT_PYRAMID_MAX_LEVELS 14
+
+// Disposición en bloques de height_cache y texel_cache: bloques de 8x8 o
+// 16x16 texels en orden Z dentro de supertexelas de 8x8 bloques
+#define TEXEL_LAYOUT_ROWS        0
+#define TEXEL_SUPER_SHIFT        3
+
+// Texel del terreno para el render CPU: la altura cuantizada, la del texel de
+// su derecha y el color ya sombreado en gPixelFormat. Una muestra bilineal lee
+// dos registros (su fila y la siguiente) y con ellos tiene las cuatro esquinas
+// y el color; los 32 bits bajos son el par de alturas que recogen los gathers
+typedef struct {
+    uint16_t height;
+    uint16_t height_right;     // Altura de (x + 1, y); en la última columna, la propia
+    uint32_t color;
+} TERRAIN_TEXEL;
+
 typedef struct {                        
     int64_t id;                  
     MAP_TYPE type;  // MAP_TYPE_SECTOR para DMP2      
@@ -168,8 +188,39 @@ typedef struct {
     GRAPH *texturemap;                  
     int64_t width;                  
     int64_t height;                  
-    float *height_cache;                  
+    uint16_t *height_cache;    // Alturas cuantizadas: altura = height_offset + valor * height_scale.
+                               // NULL una vez hecha texel_cache, que las guarda, salvo si apunta a un .hmt
+    float height_scale;
+    float height_offset;
+    int height_bits;           // Precisión de la fuente: 8 (canal rojo) o 16 (PNG 16 bits, .r16, rojo+verde)
     int cache_valid;                      
+
+    // Disposición de height_cache y texel_cache (ver texel_layout_set):
+    // el texel (x, y) está en texel_x[x] + texel_y[y]
+    uint32_t *texel_x;
+    uint32_t *texel_y;
+    size_t texel_count;        // Texels reservados, incluido el relleno de las supertexelas
+    int texel_brick;           // TEXEL_LAYOUT_ROWS (por filas), 8 o 16
+
+    // Pirámide de alturas máximas para saltar zonas vacías (ver build_height_pyramid)
+    float *height_max[HEIGHT_PYRAMID_MAX_LEVELS];
+    int height_max_width[HEIGHT_PYRAMID_MAX_LEVELS];
+    int height_max_height[HEIGHT_PYRAMID_MAX_LEVELS];
+    int height_max_levels;
+
+    // Fichero de terreno .hmt mapeado en memoria (ver load_terrain_file): height_cache,
+    // la pirámide y file_colors pueden apuntar dentro
+    const uint8_t *file_data;
+    size_t file_size;
+    const uint8_t *file_colors;     // RGBA por texel y por filas; NULL si el fichero no trae color
+
+    // Altura y color del terreno juntos por celda para el render CPU (ver build_texel_cache)
+    TERRAIN_TEXEL *texel_cache;
+    GRAPH *texel_cache_texture;     // Textura con la que se generó
+    int texel_cache_light;          // light_intensity con la que se generó
+
+    // Paginación de texel_cache por supertexelas (ver HEIGHTMAP_SET_PAGING); NULL si está entera
+    struct TERRAIN_PAGER *pager;
                       
 } HEIGHTMAP;        
     
@@ -199,6 +250,7 @@ typedef struct {
 // Constantes de proyección                
 #define PROJECTION_HEIGHT_SCALE 300.0f                
 #define PROJECTION_CENTER_Y 120.0f                
+#define PROJECTION_REFERENCE_HEIGHT 240.0f
                 
 // Constantes de calidad de renderizado                
 #define QUALITY_STEP_NEAR 0.2f                
@@ -225,6 +277,7 @@ typedef struct {
 typedef struct {                  
     int screen_x, screen_y;                  
     float distance;            
+    float ground_distance;           // Distancia horizontal, comparable con la del raycast
     float distance_scale;            
     int scaled_width, scaled_height;                  
     uint8_t alpha;                  
@@ -243,7 +296,6 @@ typedef struct {
       
 /* Variables globales del módulo */                
 extern HEIGHTMAP heightmaps[MAX_HEIGHTMAPS];                
-extern CAMERA_3D camera;                
 extern int64_t next_heightmap_id;                
 
 // Añadir antes de las funciones existentes  
@@ -275,10 +327,6 @@ extern int64_t libmod_heightmap_render_voxelspace_gpu(INSTANCE *my, int64_t *par
 extern int64_t load_tex_file(INSTANCE *my, int64_t *params);    
 extern GRAPH *get_tex_image(int index);      
       
-// Declaraciones forward para skybox                
-static uint32_t sample_sky_texture(float screen_x, float screen_y, float camera_angle, float camera_pitch, float time);                
-static void render_skybox(float camera_angle, float camera_pitch, float time, int quality_step);              
-      
 // Declaraciones forward para efectos atmosféricos                
 static void render_atmospheric_particles(float time, int quality_step, HEIGHTMAP *hm);               
 static float calculate_atmospheric_lighting(float distance, float height);                
@@ -22,9 +22,25 @@ DLSYSFUNCS __bgdexport(libmod_heightmap, functions_exports)[] = {
   
     // Funciones existentes del heightmap  
     FUNC("HEIGHTMAP_LOAD", "S", TYPE_INT, libmod_heightmap_load),  
+    FUNC("HEIGHTMAP_LOAD_RG", "S", TYPE_INT, libmod_heightmap_load_rg),
+    FUNC("HEIGHTMAP_SET_HEIGHT_RANGE", "IFF", TYPE_INT, libmod_heightmap_set_height_range),
+    FUNC("HEIGHTMAP_SET_TILED_LAYOUT", "II", TYPE_INT, libmod_heightmap_set_tiled_layout),
+    FUNC("HEIGHTMAP_SET_PAGING", "III", TYPE_INT, libmod_heightmap_set_paging),
     FUNC("HEIGHTMAP_RENDER_3D", "III", TYPE_INT, libmod_heightmap_render_voxelspace),  
     FUNC("HEIGHTMAP_RENDER_3D_GPU", "III", TYPE_INT, libmod_heightmap_render_voxelspace_gpu),
     FUNC("HEIGHTMAP_SET_RENDER_RESOLUTION", "II", TYPE_INT, libmod_heightmap_set_render_resolution), 
+    FUNC("HEIGHTMAP_SET_RENDER_THREADS", "I", TYPE_INT, libmod_heightmap_set_render_threads),
+    FUNC("HEIGHTMAP_SET_RENDER_SIMD", "I", TYPE_INT, libmod_heightmap_set_render_simd),
+    FUNC("HEIGHTMAP_SET_RAY_TRAVERSAL", "I", TYPE_INT, libmod_heightmap_set_ray_traversal),
+    FUNC("HEIGHTMAP_SET_REPROJECTION", "I", TYPE_INT, libmod_heightmap_set_reprojection),
+    FUNC("HEIGHTMAP_SET_INTERLACED", "I", TYPE_INT, libmod_heightmap_set_interlaced),
+    FUNC("HEIGHTMAP_SET_LOD_ERROR", "F", TYPE_INT, libmod_heightmap_set_lod_error),
+    FUNC("HEIGHTMAP_SET_FRAME_BUDGET", "FI", TYPE_INT, libmod_heightmap_set_frame_budget),
+    FUNC("HEIGHTMAP_GET_QUALITY_LEVEL", "", TYPE_INT, libmod_heightmap_get_quality_level),
+    FUNC("HEIGHTMAP_CREATE_CONTEXT", "II", TYPE_INT, libmod_heightmap_create_context),
+    FUNC("HEIGHTMAP_SELECT_CONTEXT", "I", TYPE_INT, libmod_heightmap_select_context),
+    FUNC("HEIGHTMAP_DESTROY_CONTEXT", "I", TYPE_INT, libmod_heightmap_destroy_context),
+    FUNC("HEIGHTMAP_RENDER_VIEWS", "IPIP", TYPE_INT, libmod_heightmap_render_views),
     FUNC("HEIGHTMAP_SET_CAMERA", "IIIIII", TYPE_INT, libmod_heightmap_set_camera),  
     FUNC("HEIGHTMAP_SET_LIGHT", "I", TYPE_INT, libmod_heightmap_set_light),  
     FUNC("HEIGHTMAP_SET_WATER_LEVEL", "I", TYPE_INT, libmod_heightmap_set_water_level),  
@@ -0,0 +1,397 @@
+// terrain.c - Conversor de heightmaps al fichero de terreno .hmt (ver terrain_format.h)
+//
+// Uso: terrain <alturas.png|alturas.r16> <salida.hmt> [opciones]
+//   -rg                 PNG de 8 bits con la altura en rojo (byte alto) y verde (byte bajo)
+//   -color textura.png  Guarda el color del terreno (la textura repetida en mosaico)
+//   -range min max      Alturas entre min y max (por defecto 0-255)
+//   -nopyramid          No guarda la pirámide de alturas máximas
+//
+// Compilar: gcc -O2 terrain.c -o terrain -lpng -lm
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <math.h>
+#include <png.h>
+#include "../terrain_format.h"
+
+// Deben coincidir con libmod_heightmap.h
+#define HEIGHT_PYRAMID_BASE_SHIFT 2
+#define HEIGHT_PYRAMID_MAX_LEVELS 14
+
+typedef struct {
+    int width;
+    int height;
+    int bits;
+    uint16_t *values;
+} HEIGHTS;
+
+static int has_extension(const char *filename, const char *extension) {
+    size_t length = strlen(filename);
+    size_t ext_length = strlen(extension);
+    return length >= ext_length && strcasecmp(filename + length - ext_length, extension) == 0;
+}
+
+/* PNG a muestras de 8 o 16 bits por canal y sin alfa. El gris se queda en un
+   canal salvo con gray_to_rgb; *channels dice con cuántos quedó (1 o 3) */
+static int load_png(const char *filename, int keep_16, int gray_to_rgb, uint8_t **pixels,
+                    int *width, int *height, int *bit_depth, int *channels) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        printf("Error: No se pudo abrir PNG: %s\n", filename);
+        return 0;
+    }
+
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png ? png_create_info_struct(png) : NULL;
+    if (!png || !info) {
+        png_destroy_read_struct(&png, NULL, NULL);
+        fclose(fp);
+        return 0;
+    }
+
+    png_bytep *rows = NULL;
+    *pixels = NULL;
+    if (setjmp(png_jmpbuf(png))) {
+        printf("Error: PNG no válido: %s\n", filename);
+        free(rows);
+        free(*pixels);
+        *pixels = NULL;
+        png_destroy_read_struct(&png, &info, NULL);
+        fclose(fp);
+        return 0;
+    }
+
+    png_init_io(png, fp);
+    png_read_info(png, info);
+
+    *width = png_get_image_width(png, info);
+    *height = png_get_image_height(png, info);
+    png_byte color_type = png_get_color_type(png, info);
+    png_byte depth = png_get_bit_depth(png, info);
+
+    if (depth == 16 && !keep_16) png_set_strip_16(png);
+    if (color_type == PNG_COLOR_TYPE_PALETTE) png_set_palette_to_rgb(png);
+    if (color_type == PNG_COLOR_TYPE_GRAY && depth < 8) png_set_expand_gray_1_2_4_to_8(png);
+    if (gray_to_rgb && (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA))
+        png_set_gray_to_rgb(png);
+    if (color_type & PNG_COLOR_MASK_ALPHA) png_set_strip_alpha(png);
+    png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+
+    *bit_depth = png_get_bit_depth(png, info);
+    *channels = png_get_channels(png, info);
+    size_t row_bytes = png_get_rowbytes(png, info);
+    *pixels = malloc(row_bytes * (*height));
+    rows = malloc(sizeof(png_bytep) * (*height));
+    if (!*pixels || !rows)
+        png_error(png, "sin memoria");
+
+    for (int y = 0; y < *height; y++)
+        rows[y] = *pixels + row_bytes * y;
+    png_read_image(png, rows);
+
+    free(rows);
+    png_destroy_read_struct(&png, &info, NULL);
+    fclose(fp);
+    return 1;
+}
+
+// Tamaño del fichero en 64 bits; long solo tiene 32 en Windows
+static int64_t file_size(FILE *f) {
+#ifdef _WIN32
+    _fseeki64(f, 0, SEEK_END);
+    int64_t size = _ftelli64(f);
+    _fseeki64(f, 0, SEEK_SET);
+#else
+    fseeko(f, 0, SEEK_END);
+    int64_t size = (int64_t)ftello(f);
+    fseeko(f, 0, SEEK_SET);
+#endif
+    return size;
+}
+
+// .r16: alturas de 16 bits little-endian sin cabecera; el mapa es cuadrado
+static int load_r16(const char *filename, HEIGHTS *heights) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        printf("Error: No se pudo abrir %s\n", filename);
+        return 0;
+    }
+
+    int64_t size = file_size(f);
+    int64_t side = (int64_t)sqrt((double)(size / 2));
+    while (side * side * 2 < size)
+        side++;
+    if (side < 2 || side * side * 2 != size) {
+        printf("Error: %s no es un .r16 cuadrado (%lld bytes)\n", filename, (long long)size);
+        fclose(f);
+        return 0;
+    }
+
+    uint8_t *bytes = malloc((size_t)size);
+    heights->values = malloc((size_t)size);
+    if (!bytes || !heights->values || fread(bytes, 1, (size_t)size, f) != (size_t)size) {
+        printf("Error: No se pudo leer %s\n", filename);
+        free(bytes);
+        fclose(f);
+        return 0;
+    }
+    fclose(f);
+
+    for (size_t i = 0; i < (size_t)(side * side); i++)
+        heights->values[i] = (uint16_t)(bytes[i * 2] | (bytes[i * 2 + 1] << 8));
+    free(bytes);
+
+    heights->width = heights->height = (int)side;
+    heights->bits = 16;
+    return 1;
+}
+
+// Mismos valores que build_height_cache: PNG de 16 bits primer canal, de 8 bits
+// canal rojo, o rojo (byte alto) y verde (byte bajo) con -rg. En gris el único
+// canal hace de rojo y de verde
+static int load_heights(const char *filename, int rg_encoded, HEIGHTS *heights) {
+    if (has_extension(filename, ".r16"))
+        return load_r16(filename, heights);
+
+    uint8_t *pixels;
+    int depth, channels;
+    if (!load_png(filename, !rg_encoded, 0, &pixels, &heights->width, &heights->height, &depth, &channels))
+        return 0;
+
+    size_t count = (size_t)heights->width * heights->height;
+    heights->values = malloc(count * sizeof(uint16_t));
+    if (!heights->values) {
+        free(pixels);
+        return 0;
+    }
+
+    size_t stride = (size_t)channels * (depth == 16 ? 2 : 1);
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t *pixel = pixels + i * stride;
+        if (depth == 16)
+            heights->values[i] = (uint16_t)((pixel[0] << 8) | pixel[1]);
+        else if (rg_encoded)
+            heights->values[i] = (uint16_t)((pixel[0] << 8) | pixel[channels > 1 ? 1 : 0]);
+        else
+            heights->values[i] = pixel[0];
+    }
+    heights->bits = (depth == 16 || rg_encoded) ? 16 : 8;
+
+    free(pixels);
+    return 1;
+}
+
+// Textura repetida en mosaico hasta el tamaño del mapa, en RGBA
+static uint8_t *load_colors(const char *filename, int width, int height) {
+    uint8_t *pixels;
+    int tex_w, tex_h, depth, channels;
+    if (!load_png(filename, 0, 1, &pixels, &tex_w, &tex_h, &depth, &channels))
+        return NULL;
+
+    uint8_t *colors = malloc((size_t)width * height * 4);
+    if (colors) {
+        for (int y = 0; y < height; y++) {
+            const uint8_t *row = pixels + (size_t)(y % tex_h) * tex_w * 3;
+            for (int x = 0; x < width; x++) {
+                const uint8_t *src = row + (x % tex_w) * 3;
+                uint8_t *dst = colors + ((size_t)y * width + x) * 4;
+                dst[0] = src[0];
+                dst[1] = src[1];
+                dst[2] = src[2];
+                dst[3] = 0xFF;
+            }
+        }
+    }
+
+    free(pixels);
+    return colors;
+}
+
+/* Pirámide de alturas máximas con las mismas reglas que build_height_pyramid:
+   el nivel 0 guarda el máximo de cada bloque de 4x4 celdas incluida la fila y
+   columna vecinas, ya convertido a altura del mundo */
+static int build_pyramid(const HEIGHTS *heights, float scale, float offset,
+                         float **levels, int *widths, int *level_heights) {
+    int cells_w = heights->width - 1;
+    int cells_h = heights->height - 1;
+    int block = 1 << HEIGHT_PYRAMID_BASE_SHIFT;
+    int level_w = (cells_w + block - 1) / block;
+    int level_h = (cells_h + block - 1) / block;
+
+    float *base = malloc((size_t)level_w * level_h * sizeof(float));
+    if (!base)
+        return 0;
+
+    for (int by = 0; by < level_h; by++) {
+        int y0 = by * block;
+        int y1 = (y0 + block < cells_h) ? y0 + block : cells_h;
+        for (int bx = 0; bx < level_w; bx++) {
+            int x0 = bx * block;
+            int x1 = (x0 + block < cells_w) ? x0 + block : cells_w;
+            uint16_t max_height = heights->values[(size_t)y0 * heights->width + x0];
+            for (int y = y0; y <= y1; y++) {
+                const uint16_t *row = heights->values + (size_t)y * heights->width;
+                for (int x = x0; x <= x1; x++)
+                    if (row[x] > max_height)
+                        max_height = row[x];
+            }
+            float value = max_height;
+            base[by * level_w + bx] = offset + value * scale;
+        }
+    }
+
+    levels[0] = base;
+    widths[0] = level_w;
+    level_heights[0] = level_h;
+    int count = 1;
+
+    while (count < HEIGHT_PYRAMID_MAX_LEVELS && (level_w > 1 || level_h > 1)) {
+        const float *src = levels[count - 1];
+        int src_w = level_w, src_h = level_h;
+        level_w = (src_w + 1) / 2;
+        level_h = (src_h + 1) / 2;
+
+        float *dst = malloc((size_t)level_w * level_h * sizeof(float));
+        if (!dst)
+            break;
+
+        for (int y = 0; y < level_h; y++) {
+            int sy0 = y * 2, sy1 = (y * 2 + 1 < src_h) ? y * 2 + 1 : y * 2;
+            for (int x = 0; x < level_w; x++) {
+                int sx0 = x * 2, sx1 = (x * 2 + 1 < src_w) ? x * 2 + 1 : x * 2;
+                float a = fmaxf(src[sy0 * src_w + sx0], src[sy0 * src_w + sx1]);
+                float b = fmaxf(src[sy1 * src_w + sx0], src[sy1 * src_w + sx1]);
+                dst[y * level_w + x] = fmaxf(a, b);
+            }
+        }
+
+        levels[count] = dst;
+        widths[count] = level_w;
+        level_heights[count] = level_h;
+        count++;
+    }
+    return count;
+}
+
+/* Escribe una sección alineada a TERRAIN_FILE_ALIGN y devuelve su posición.
+   *written lleva la cuenta de los bytes escritos en vez de preguntar a ftell,
+   que devuelve long y se queda en 2 GB en Windows */
+static uint64_t write_section(FILE *f, uint64_t *written, const void *data, size_t bytes) {
+    static const uint8_t zeros[TERRAIN_FILE_ALIGN];
+    uint64_t padding = (TERRAIN_FILE_ALIGN - *written % TERRAIN_FILE_ALIGN) % TERRAIN_FILE_ALIGN;
+    uint64_t position = *written + padding;
+    fwrite(zeros, 1, (size_t)padding, f);
+    fwrite(data, 1, bytes, f);
+    *written = position + bytes;
+    return position;
+}
+
+int main(int argc, char **argv) {
+    printf("=== Conversor de terreno .hmt ===\n");
+
+    if (argc < 3) {
+        printf("Uso: %s <alturas.png|alturas.r16> <salida.hmt> [-rg] [-color textura.png] [-range min max] [-nopyramid]\n", argv[0]);
+        return 1;
+    }
+
+    const char *input = argv[1];
+    const char *output = argv[2];
+    const char *color_file = NULL;
+    int rg_encoded = 0, with_pyramid = 1, with_range = 0;
+    float range_min = 0.0f, range_max = 0.0f;
+
+    for (int i = 3; i < argc; i++) {
+        if (!strcmp(argv[i], "-rg")) {
+            rg_encoded = 1;
+        } else if (!strcmp(argv[i], "-color") && i + 1 < argc) {
+            color_file = argv[++i];
+        } else if (!strcmp(argv[i], "-range") && i + 2 < argc) {
+            range_min = (float)atof(argv[++i]);
+            range_max = (float)atof(argv[++i]);
+            with_range = 1;
+        } else if (!strcmp(argv[i], "-nopyramid")) {
+            with_pyramid = 0;
+        } else {
+            printf("Error: opción desconocida %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    HEIGHTS heights = {0};
+    if (!load_heights(input, rg_encoded, &heights))
+        return 1;
+    if (heights.width < 2 || heights.height < 2) {
+        printf("Error: %s es demasiado pequeño\n", input);
+        return 1;
+    }
+
+    float levels_max = (float)((1 << heights.bits) - 1);
+    float scale = 255.0f / levels_max, offset = 0.0f;
+    if (with_range) {
+        if (!(range_max > range_min)) {
+            printf("Error: la altura máxima debe ser mayor que la mínima\n");
+            return 1;
+        }
+        offset = range_min;
+        scale = (range_max - range_min) / levels_max;
+    }
+
+    uint8_t *colors = NULL;
+    if (color_file && !(colors = load_colors(color_file, heights.width, heights.height)))
+        return 1;
+
+    float *levels[HEIGHT_PYRAMID_MAX_LEVELS];
+    int widths[HEIGHT_PYRAMID_MAX_LEVELS], level_heights[HEIGHT_PYRAMID_MAX_LEVELS];
+    int level_count = with_pyramid ? build_pyramid(&heights, scale, offset, levels, widths, level_heights) : 0;
+
+    FILE *f = fopen(output, "wb");
+    if (!f) {
+        printf("Error: No se pudo crear %s\n", output);
+        return 1;
+    }
+
+    TERRAIN_FILE_HEADER header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TERRAIN_FILE_MAGIC, 4);
+    header.version = TERRAIN_FILE_VERSION;
+    header.width = (uint32_t)heights.width;
+    header.height = (uint32_t)heights.height;
+    header.height_bits = (uint32_t)heights.bits;
+    header.height_scale = scale;
+    header.height_offset = offset;
+    fwrite(&header, sizeof(header), 1, f);
+    uint64_t written = sizeof(header);
+
+    size_t texels = (size_t)heights.width * heights.height;
+    header.heights_offset = write_section(f, &written, heights.values, texels * sizeof(uint16_t));
+    if (colors)
+        header.colors_offset = write_section(f, &written, colors, texels * 4);
+    if (level_count > 0) {
+        header.pyramid_shift = HEIGHT_PYRAMID_BASE_SHIFT;
+        header.pyramid_levels = (uint32_t)level_count;
+        for (int level = 0; level < level_count; level++)
+            header.pyramid_offset[level] = write_section(f, &written, levels[level],
+                                                         (size_t)widths[level] * level_heights[level] * sizeof(float));
+    }
+
+    // Relleno final para que la última sección ocupe páginas completas
+    write_section(f, &written, NULL, 0);
+    fseek(f, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, f);
+    int ok = !ferror(f);
+    fclose(f);
+
+    printf("%s: %dx%d, %d bits, alturas %.2f-%.2f%s, %d niveles de pirámide\n", output,
+           heights.width, heights.height, heights.bits, offset, offset + levels_max * scale,
+           colors ? ", con color" : "", level_count);
+
+    for (int level = 0; level < level_count; level++)
+        free(levels[level]);
+    free(colors);
+    free(heights.values);
+    return ok ? 0 : 1;
+}
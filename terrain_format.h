@@ -0,0 +1,45 @@
+// terrain_format.h - Fichero binario de terreno (.hmt) de libmod_heightmap
+//
+// Lo genera la herramienta terrain/terrain.c y HEIGHTMAP_LOAD lo mapea en
+// memoria y usa sus secciones en su sitio, sin copiarlas. Todo en little-endian.
+// Cada sección empieza en un múltiplo de TERRAIN_FILE_ALIGN.
+//
+//   heights  width * height uint16_t, por filas
+//   colors   width * height RGBA8 por filas, ya repetida la textura (opcional)
+//   pyramid  niveles de la pirámide de alturas máximas en float (opcional): el
+//            nivel 0 tiene ceil((width - 1) / bloque) x ceil((height - 1) / bloque)
+//            valores con bloque = 1 << pyramid_shift, cada nivel siguiente la
+//            mitad redondeando hacia arriba, hasta 1x1 o TERRAIN_FILE_MAX_LEVELS.
+//            Los valores ya llevan aplicados height_scale y height_offset.
+#ifndef __TERRAIN_FORMAT_H
+#define __TERRAIN_FORMAT_H
+
+#include <stdint.h>
+
+#define TERRAIN_FILE_MAGIC      "HMT1"
+#define TERRAIN_FILE_VERSION    1
+#define TERRAIN_FILE_ALIGN      4096
+#define TERRAIN_FILE_MAX_LEVELS 16
+
+#pragma pack(push, 1)
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t height_bits;       // 8 o 16
+    float height_scale;         // altura = height_offset + valor * height_scale
+    float height_offset;
+    uint32_t pyramid_shift;     // 0 si el fichero no trae pirámide
+    uint32_t pyramid_levels;
+    uint32_t reserved0;
+    uint64_t heights_offset;
+    uint64_t colors_offset;     // 0 si el fichero no trae color
+    uint64_t pyramid_offset[TERRAIN_FILE_MAX_LEVELS];
+    uint8_t reserved[72];
+} TERRAIN_FILE_HEADER;
+
+#pragma pack(pop)
+
+#endif